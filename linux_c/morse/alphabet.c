@@ -0,0 +1,542 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Non-Latin alphabets for UTF-8 text, selected with -a <name>.
+ *
+ * ASCII always goes through the morse_code[] byte table.  Anything else
+ * is decoded from UTF-8, folded to the canonical letter of the alphabet
+ * (upper case, final forms to their normal form, hiragana to katakana,
+ * voiced kana to the plain kana plus the dakuten sign) and looked up by
+ * code point in the tables below, which must stay sorted by code point.
+ * The Latin extensions are always available, the other alphabets are
+ * tried first when selected.
+ *
+ * For decoding every alphabet also gets an index sorted by code, built
+ * once by alphabet_init().  Latin text keeps decoding the ASCII letters
+ * first and only uses the extensions for codes the ASCII table lacks;
+ * with another alphabet selected its letters win over the Latin ones.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "morse.h"
+
+#define countof(a) (sizeof(a) / sizeof((a)[0]))
+
+// ITU and common national extensions, upper case only.
+static struct morse_letter latin_letters[] = {
+    { 0x00C0, ".--.-" },	/* À */
+    { 0x00C4, ".-.-" },		/* Ä */
+    { 0x00C5, ".--.-" },	/* Å */
+    { 0x00C6, ".-.-" },		/* Æ */
+    { 0x00C7, "-.-.." },	/* Ç */
+    { 0x00C8, ".-..-" },	/* È */
+    { 0x00C9, "..-.." },	/* É */
+    { 0x00D0, "..--." },	/* Ð */
+    { 0x00D1, "--.--" },	/* Ñ */
+    { 0x00D6, "---." },		/* Ö */
+    { 0x00D8, "---." },		/* Ø */
+    { 0x00DC, "..--" },		/* Ü */
+    { 0x00DE, ".--.." },	/* Þ */
+    { 0x0108, "-.-.." },	/* Ĉ */
+    { 0x011C, "--.-." },	/* Ĝ */
+    { 0x0124, "----" },		/* Ĥ */
+    { 0x0134, ".---." },	/* Ĵ */
+    { 0x015C, "...-." },	/* Ŝ */
+    { 0x016C, "..--" },		/* Ŭ */
+    { 0x0179, "--..-." },	/* Ź */
+    { 0x017B, "--..-" },	/* Ż */
+};
+
+// Russian
+static struct morse_letter cyrillic_letters[] = {
+    { 0x0410, ".-" },		/* А */
+    { 0x0411, "-..." },		/* Б */
+    { 0x0412, ".--" },		/* В */
+    { 0x0413, "--." },		/* Г */
+    { 0x0414, "-.." },		/* Д */
+    { 0x0415, "." },		/* Е, Ё */
+    { 0x0416, "...-" },		/* Ж */
+    { 0x0417, "--.." },		/* З */
+    { 0x0418, ".." },		/* И */
+    { 0x0419, ".---" },		/* Й */
+    { 0x041A, "-.-" },		/* К */
+    { 0x041B, ".-.." },		/* Л */
+    { 0x041C, "--" },		/* М */
+    { 0x041D, "-." },		/* Н */
+    { 0x041E, "---" },		/* О */
+    { 0x041F, ".--." },		/* П */
+    { 0x0420, ".-." },		/* Р */
+    { 0x0421, "..." },		/* С */
+    { 0x0422, "-" },		/* Т */
+    { 0x0423, "..-" },		/* У */
+    { 0x0424, "..-." },		/* Ф */
+    { 0x0425, "...." },		/* Х */
+    { 0x0426, "-.-." },		/* Ц */
+    { 0x0427, "---." },		/* Ч */
+    { 0x0428, "----" },		/* Ш */
+    { 0x0429, "--.-" },		/* Щ */
+    { 0x042A, "--.--" },	/* Ъ */
+    { 0x042B, "-.--" },		/* Ы */
+    { 0x042C, "-..-" },		/* Ь */
+    { 0x042D, "..-.." },	/* Э */
+    { 0x042E, "..--" },		/* Ю */
+    { 0x042F, ".-.-" },		/* Я */
+};
+
+static struct morse_letter greek_letters[] = {
+    { 0x0391, ".-" },		/* Α */
+    { 0x0392, "-..." },		/* Β */
+    { 0x0393, "--." },		/* Γ */
+    { 0x0394, "-.." },		/* Δ */
+    { 0x0395, "." },		/* Ε */
+    { 0x0396, "--.." },		/* Ζ */
+    { 0x0397, "...." },		/* Η */
+    { 0x0398, "-.-." },		/* Θ */
+    { 0x0399, ".." },		/* Ι */
+    { 0x039A, "-.-" },		/* Κ */
+    { 0x039B, ".-.." },		/* Λ */
+    { 0x039C, "--" },		/* Μ */
+    { 0x039D, "-." },		/* Ν */
+    { 0x039E, "-..-" },		/* Ξ */
+    { 0x039F, "---" },		/* Ο */
+    { 0x03A0, ".--." },		/* Π */
+    { 0x03A1, ".-." },		/* Ρ */
+    { 0x03A3, "..." },		/* Σ */
+    { 0x03A4, "-" },		/* Τ */
+    { 0x03A5, "-.--" },		/* Υ */
+    { 0x03A6, "..-." },		/* Φ */
+    { 0x03A7, "----" },		/* Χ */
+    { 0x03A8, "--.-" },		/* Ψ */
+    { 0x03A9, ".--" },		/* Ω */
+};
+
+static struct morse_letter hebrew_letters[] = {
+    { 0x05D0, ".-" },		/* א */
+    { 0x05D1, "-..." },		/* ב */
+    { 0x05D2, "--." },		/* ג */
+    { 0x05D3, "-.." },		/* ד */
+    { 0x05D4, "---" },		/* ה */
+    { 0x05D5, "." },		/* ו */
+    { 0x05D6, "--.." },		/* ז */
+    { 0x05D7, "...." },		/* ח */
+    { 0x05D8, "..-" },		/* ט */
+    { 0x05D9, ".." },		/* י */
+    { 0x05DB, "-.-" },		/* כ */
+    { 0x05DC, ".-.." },		/* ל */
+    { 0x05DE, "--" },		/* מ */
+    { 0x05E0, "-." },		/* נ */
+    { 0x05E1, "-.-." },		/* ס */
+    { 0x05E2, ".---" },		/* ע */
+    { 0x05E4, ".--." },		/* פ */
+    { 0x05E6, ".--" },		/* צ */
+    { 0x05E7, "--.-" },		/* ק */
+    { 0x05E8, ".-." },		/* ר */
+    { 0x05E9, "..." },		/* ש */
+    { 0x05EA, "-" },		/* ת */
+};
+
+// Japanese Wabun code, katakana.
+static struct morse_letter wabun_letters[] = {
+    { 0x3001, ".-.-.-" },	/* 、 */
+    { 0x3002, ".-.-.." },	/* 。 */
+    { 0x309B, ".." },		/* ゛ dakuten */
+    { 0x309C, "..--." },	/* ゜ handakuten */
+    { 0x30A2, "--.--" },	/* ア */
+    { 0x30A4, ".-" },		/* イ */
+    { 0x30A6, "..-" },		/* ウ */
+    { 0x30A8, "-.---" },	/* エ */
+    { 0x30AA, ".-..." },	/* オ */
+    { 0x30AB, ".-.." },		/* カ */
+    { 0x30AD, "-.-.." },	/* キ */
+    { 0x30AF, "...-" },		/* ク */
+    { 0x30B1, "-.--" },		/* ケ */
+    { 0x30B3, "----" },		/* コ */
+    { 0x30B5, "-.-.-" },	/* サ */
+    { 0x30B7, "--.-." },	/* シ */
+    { 0x30B9, "---.-" },	/* ス */
+    { 0x30BB, ".---." },	/* セ */
+    { 0x30BD, "---." },		/* ソ */
+    { 0x30BF, "-." },		/* タ */
+    { 0x30C1, "..-." },		/* チ */
+    { 0x30C4, ".--." },		/* ツ */
+    { 0x30C6, ".-.--" },	/* テ */
+    { 0x30C8, "..-.." },	/* ト */
+    { 0x30CA, ".-." },		/* ナ */
+    { 0x30CB, "-.-." },		/* ニ */
+    { 0x30CC, "...." },		/* ヌ */
+    { 0x30CD, "--.-" },		/* ネ */
+    { 0x30CE, "..--" },		/* ノ */
+    { 0x30CF, "-..." },		/* ハ */
+    { 0x30D2, "--..-" },	/* ヒ */
+    { 0x30D5, "--.." },		/* フ */
+    { 0x30D8, "." },		/* ヘ */
+    { 0x30DB, "-.." },		/* ホ */
+    { 0x30DE, "-..-" },		/* マ */
+    { 0x30DF, "..-.-" },	/* ミ */
+    { 0x30E0, "-" },		/* ム */
+    { 0x30E1, "-...-" },	/* メ */
+    { 0x30E2, "-..-." },	/* モ */
+    { 0x30E4, ".--" },		/* ヤ */
+    { 0x30E6, "-..--" },	/* ユ */
+    { 0x30E8, "--" },		/* ヨ */
+    { 0x30E9, "..." },		/* ラ */
+    { 0x30EA, "--." },		/* リ */
+    { 0x30EB, "-.--." },	/* ル */
+    { 0x30EC, "---" },		/* レ */
+    { 0x30ED, ".-.-" },		/* ロ */
+    { 0x30EF, "-.-" },		/* ワ */
+    { 0x30F0, ".-..-" },	/* ヰ */
+    { 0x30F1, ".--.." },	/* ヱ */
+    { 0x30F2, ".---" },		/* ヲ */
+    { 0x30F3, ".-.-." },	/* ン */
+    { 0x30FC, ".--.-" },	/* ー */
+    { 0xFF08, "-.--.-" },	/* （ */
+    { 0xFF09, ".-..-." },	/* ） */
+};
+
+static int latin_fold(uint32_t cp, uint32_t out[2])
+{
+    if (cp >= 0xE0 && cp <= 0xFE && cp != 0xF7)
+        cp -= 0x20;
+    else if ((cp >= 0x100 && cp <= 0x137) || (cp >= 0x14A && cp <= 0x177))
+        cp &= ~1u;			// upper case even, lower case odd
+    else if (cp >= 0x179 && cp <= 0x17E && !(cp & 1))
+        cp--;				// upper case odd, lower case even
+    out[0] = cp;
+    return 1;
+}
+
+static int cyrillic_fold(uint32_t cp, uint32_t out[2])
+{
+    if (cp >= 0x430 && cp <= 0x44F)
+        cp -= 0x20;
+    else if (cp == 0x401 || cp == 0x451)
+        cp = 0x415;			// Ё is sent as Е
+    out[0] = cp;
+    return 1;
+}
+
+static int greek_fold(uint32_t cp, uint32_t out[2])
+{
+    if (cp == 0x3C2)
+        cp = 0x3A3;			// final sigma
+    else if (cp >= 0x3B1 && cp <= 0x3C9)
+        cp -= 0x20;
+    out[0] = cp;
+    return 1;
+}
+
+static int hebrew_fold(uint32_t cp, uint32_t out[2])
+{
+    // Final forms sit right before their normal form.
+    if (cp == 0x5DA || cp == 0x5DD || cp == 0x5DF || cp == 0x5E3 || cp == 0x5E5)
+        cp++;
+    out[0] = cp;
+    return 1;
+}
+
+static int wabun_fold(uint32_t cp, uint32_t out[2])
+{
+    static const uint16_t small[] = {
+        0x30A1, 0x30A3, 0x30A5, 0x30A7, 0x30A9, 0x30C3, 0x30E3, 0x30E5,
+        0x30E7, 0x30EE,
+    };
+    static const uint16_t voiced[] = {
+        0x30AC, 0x30AE, 0x30B0, 0x30B2, 0x30B4, 0x30B6, 0x30B8, 0x30BA,
+        0x30BC, 0x30BE, 0x30C0, 0x30C2, 0x30C5, 0x30C7, 0x30C9, 0x30D0,
+        0x30D3, 0x30D6, 0x30D9, 0x30DC,
+    };
+    static const uint16_t semi_voiced[] = {
+        0x30D1, 0x30D4, 0x30D7, 0x30DA, 0x30DD,
+    };
+
+    if (cp >= 0x3041 && cp <= 0x3096)
+        cp += 0x60;			// hiragana to katakana
+    for (size_t i = 0; i < countof(small); i++)
+        if (cp == small[i]) {
+            out[0] = cp + 1;
+            return 1;
+        }
+    for (size_t i = 0; i < countof(voiced); i++)
+        if (cp == voiced[i]) {
+            out[0] = cp - 1;
+            out[1] = 0x309B;
+            return 2;
+        }
+    for (size_t i = 0; i < countof(semi_voiced); i++)
+        if (cp == semi_voiced[i]) {
+            out[0] = cp - 2;
+            out[1] = 0x309C;
+            return 2;
+        }
+    if (cp == 0x30F4) {			// ヴ
+        out[0] = 0x30A6;
+        out[1] = 0x309B;
+        return 2;
+    }
+    out[0] = cp;
+    return 1;
+}
+
+static struct morse_alphabet alphabets[] = {
+    { "latin", latin_letters, countof(latin_letters), latin_fold, 0 },
+    { "cyrillic", cyrillic_letters, countof(cyrillic_letters), cyrillic_fold, 1 },
+    { "greek", greek_letters, countof(greek_letters), greek_fold, 1 },
+    { "hebrew", hebrew_letters, countof(hebrew_letters), hebrew_fold, 1 },
+    { "wabun", wabun_letters, countof(wabun_letters), wabun_fold, 1 },
+};
+
+struct morse_alphabet *morse_alphabet = &alphabets[0];
+
+struct morse_alphabet *alphabet_find(const char *name)
+{
+    for (size_t i = 0; i < countof(alphabets); i++)
+        if (!strcmp(alphabets[i].name, name))
+            return &alphabets[i];
+    return NULL;
+}
+
+const char *alphabet_names(void)
+{
+    return "latin, cyrillic, greek, hebrew, wabun";
+}
+
+static const char *alphabet_lookup(struct morse_alphabet *a, uint32_t cp)
+{
+    size_t lo = 0, hi = a->n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (a->letters[mid].cp == cp)
+            return a->letters[mid].code;
+        if (a->letters[mid].cp < cp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/*
+ * Codes for one non-ASCII code point, up to two for the voiced kana, and
+ * the canonical letters they stand for.  Returns the number of codes, 0
+ * when no alphabet knows the letter.
+ */
+static int alphabet_resolve(uint32_t cp, const char *codes[2], uint32_t folded[2])
+{
+    struct morse_alphabet *a = morse_alphabet, *latin = &alphabets[0];
+    int n;
+
+    n = a->fold(cp, folded);
+    for (int i = 0; i < n; i++)
+        if (!(codes[i] = alphabet_lookup(a, folded[i])))
+            goto latin;
+    return n;
+
+latin:
+    if (a == latin)
+        return 0;
+    latin->fold(cp, folded);
+    codes[0] = alphabet_lookup(latin, folded[0]);
+    return codes[0] ? 1 : 0;
+}
+
+int alphabet_encode(uint32_t cp, const char *codes[2])
+{
+    uint32_t folded[2];
+
+    return alphabet_resolve(cp, codes, folded);
+}
+
+/*
+ * The codes of the letter at the start of in, ASCII or UTF-8.  Returns
+ * the bytes the letter takes, at least one, and how many codes it has in
+ * *ncodes, 0 when it has none.
+ */
+size_t morse_letter_codes(const char *in, size_t len, const char *codes[2],
+                          int *ncodes)
+{
+    uint32_t cp;
+    size_t n;
+
+    if ((unsigned char)in[0] < 0x80) {
+        codes[0] = morse_lookup(in[0]);
+        *ncodes = *codes[0] != '\0';
+        return 1;
+    }
+    n = utf8_decode((const unsigned char *)in, len, &cp);
+    if (!n) {
+        *ncodes = 0;
+        return 1;
+    }
+    *ncodes = alphabet_encode(cp, codes);
+    return n;
+}
+
+/*
+ * The letters a code point is sent as, what a lossless round trip decodes
+ * it to.  Returns their number, 0 when the code point has no code.
+ */
+int alphabet_canonical(uint32_t cp, uint32_t canon[2])
+{
+    const char *codes[2];
+
+    return alphabet_resolve(cp, codes, canon);
+}
+
+static int cmp_by_code(const void *a, const void *b)
+{
+    const struct morse_letter *x = a, *y = b;
+    int r = strcmp(x->code, y->code);
+
+    // Several letters may share a code, decode to the lowest code point.
+    return r ? r : (x->cp > y->cp) - (x->cp < y->cp);
+}
+
+void alphabet_init(void)
+{
+    for (size_t i = 0; i < countof(alphabets); i++) {
+        struct morse_alphabet *a = &alphabets[i];
+
+        a->by_code = arena_alloc(&morse_tables, a->n * sizeof(*a->by_code));
+        memcpy(a->by_code, a->letters, a->n * sizeof(*a->by_code));
+        qsort(a->by_code, a->n, sizeof(*a->by_code), cmp_by_code);
+    }
+}
+
+// Code point for a code in one alphabet, 0 if it has none.
+uint32_t alphabet_decode(struct morse_alphabet *a, const char *code)
+{
+    size_t lo = 0, hi = a->n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int r = strcmp(a->by_code[mid].code, code);
+
+        if (r == 0) {
+            // Step back to the first (lowest code point) of equal codes.
+            while (mid && !strcmp(a->by_code[mid - 1].code, code))
+                mid--;
+            return a->by_code[mid].cp;
+        }
+        if (r < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+struct morse_alphabet *alphabet_latin(void)
+{
+    return &alphabets[0];
+}
+
+/*
+ * Decode one UTF-8 sequence, returns its length or 0 if it is invalid or
+ * cut short by the end of the buffer.
+ */
+size_t utf8_decode(const unsigned char *p, size_t len, uint32_t *cp)
+{
+    size_t n;
+    uint32_t c, min;
+
+    if (p[0] < 0xC2)
+        return 0;
+    if (p[0] < 0xE0) {
+        n = 2;
+        c = p[0] & 0x1F;
+        min = 0x80;
+    } else if (p[0] < 0xF0) {
+        n = 3;
+        c = p[0] & 0x0F;
+        min = 0x800;
+    } else if (p[0] < 0xF5) {
+        n = 4;
+        c = p[0] & 0x07;
+        min = 0x10000;
+    } else
+        return 0;
+    if (len < n)
+        return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        c = c << 6 | (p[i] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return 0;
+    *cp = c;
+    return n;
+}
+
+size_t utf8_encode(uint32_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3F);
+    out[2] = 0x80 | (cp >> 6 & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+/*
+ * Length of the longest prefix of p that does not end in the middle of a
+ * UTF-8 sequence, for splitting text into chunks.
+ */
+size_t utf8_boundary(const char *p, size_t len)
+{
+    size_t i = len;
+
+    // Walk back over at most 3 continuation bytes to the lead byte.
+    while (i > 0 && len - i < 3 && ((unsigned char)p[i - 1] & 0xC0) == 0x80)
+        i--;
+    if (i > 0 && ((unsigned char)p[i - 1] & 0xC0) == 0xC0) {
+        unsigned char lead = p[i - 1];
+        size_t need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+
+        if (len - (i - 1) < need)
+            return i - 1;
+    }
+    return len;
+}
@@ -0,0 +1,91 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Arena allocator, see struct arena in morse.h.
+ *
+ * A request that does not fit the rest of the current block moves on to
+ * the next block kept from before the last reset when it is big enough,
+ * otherwise a new block of at least block_size is linked in right after
+ * the current one.  Blocks are only freed by arena_free().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "morse.h"
+
+void *arena_grow(struct arena *a, size_t size)
+{
+    struct arena_block *b = a->cur ? a->cur->next : a->first;
+    size_t want = a->block_size ? a->block_size : ARENA_BLOCK;
+
+    if (!b || b->size < size) {
+        if (want < size)
+            want = size;
+        b = malloc(sizeof(*b) + want);
+        if (!b) {
+            perror("Error allocating arena");
+            exit(EXIT_FAILURE);
+        }
+        b->size = want;
+        if (a->cur) {
+            b->next = a->cur->next;
+            a->cur->next = b;
+        } else {
+            b->next = a->first;
+            a->first = b;
+        }
+    }
+    a->cur = b;
+    a->used = size;
+    return b->data;
+}
+
+// Everything handed out is gone, the blocks stay for reuse.
+void arena_reset(struct arena *a)
+{
+    a->cur = NULL;
+    a->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *b, *next;
+
+    for (b = a->first; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->first = a->cur = NULL;
+    a->used = 0;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    size_t n = strlen(s) + 1;
+
+    return memcpy(arena_alloc(a, n), s, n);
+}
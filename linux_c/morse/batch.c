@@ -0,0 +1,375 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Batch mode, encode or decode many files in one process.
+ *
+ *   morse -e|-d [-j N] [-o dir] file1 file2 ...
+ *   morse -e|-d [-j N] [-o dir] --from-list list.txt
+ *
+ * Every file is a task on the work stealing pool.  The decode tables are
+ * built once before the workers start and are read only afterwards, and
+ * each worker keeps its input buffer and output arena across files so
+ * small files cost an open, a read, a write and a close and no malloc.
+ *
+ * Encoding foo writes foo.morse, decoding foo.morse writes foo (any other
+ * name gets .txt appended).  With -o the outputs go into that directory.
+ *
+ * With --io-uring the batch runs on the io_uring engine in uring.c
+ * instead, falling back to this path when the kernel does not offer it.
+ * Without -j and --io-uring the calibration of tune.c chooses the thread
+ * count, the engine and the largest file read() rather than mapped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+// Files up to this size are read into the worker buffer, mmap above it.
+#define BATCH_READ_MAX (256 * 1024)
+#define BATCH_SAMPLE 64			// files stat()ed to size a batch
+
+struct batch_worker {
+    char *in;
+    struct arena scratch;		// output of the current file
+    struct morse_cache *cache;		// outputs of small files seen before
+};
+
+static struct batch {
+    int mode;
+    const char *outdir;
+    size_t read_max;			// BATCH_READ_MAX or calibrated
+    struct batch_worker *workers;
+    atomic_int failed;
+} batch;
+
+int batch_output_path(int mode, const char *outdir, const char *in,
+                      char *path, size_t len)
+{
+    const char *name = in;
+    size_t n;
+    int ret;
+
+    if (outdir) {
+        const char *slash = strrchr(in, '/');
+
+        if (slash)
+            name = slash + 1;
+        ret = snprintf(path, len, "%s/%s", outdir, name);
+    } else
+        ret = snprintf(path, len, "%s", in);
+    if (ret < 0 || (size_t)ret >= len)
+        return -1;
+
+    n = strlen(path);
+    if (mode == MORS_DECO && n > strlen(MORSE_FILE_SUFFIX)
+        && !strcmp(path + n - strlen(MORSE_FILE_SUFFIX), MORSE_FILE_SUFFIX)) {
+        path[n - strlen(MORSE_FILE_SUFFIX)] = '\0';
+        return 0;
+    }
+    ret = snprintf(path + n, len - n, "%s", mode == MORS_ENCO
+                   ? MORSE_FILE_SUFFIX : TEXT_FILE_SUFFIX);
+    return (size_t)ret >= len - n ? -1 : 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Convert one in memory file into the worker output buffer and write it.
+static int batch_convert(struct batch_worker *w, const char *in, size_t len,
+                  const char *path)
+{
+    size_t need, n;
+    uint64_t start;
+    const char *hit;
+    char *out;
+    int fd, ret;
+
+    need = batch.mode == MORS_ENCO ? MORSE_ENCODE_BOUND(len) + 1
+                                   : MORSE_DECODE_BOUND(len);
+    arena_reset(&w->scratch);
+    out = arena_alloc(&w->scratch, need);
+
+    start = morse_stats_chunk_start();
+    if ((hit = cache_get(w->cache, batch.mode, in, len, &n))) {
+        memcpy(out, hit, n);
+    } else {
+        n = batch.mode == MORS_ENCO ? morse_encode_buf(in, len, out)
+                                    : morse_decode_buf(in, len, out);
+        cache_put(w->cache, batch.mode, in, len, out, n);
+    }
+    if (batch.mode == MORS_ENCO)
+        out[n++] = '\n';
+    morse_stats_chunk_end(start);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    ret = write_all(fd, out, n);
+    morse_stats_flush(n);
+    if (close(fd) == -1)
+        ret = -1;
+    return ret;
+}
+
+static int batch_file(struct batch_worker *w, const char *in)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    char *data;
+    size_t len = 0;
+    ssize_t n;
+    int fd, ret;
+
+    if (batch_output_path(batch.mode, batch.outdir, in, path, sizeof(path))) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = open(in, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1)
+        goto err;
+
+    if ((size_t)st.st_size <= batch.read_max) {
+        // Pipes, FUSE and signals may hand it over in pieces.
+        while (len < batch.read_max
+               && (n = read(fd, w->in + len, batch.read_max - len))) {
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                goto err;
+            }
+            len += n;
+        }
+        close(fd);
+        return batch_convert(w, w->in, len, path);
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        goto err;
+    close(fd);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    ret = batch_convert(w, data, st.st_size, path);
+    munmap(data, st.st_size);
+    return ret;
+
+err:
+    close(fd);
+    return -1;
+}
+
+static void batch_task(void *arg, int worker)
+{
+    const char *in = arg;
+
+    if (batch_file(&batch.workers[worker], in)) {
+        fprintf(stderr, "%s: %s\n", in, strerror(errno));
+        atomic_fetch_add(&batch.failed, 1);
+    }
+}
+
+/*
+ * Read the newline separated list of inputs for --from-list, "-" is
+ * stdin.  The strings are never freed, they live until exit.
+ */
+void batch_read_list(struct start_options *options)
+{
+    static struct arena names;
+    FILE *f;
+    char *line = NULL, **files;
+    size_t cap = 0, size = options->nfiles + 1024;
+    ssize_t n;
+
+    f = strcmp(options->from_list, "-") ? fopen(options->from_list, "r") : stdin;
+    if (!f) {
+        perror("Error opening file list");
+        exit(EXIT_FAILURE);
+    }
+
+    // The command line inputs point into argv, copy them over first.
+    files = malloc(size * sizeof(char *));
+    if (!files)
+        goto err;
+    memcpy(files, options->files, options->nfiles * sizeof(char *));
+
+    while ((n = getline(&line, &cap, f)) != -1) {
+        if (n && line[n - 1] == '\n')
+            line[--n] = '\0';
+        if (!n)
+            continue;
+        if (options->nfiles == (int)size) {
+            size *= 2;
+            files = realloc(files, size * sizeof(char *));
+            if (!files)
+                goto err;
+        }
+        files[options->nfiles++] = arena_strdup(&names, line);
+    }
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    options->files = files;
+    return;
+
+err:
+    perror("Error reading file list");
+    exit(EXIT_FAILURE);
+}
+
+int batch_threads(struct start_options *options)
+{
+    long n;
+
+    if (options->jobs > 0)
+        return options->jobs;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Without -j the calibration picks the threads by the size of the batch,
+ * from the sizes of a sample of its files.  A small batch runs on one
+ * thread without asking it.
+ */
+static const struct morse_tune *batch_tune(struct start_options *options,
+                                           int *nthreads)
+{
+    const struct morse_tune *t;
+    int step = options->nfiles / BATCH_SAMPLE + 1, n = 0;
+    double bytes = 0;
+    struct stat st;
+
+    if (options->jobs || options->tune < 0)
+        return NULL;
+    for (int i = 0; i < options->nfiles; i += step, n++)
+        if (stat(options->files[i], &st) == 0)
+            bytes += st.st_size;
+    bytes *= (double)options->nfiles / n;
+    if (bytes < TUNE_MIN) {
+        *nthreads = 1;
+        return NULL;
+    }
+    t = tune_get(options);
+    if (t)
+        *nthreads = tune_threads(t, bytes, options->nfiles, options->mode);
+    return t;
+}
+
+/*
+ * Convert the files of options on nthreads workers of the mmap engine,
+ * reading those up to read_max (0 for the default) into the worker
+ * buffer.  Returns the number of failed files, every call starts afresh.
+ */
+int batch_files(struct start_options *options, int nthreads, size_t read_max)
+{
+    struct pool *pool;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.mode = options->mode;
+    batch.outdir = options->outdir;
+    batch.read_max = read_max ? read_max : BATCH_READ_MAX;
+    batch.workers = calloc(nthreads, sizeof(*batch.workers));
+    if (!batch.workers) {
+        perror("Error allocating workers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        batch.workers[i].in = malloc(batch.read_max);
+        batch.workers[i].cache = cache_for_worker(options, nthreads);
+        if (!batch.workers[i].in) {
+            perror("Error allocating workers");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pool = pool_create(nthreads);
+    for (int i = 0; i < options->nfiles; i++)
+        pool_submit(pool, batch_task, options->files[i]);
+    pool_destroy(pool);
+
+    for (int i = 0; i < nthreads; i++) {
+        free(batch.workers[i].in);
+        arena_free(&batch.workers[i].scratch);
+        cache_destroy(batch.workers[i].cache);
+    }
+    free(batch.workers);
+    batch.workers = NULL;
+    return batch.failed;
+}
+
+void batch_run(struct start_options *options)
+{
+    const struct morse_tune *t;
+    int nthreads, failed = -1;
+
+    if (options->from_list)
+        batch_read_list(options);
+    if (!options->nfiles)
+        return;
+
+    nthreads = batch_threads(options);
+    t = batch_tune(options, &nthreads);
+    if (nthreads > options->nfiles)
+        nthreads = options->nfiles;
+    hmorse_init();
+
+    if (options->io_uring || (t && t->uring)) {
+        failed = uring_batch_run(options, nthreads);
+        if (failed < 0)
+            pr_dbg("io_uring not available, using mmap\n");
+    }
+    if (failed < 0)
+        failed = batch_files(options, nthreads, t ? t->read_max : 0);
+
+    if (failed) {
+        fprintf(stderr, "%d of %d files failed\n", failed, options->nfiles);
+        exit(EXIT_FAILURE);
+    }
+}
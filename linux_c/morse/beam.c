@@ -0,0 +1,382 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Beam search timing decoder, -d [--lm model] [--beam width]
+ *
+ * The timing decoder decides every element and gap on its own against a
+ * threshold, so a stretched dot becomes a dash and a long letter gap
+ * splits a word for good.  This one keeps up to --beam interpretations
+ * (BEAM_DEFAULT, at most BEAM_MAX) of the key down/up durations so far and
+ * scores each by how well the durations fit it and, with a model from
+ * lm.c, how likely its text is.  Every duration gives each hypothesis at
+ * most three successors:
+ *
+ *   key down  a dot or a dash
+ *   key up    the same letter goes on, the letter ends, the word ends
+ *
+ * A duration costs its squared distance from the 1, 3 or 7 dot units of
+ * each choice in log time, in bits, a finished letter its character
+ * n-gram cost and a finished word the word cost on top.  Hypotheses that
+ * end up in the same state, same code so far, same last letters and same
+ * word, are merged keeping the cheaper, and only the cheapest width stay,
+ * so the work per duration is bounded by 3 x width whatever the signal.
+ *
+ * Text leaves as soon as every hypothesis agrees on it, after BEAM_TEXT
+ * letters of disagreement the best one wins, and a word gap long enough
+ * that nothing can follow settles it at once so live decoding does not
+ * lag.  The dot estimate follows the best hypothesis' elements.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "morse.h"
+
+#define BEAM_DEFAULT 8
+#define BEAM_MAX 64
+#define BEAM_TEXT 48			// letters held before the best is taken
+#define BEAM_SIGMA 0.3			// of log durations, natural log
+#define BEAM_BAD_CODE 24.0		// bits, a code that is no letter
+#define BEAM_LM_WEIGHT 0.5		// of the model against the timing
+#define BEAM_WORD_WEIGHT 0.5		// of the word model against the letters
+#define BEAM_WORD_OOV 14.0		// bits, a word the model never saw
+#define BEAM_SETTLE 10			// dot units of silence that end it all
+
+struct beam_hyp {
+    double score;			// bits, lower is better
+    uint32_t ctx;			// last three letters, newest low
+    uint32_t word;			// lm_word_hash() of the word so far
+    uint16_t code;			// elements so far, see beam_letters
+    uint8_t nsym;
+    uint8_t ntext;
+    char text[BEAM_TEXT + 8];		// not yet emitted, UTF-8
+};
+
+struct beam_decoder {
+    const struct morse_lm *lm;
+    unsigned width;
+    uint64_t dot_ns;
+    int in_space;			// a gap was taken since the last mark
+    size_t n;
+    struct beam_hyp hyp[BEAM_MAX];
+    struct beam_hyp cand[3 * BEAM_MAX];
+    void (*emit)(char c, void *arg);
+    void *arg;
+};
+
+/*
+ * Letters by code as a binary heap, the root 1 is the empty code, a dot
+ * goes to 2k and a dash to 2k + 1, as in morse.hpp.  Codes shared by two
+ * letters decode to the first, as morse2char() does, codes the table does
+ * not have to the latin alphabet as the stream decoder does.
+ */
+static uint32_t beam_letters[2 << TIMING_MAX_SYMBOLS];
+
+static void beam_letters_init(void)
+{
+    for (size_t i = 0; i < morse_active_size; i++) {
+        const char *s = morse_active[i];
+        unsigned k = 1;
+
+        if (!s || !*s || strlen(s) > TIMING_MAX_SYMBOLS
+            || strspn(s, ".-") != strlen(s))
+            continue;
+        for (; *s; s++)
+            k = 2 * k + (*s == '-');
+        if (!beam_letters[k])
+            beam_letters[k] = toupper((int)i);
+    }
+    for (unsigned k = 2; k < 2U << TIMING_MAX_SYMBOLS; k++) {
+        char code[TIMING_MAX_SYMBOLS + 1];
+        int n = 0;
+
+        if (beam_letters[k])
+            continue;
+        for (unsigned b = 31 - __builtin_clz(k); b-- > 0; )
+            code[n++] = k >> b & 1 ? '-' : '.';
+        code[n] = '\0';
+        beam_letters[k] = alphabet_decode(alphabet_latin(), code);
+    }
+}
+
+static inline double beam_fit(double x, double units)
+{
+    double d = x - log(units);
+
+    return d * d / (2 * BEAM_SIGMA * BEAM_SIGMA) / M_LN2;
+}
+
+static void beam_reset(struct beam_decoder *b, uint32_t ctx)
+{
+    memset(&b->hyp[0], 0, sizeof(b->hyp[0]));
+    b->hyp[0].ctx = ctx;
+    b->hyp[0].code = 1;
+    b->n = 1;
+}
+
+struct beam_decoder *beam_create(const struct morse_lm *lm, unsigned width,
+                                 uint64_t dot_ns,
+                                 void (*emit)(char c, void *arg), void *arg)
+{
+    struct beam_decoder *b = calloc(1, sizeof(*b));
+
+    if (!b) {
+        perror("Error allocating the beam decoder");
+        exit(EXIT_FAILURE);
+    }
+    if (!beam_letters[3])
+        beam_letters_init();
+    b->lm = lm;
+    b->width = width ? (width < BEAM_MAX ? width : BEAM_MAX) : BEAM_DEFAULT;
+    b->dot_ns = dot_ns;
+    b->emit = emit;
+    b->arg = arg;
+    beam_reset(b, 0x202020);
+    return b;
+}
+
+void beam_destroy(struct beam_decoder *b)
+{
+    free(b);
+}
+
+// Letters outside ASCII go into the context as their first byte.
+static void beam_append(struct beam_hyp *h, uint32_t cp)
+{
+    char c = cp < 0x80 ? (char)cp : (char)(0xc0 | cp >> 6);
+
+    if (cp < 0x80)
+        h->text[h->ntext++] = c;
+    else
+        h->ntext += utf8_encode(cp, h->text + h->ntext);
+    h->ctx = (h->ctx << 8 | (unsigned char)c) & 0xffffff;
+}
+
+static void beam_letter(const struct beam_decoder *b, struct beam_hyp *h)
+{
+    uint32_t cp = beam_letters[h->code];
+    char c = cp < 0x80 ? (char)cp : (char)(0xc0 | cp >> 6);
+
+    if (h->nsym == 0)
+        return;
+    if (!cp) {
+        h->score += BEAM_BAD_CODE;
+    } else {
+        if (b->lm)
+            h->score += BEAM_LM_WEIGHT * lm_char_cost(b->lm, h->ctx, c);
+        beam_append(h, cp);
+        h->word = lm_word_hash(h->word, c);
+    }
+    h->code = 1;
+    h->nsym = 0;
+}
+
+static void beam_word(const struct beam_decoder *b, struct beam_hyp *h)
+{
+    if (!h->word)
+        return;
+    if (b->lm) {
+        double w = lm_word_cost(b->lm, h->word);
+
+        // Known words earn back part of what their letters cost.
+        h->score += BEAM_LM_WEIGHT * (lm_char_cost(b->lm, h->ctx, ' ')
+                  + (w < 0 ? 0 : BEAM_WORD_WEIGHT * (w - BEAM_WORD_OOV)));
+    }
+    beam_append(h, ' ');
+    h->word = 0;
+}
+
+static int cmp_score(const void *a, const void *b)
+{
+    const struct beam_hyp *x = a, *y = b;
+
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+static int same_state(const struct beam_hyp *x, const struct beam_hyp *y)
+{
+    return x->code == y->code && x->nsym == y->nsym && x->ctx == y->ctx
+        && x->word == y->word;
+}
+
+// Emit the first n letters of the best, drop what disagrees with them.
+static void beam_commit(struct beam_decoder *b, size_t n)
+{
+    const struct beam_hyp *best = &b->hyp[0];
+    size_t kept = 0;
+
+    if (!n)
+        return;
+    for (size_t i = 0; i < n; i++)
+        b->emit(best->text[i], b->arg);
+    for (size_t i = 0; i < b->n; i++) {
+        struct beam_hyp *h = &b->hyp[i];
+
+        if (h->ntext < n || memcmp(h->text, b->hyp[0].text, n))
+            continue;
+        if (kept != i)
+            b->hyp[kept] = *h;
+        kept++;
+    }
+    b->n = kept;
+    for (size_t i = 0; i < b->n; i++) {
+        struct beam_hyp *h = &b->hyp[i];
+
+        memmove(h->text, h->text + n, h->ntext - n);
+        h->ntext -= n;
+    }
+}
+
+// Keep the cheapest width distinct states of ncand and emit what is agreed.
+static void beam_prune(struct beam_decoder *b, size_t ncand)
+{
+    size_t agreed;
+    double base;
+
+    qsort(b->cand, ncand, sizeof(b->cand[0]), cmp_score);
+    b->n = 0;
+    for (size_t i = 0; i < ncand && b->n < b->width; i++) {
+        size_t j;
+
+        for (j = 0; j < b->n; j++)
+            if (same_state(&b->cand[i], &b->hyp[j]))
+                break;
+        if (j == b->n)
+            b->hyp[b->n++] = b->cand[i];
+    }
+    if (!b->n) {
+        // Nothing fits, say a letter longer than any code: start over.
+        beam_reset(b, 0x202020);
+        return;
+    }
+
+    base = b->hyp[0].score;
+    agreed = b->hyp[0].ntext;
+    for (size_t i = 0; i < b->n; i++) {
+        size_t k = 0;
+
+        b->hyp[i].score -= base;
+        while (k < agreed && k < b->hyp[i].ntext
+               && b->hyp[i].text[k] == b->hyp[0].text[k])
+            k++;
+        agreed = k;
+    }
+    if (b->hyp[0].ntext >= BEAM_TEXT)
+        agreed = b->hyp[0].ntext;
+    beam_commit(b, agreed);
+}
+
+void beam_mark(struct beam_decoder *b, uint64_t ns)
+{
+    double x = log((double)ns / b->dot_ns);
+    double dot = beam_fit(x, 1), dash = x > log(3) ? 0 : beam_fit(x, 3);
+    size_t n = 0;
+
+    b->in_space = 0;
+    for (size_t i = 0; i < b->n; i++) {
+        const struct beam_hyp *h = &b->hyp[i];
+
+        if (h->nsym == TIMING_MAX_SYMBOLS)
+            continue;
+        b->cand[n] = *h;
+        b->cand[n].code = 2 * h->code;
+        b->cand[n].nsym++;
+        b->cand[n++].score += dot;
+        b->cand[n] = *h;
+        b->cand[n].code = 2 * h->code + 1;
+        b->cand[n].nsym++;
+        b->cand[n++].score += dash;
+    }
+    beam_prune(b, n);
+
+    // Follow the speed by what the best took this element for.
+    if (b->hyp[0].code & 1)
+        b->dot_ns = (3 * b->dot_ns + ns / 3) / 4;
+    else if (b->hyp[0].nsym)
+        b->dot_ns = (3 * b->dot_ns + ns) / 4;
+}
+
+void beam_space(struct beam_decoder *b, uint64_t ns)
+{
+    double x = log((double)ns / b->dot_ns);
+    double in = beam_fit(x, 1), letter = beam_fit(x, 3);
+    double word = x > log(7) ? 0 : beam_fit(x, 7);
+    size_t n = 0;
+
+    // The real edge after a timed out gap adds nothing.
+    if (b->in_space)
+        return;
+    b->in_space = 1;
+    for (size_t i = 0; i < b->n; i++) {
+        const struct beam_hyp *h = &b->hyp[i];
+
+        if (!h->nsym) {
+            b->cand[n++] = *h;
+            continue;
+        }
+        if (h->nsym < TIMING_MAX_SYMBOLS) {
+            b->cand[n] = *h;
+            b->cand[n++].score += in;
+        }
+        b->cand[n] = *h;
+        beam_letter(b, &b->cand[n]);
+        b->cand[n++].score += letter;
+        b->cand[n] = *h;
+        beam_letter(b, &b->cand[n]);
+        beam_word(b, &b->cand[n]);
+        b->cand[n++].score += word;
+    }
+    beam_prune(b, n);
+    if (ns >= BEAM_SETTLE * b->dot_ns)
+        beam_commit(b, b->hyp[0].ntext);
+}
+
+// How long a gap may last before the letters so far must be decided.
+uint64_t beam_idle_ns(const struct beam_decoder *b)
+{
+    return b->in_space ? 0 : BEAM_SETTLE * b->dot_ns;
+}
+
+void beam_flush(struct beam_decoder *b)
+{
+    size_t best = 0;
+
+    for (size_t i = 0; i < b->n; i++) {
+        beam_letter(b, &b->hyp[i]);
+        if (b->hyp[i].score < b->hyp[best].score)
+            best = i;
+    }
+    if (best)
+        b->hyp[0] = b->hyp[best];
+    b->n = 1;
+    // No word gap came, what is left is not followed by a space.
+    while (b->hyp[0].ntext && b->hyp[0].text[b->hyp[0].ntext - 1] == ' ')
+        b->hyp[0].ntext--;
+    beam_commit(b, b->hyp[0].ntext);
+    beam_reset(b, b->hyp[0].ctx);
+}
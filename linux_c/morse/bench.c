@@ -0,0 +1,451 @@
+/*
+ * morse-bench, throughput and latency of the encode/decode engines.
+ *
+ *   morse-bench [-c corpora] [-s sizes] [-j threads] [-t ms] [-S seed] [-f text] [-o file]
+ *
+ * Every corpus is generated from a seeded PRNG so runs are reproducible:
+ *
+ *   random     printable ASCII noise
+ *   prose      English-like sentences and paragraphs
+ *   longlines  the same prose without a single newline
+ *   morse      the prose encoded, dense well formed morse
+ *   malformed  morse with junk bytes, ragged gaps and overlong tokens
+ *   file       the text of -f, repeated up to the largest size
+ *
+ * Text corpora run "encode" (one morse_encode_buf() per call), "words"
+ * (the same with the common word dictionary) and "stream" (MORSE_CHUNK
+ * sized calls, as display_message() does), morse corpora run "decode"
+ * and "stream" (morse_decoder_feed() per chunk).
+ * Each combination of size and thread count runs for at least -t ms on
+ * every thread at once, throughput is over all threads and the latency
+ * percentiles are per call.  The result is JSON on stdout or in -o file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "morse.h"
+
+#define BENCH_MAX_LIST 16
+
+enum { OP_ENCODE, OP_DECODE, OP_STREAM, OP_WORDS };
+
+static const char *op_names[] = { "encode", "decode", "stream", "words" };
+
+struct corpus {
+    const char *name;
+    int morse;				// input is morse code
+    char *buf;
+    size_t len;
+};
+
+struct bench_task {
+    const struct corpus *c;
+    size_t size;
+    int op;
+    uint64_t deadline;
+    uint64_t *lat;			// ns per call
+    size_t nlat, lat_size;
+    uint64_t bytes;
+};
+
+static uint64_t seed = 1;
+static const char *text_path;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// splitmix64, small and good enough for test data.
+static uint64_t rnd(void)
+{
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static unsigned rnd_below(unsigned n)
+{
+    return rnd() % n;
+}
+
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n);
+
+    if (!p) {
+        perror("Error allocating");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void gen_random(struct corpus *c, size_t len)
+{
+    c->buf = xmalloc(len);
+    for (size_t i = 0; i < len; i++)
+        c->buf[i] = rnd_below(64) ? 0x20 + rnd_below(0x5F) : '\n';
+    c->len = len;
+}
+
+// Most frequent English words first, picked with a skew towards the front.
+static const char *words[] = {
+    "the", "of", "and", "to", "a", "in", "is", "you", "that", "it", "he",
+    "was", "for", "on", "are", "as", "with", "his", "they", "at", "be",
+    "this", "have", "from", "or", "one", "had", "by", "word", "but", "not",
+    "what", "all", "were", "we", "when", "your", "can", "said", "there",
+    "use", "an", "each", "which", "she", "do", "how", "their", "if", "will",
+    "up", "other", "about", "out", "many", "then", "them", "these", "so",
+    "some", "her", "would", "make", "like", "him", "into", "time", "has",
+    "look", "two", "more", "write", "go", "see", "number", "no", "way",
+    "could", "people", "my", "than", "first", "water", "been", "call",
+    "who", "oil", "its", "now", "find", "long", "down", "day", "did", "get",
+    "come", "made", "may", "part", "radio", "station", "signal", "copy",
+    "73", "1200", "2019",
+};
+
+static void gen_prose(struct corpus *c, size_t len, int newlines)
+{
+    size_t n = 0;
+    int word = 0, sentence = 0;
+
+    c->buf = xmalloc(len + 64);
+    while (n < len) {
+        unsigned r = rnd_below(1000);
+        const char *w = words[r * r / 1000 * (sizeof(words) / sizeof(words[0])) / 1000];
+        size_t wl = strlen(w);
+
+        memcpy(c->buf + n, w, wl);
+        if (word == 0)
+            c->buf[n] = c->buf[n] >= 'a' ? c->buf[n] - 32 : c->buf[n];
+        n += wl;
+        word++;
+        if (word > 4 && rnd_below(12) == 0) {
+            c->buf[n++] = rnd_below(8) ? '.' : '?';
+            word = 0;
+            if (++sentence % 5 == 0 && newlines) {
+                c->buf[n++] = '\n';
+                continue;
+            }
+        } else if (rnd_below(15) == 0)
+            c->buf[n++] = ',';
+        c->buf[n++] = ' ';
+    }
+    c->len = len;
+}
+
+static void gen_malformed(struct corpus *c, size_t len)
+{
+    static const char junk[] = "x_/|=#";
+    size_t n = 0;
+
+    c->buf = xmalloc(len + 32);
+    while (n < len) {
+        unsigned tok = 1 + rnd_below(rnd_below(8) ? 6 : 14);
+        unsigned gap = 1 + rnd_below(rnd_below(4) ? 1 : 4);
+
+        for (unsigned i = 0; i < tok; i++)
+            c->buf[n++] = rnd_below(20) ? ".-"[rnd_below(2)]
+                                        : junk[rnd_below(sizeof(junk) - 1)];
+        for (unsigned i = 0; i < gap; i++)
+            c->buf[n++] = rnd_below(30) ? ' ' : "\t\n\r"[rnd_below(3)];
+    }
+    c->len = len;
+}
+
+// Real text, repeated until it is long enough.
+static void read_text(struct corpus *c, size_t len)
+{
+    FILE *f = fopen(text_path, "r");
+    size_t n = 0, got;
+
+    if (!f) {
+        perror(text_path);
+        exit(EXIT_FAILURE);
+    }
+    c->buf = xmalloc(len);
+    while (n < len) {
+        got = fread(c->buf + n, 1, len - n, f);
+        if (got == 0 && n == 0) {
+            fprintf(stderr, "Error: %s is empty\n", text_path);
+            exit(EXIT_FAILURE);
+        }
+        if (got == 0)
+            rewind(f);
+        n += got;
+    }
+    fclose(f);
+    c->len = len;
+}
+
+static void gen_corpus(struct corpus *c, size_t len)
+{
+    if (!strcmp(c->name, "file"))
+        read_text(c, len);
+    else if (!strcmp(c->name, "random"))
+        gen_random(c, len);
+    else if (!strcmp(c->name, "prose"))
+        gen_prose(c, len, 1);
+    else if (!strcmp(c->name, "longlines"))
+        gen_prose(c, len, 0);
+    else if (!strcmp(c->name, "malformed"))
+        gen_malformed(c, len);
+    else {
+        struct corpus text = { "prose", 0, NULL, 0 };
+
+        // Encoded text is about 4 times longer, generate just enough.
+        gen_prose(&text, len / 3 + 16, 1);
+        c->buf = xmalloc(MORSE_ENCODE_BOUND(text.len));
+        c->len = morse_encode_buf(text.buf, text.len, c->buf);
+        free(text.buf);
+        if (c->len > len)
+            c->len = len;
+    }
+}
+
+static void record(struct bench_task *t, uint64_t ns)
+{
+    if (t->nlat == t->lat_size) {
+        t->lat_size = t->lat_size ? 2 * t->lat_size : 4096;
+        t->lat = realloc(t->lat, t->lat_size * sizeof(*t->lat));
+        if (!t->lat) {
+            perror("Error allocating");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->lat[t->nlat++] = ns;
+}
+
+static void bench_task(void *arg, int worker)
+{
+    struct bench_task *t = arg;
+    const char *in = t->c->buf;
+    size_t len = t->size;
+    char *out = xmalloc(MORSE_ENCODE_BOUND(len > MORSE_CHUNK ? len : MORSE_CHUNK));
+    struct morse_decoder d;
+    uint64_t start, end;
+
+    (void)worker;
+    do {
+        if (t->op != OP_STREAM) {
+            start = now_ns();
+            if (t->op == OP_ENCODE || t->op == OP_WORDS)
+                morse_encode_buf(in, len, out);
+            else
+                morse_decode_buf(in, len, out);
+            record(t, now_ns() - start);
+            t->bytes += len;
+            continue;
+        }
+
+        morse_decoder_init(&d);
+        for (size_t off = 0, n; off < len; off += n) {
+            n = len - off < MORSE_CHUNK ? len - off : MORSE_CHUNK;
+            start = now_ns();
+            if (t->c->morse)
+                morse_decoder_feed(&d, in + off, n, out);
+            else {
+                n = utf8_boundary(in + off, n);
+                morse_encode_buf(in + off, n, out);
+            }
+            end = now_ns();
+            record(t, end - start);
+        }
+        if (t->c->morse)
+            morse_decoder_finish(&d, out);
+        t->bytes += len;
+    } while (now_ns() < t->deadline);
+    free(out);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(FILE *out, const struct corpus *c, int op, size_t size,
+                      int nthreads, unsigned ms, int *first)
+{
+    struct bench_task *tasks = calloc(nthreads, sizeof(*tasks));
+    struct pool *pool = pool_create(nthreads);
+    uint64_t start, elapsed, bytes = 0, *all;
+    size_t total = 0, k = 0;
+
+    if (!tasks) {
+        perror("Error allocating");
+        exit(EXIT_FAILURE);
+    }
+    if (op == OP_WORDS)
+        morse_words_init(NULL, 0);
+    start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        tasks[i].c = c;
+        tasks[i].size = size;
+        tasks[i].op = op;
+        tasks[i].deadline = start + ms * 1000000ULL;
+        pool_submit(pool, bench_task, &tasks[i]);
+    }
+    pool_wait(pool);
+    elapsed = now_ns() - start;
+    pool_destroy(pool);
+    morse_words_free();
+
+    for (int i = 0; i < nthreads; i++) {
+        total += tasks[i].nlat;
+        bytes += tasks[i].bytes;
+    }
+    all = xmalloc(total * sizeof(*all));
+    for (int i = 0; i < nthreads; i++) {
+        memcpy(all + k, tasks[i].lat, tasks[i].nlat * sizeof(*all));
+        k += tasks[i].nlat;
+        free(tasks[i].lat);
+    }
+    qsort(all, total, sizeof(*all), cmp_u64);
+
+    fprintf(out, "%s    {\"corpus\": \"%s\", \"op\": \"%s\", \"size\": %zu, "
+            "\"threads\": %d, \"calls\": %zu, \"bytes\": %llu, "
+            "\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+            "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+            "\"p999_ns\": %llu, \"max_ns\": %llu}",
+            *first ? "" : ",\n", c->name, op_names[op], size, nthreads, total,
+            (unsigned long long)bytes, elapsed / 1e9, bytes / (elapsed / 1e3),
+            (unsigned long long)all[total / 2],
+            (unsigned long long)all[total * 90 / 100],
+            (unsigned long long)all[total * 99 / 100],
+            (unsigned long long)all[total * 999 / 1000],
+            (unsigned long long)all[total - 1]);
+    fflush(out);
+    *first = 0;
+    fprintf(stderr, "%-9s %-6s %9zu bytes %3d threads %10.1f MB/s  p99 %llu ns\n",
+            c->name, op_names[op], size, nthreads, bytes / (elapsed / 1e3),
+            (unsigned long long)all[total * 99 / 100]);
+    free(all);
+    free(tasks);
+}
+
+// Comma separated list of numbers, K and M suffixes allowed.
+static int parse_list(const char *s, size_t *v)
+{
+    int n = 0;
+
+    while (*s && n < BENCH_MAX_LIST) {
+        char *end;
+        size_t x = strtoul(s, &end, 10);
+
+        if (*end == 'K' || *end == 'k')
+            x <<= 10, end++;
+        else if (*end == 'M' || *end == 'm')
+            x <<= 20, end++;
+        if (end == s || x == 0 || (*end && *end != ','))
+            return -1;
+        v[n++] = x;
+        s = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(void)
+{
+    printf("morse-bench [-c corpora] [-s sizes] [-j threads] [-t ms] [-S seed] [-f text] [-o file]\n\n");
+    printf("    -c <list> Corpora to run, from random,prose,longlines,morse,malformed,file (default all).\n");
+    printf("    -s <list> Input sizes, K and M suffixes allowed (default 1K,64K,1M,16M).\n");
+    printf("    -j <list> Thread counts (default 1,2,4 and one per cpu).\n");
+    printf("    -t <ms>   Minimum run time of every combination (default 100).\n");
+    printf("    -S <n>    Corpus seed (default 1).\n");
+    printf("    -f <file> Real text for the file corpus, which only runs with it.\n");
+    printf("    -o <file> Write the JSON report to <file> instead of stdout.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct corpus corpora[] = {
+        { "random", 0 }, { "prose", 0 }, { "longlines", 0 },
+        { "morse", 1 }, { "malformed", 1 }, { "file", 0 },
+    };
+    size_t sizes[BENCH_MAX_LIST] = { 1 << 10, 64 << 10, 1 << 20, 16 << 20 };
+    size_t threads[BENCH_MAX_LIST] = { 1, 2, 4 };
+    int nsizes = 4, nthreads = 3, ncorpora = sizeof(corpora) / sizeof(corpora[0]);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *only = NULL, *path = NULL;
+    unsigned ms = 100;
+    size_t max = 0;
+    FILE *out = stdout;
+    int opt, first = 1;
+
+    if (ncpu > 4)
+        threads[nthreads++] = ncpu;
+    while ((opt = getopt(argc, argv, "c:f:hj:o:s:S:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            only = optarg;
+            break;
+        case 'f':
+            text_path = optarg;
+            break;
+        case 'j':
+            nthreads = parse_list(optarg, threads);
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        case 's':
+            nsizes = parse_list(optarg, sizes);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            ms = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+    if (nsizes <= 0 || nthreads <= 0 || ms == 0 || optind != argc) {
+        usage();
+        exit(-1);
+    }
+    if (path && !(out = fopen(path, "w"))) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    hmorse_init();
+    for (int i = 0; i < nsizes; i++)
+        if (sizes[i] > max)
+            max = sizes[i];
+
+    fprintf(out, "{\n  \"seed\": %llu, \"cpus\": %ld, \"min_ms\": %u, \"chunk\": %d,\n"
+            "  \"results\": [\n", (unsigned long long)seed, ncpu, ms, MORSE_CHUNK);
+    for (int i = 0; i < ncorpora; i++) {
+        struct corpus *c = &corpora[i];
+        int ops[3] = { c->morse ? OP_DECODE : OP_ENCODE, OP_STREAM, OP_WORDS };
+
+        if ((only && !strstr(only, c->name))
+            || (!strcmp(c->name, "file") && !text_path))
+            continue;
+        gen_corpus(c, max);
+        for (int o = 0; o < (c->morse ? 2 : 3); o++)
+            for (int s = 0; s < nsizes; s++)
+                for (int t = 0; t < nthreads; t++)
+                    bench_run(out, c, ops[o], sizes[s] < c->len ? sizes[s] : c->len,
+                              threads[t], ms, &first);
+        free(c->buf);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Result cache of the daemon and batch mode, --cache <MB>
+ *
+ * The same beacons and status strings come in over and over, so the
+ * conversions of short inputs are kept by content.  An entry is keyed by
+ * a hash of the mode, the alphabet and the input and holds the input and
+ * the output; a hit compares the input byte for byte, so a collision can
+ * never give back the wrong text.  Each entry counts its size against the
+ * budget and the least recently used ones are dropped to make room.
+ *
+ * A cache belongs to one thread, the daemon and batch workers have one
+ * each and share the budget, so a lookup takes no lock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "morse.h"
+
+#define CACHE_MAX_INPUT 4096		// longer inputs are converted every time
+#define CACHE_BUCKET_BYTES 512		// of the budget per hash bucket
+
+struct cache_entry {
+    struct cache_entry *chain;		// same bucket
+    struct cache_entry *prev, *next;	// most recently used first
+    uint64_t hash;
+    uint32_t in_len, out_len;
+    char data[];			// input, then output
+};
+
+struct morse_cache {
+    struct cache_entry **table;
+    size_t mask;
+    size_t budget, used;
+    struct cache_entry *head, *tail;
+};
+
+struct morse_cache *cache_create(size_t budget)
+{
+    struct morse_cache *c = calloc(1, sizeof(*c));
+    size_t n = 64;
+
+    while (n < budget / CACHE_BUCKET_BYTES)
+        n *= 2;
+    if (!c || !(c->table = calloc(n, sizeof(*c->table)))) {
+        perror("Error allocating result cache");
+        exit(EXIT_FAILURE);
+    }
+    c->mask = n - 1;
+    c->budget = budget;
+    return c;
+}
+
+// One of nthreads worker caches, NULL with --cache 0.
+struct morse_cache *cache_for_worker(struct start_options *options,
+                                     int nthreads)
+{
+    long budget = options->cache ? options->cache : MORSE_CACHE_DEFAULT;
+
+    return budget > 0 ? cache_create(budget / nthreads) : NULL;
+}
+
+void cache_destroy(struct morse_cache *c)
+{
+    struct cache_entry *e, *next;
+
+    if (!c)
+        return;
+    for (e = c->head; e; e = next) {
+        next = e->next;
+        free(e);
+    }
+    free(c->table);
+    free(c);
+}
+
+// The alphabet is one of the static tables, its address tells them apart.
+static uint64_t cache_hash(int mode, const char *p, size_t len)
+{
+    uint64_t h = ((uint64_t)mode << 32 ^ (uintptr_t)morse_alphabet ^ len)
+               * 0x9e3779b97f4a7c15ULL;
+    uint64_t v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    v = 0;
+    memcpy(&v, p, len);
+    h = (h ^ v) * 0x94d049bb133111ebULL;
+    return h ^ h >> 29;
+}
+
+static void cache_unlink(struct morse_cache *c, struct cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+static void cache_push(struct morse_cache *c, struct cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head)
+        c->head->prev = e;
+    else
+        c->tail = e;
+    c->head = e;
+}
+
+static void cache_evict(struct morse_cache *c)
+{
+    struct cache_entry *e = c->tail, **pp = &c->table[e->hash & c->mask];
+
+    while (*pp != e)
+        pp = &(*pp)->chain;
+    *pp = e->chain;
+    cache_unlink(c, e);
+    c->used -= sizeof(*e) + e->in_len + e->out_len;
+    morse_stats_get()->cache_evictions++;
+    free(e);
+}
+
+/*
+ * The output of converting in with mode, NULL when it is not in the
+ * cache.  It stays valid until the next cache_put().
+ */
+const char *cache_get(struct morse_cache *c, int mode, const char *in,
+                      size_t len, size_t *out_len)
+{
+    struct morse_stats *st;
+    struct cache_entry *e;
+    uint64_t h;
+
+    if (!c || len > CACHE_MAX_INPUT)
+        return NULL;
+    st = morse_stats_get();
+    h = cache_hash(mode, in, len);
+    for (e = c->table[h & c->mask]; e; e = e->chain)
+        if (e->hash == h && e->in_len == len && !memcmp(e->data, in, len))
+            break;
+    if (!e) {
+        st->cache_misses++;
+        return NULL;
+    }
+    if (e != c->head) {
+        cache_unlink(c, e);
+        cache_push(c, e);
+    }
+    st->cache_hits++;
+    st->bytes_in += len;
+    st->bytes_out += e->out_len;
+    *out_len = e->out_len;
+    return e->data + len;
+}
+
+// Keep the output of converting in with mode, after a cache_get() miss.
+void cache_put(struct morse_cache *c, int mode, const char *in, size_t len,
+               const char *out, size_t out_len)
+{
+    size_t size = sizeof(struct cache_entry) + len + out_len;
+    struct cache_entry *e, **bucket;
+
+    if (!c || len > CACHE_MAX_INPUT || size > c->budget / 8)
+        return;
+    while (c->used + size > c->budget)
+        cache_evict(c);
+    e = malloc(size);
+    if (!e)
+        return;
+    e->hash = cache_hash(mode, in, len);
+    e->in_len = len;
+    e->out_len = out_len;
+    memcpy(e->data, in, len);
+    memcpy(e->data + len, out, out_len);
+    bucket = &c->table[e->hash & c->mask];
+    e->chain = *bucket;
+    *bucket = e;
+    cache_push(c, e);
+    c->used += size;
+}
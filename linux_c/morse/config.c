@@ -0,0 +1,496 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Config files, ETC_FILE_PATH_AND_NAME then ~/DOT_FILE_NAME (or just the
+ * file given with -c), later files override earlier ones and the command
+ * line overrides both:
+ *
+ *     wpm = 20
+ *     farnsworth = 12
+ *     mode = "encode"
+ *     jobs = 8
+ *     outdir = "/srv/morse/out"
+ *
+ *     letter "_" { code = "..--.-" }
+ *     letter ";" { code = "-.-.-." }
+ *     prosign "AR" { code = ".-.-." }
+ *
+ * Parsing with libconfuse costs far more than the conversion of a short
+ * message, so the merged result is compiled into a flat cache file
+ * (~/.cache/morse/config-<hash>.bin) holding the complete 256 entry code
+ * table, the prosigns and the settings.  The cache records the inode, size and
+ * mtime of every config file it was built from; as long as they all still
+ * match, later runs mmap the cache, point the tables into it and never
+ * start the parser.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <confuse.h>
+
+#include "morse.h"
+
+#define CACHE_MAGIC "MORSECF2"
+#define CACHE_MAX_SRC 2
+#define CACHE_MAX_PROSIGNS 64
+#define CACHE_MAX_WORDS 256
+#define CACHE_POOL_MAX 65536
+
+struct cache_src {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+};
+
+struct cache_prosign {
+    uint32_t name;			// pool offsets
+    uint32_t code;
+};
+
+/*
+ * On disk layout, every string is an offset into pool[] and offset 0 is
+ * the empty string.
+ */
+struct cache_file {
+    char magic[8];
+    uint32_t size;			// whole file, header included
+    uint32_t nsrc;
+    struct cache_src src[CACHE_MAX_SRC];
+    uint32_t wpm, farnsworth, mode, jobs;
+    uint32_t outdir;
+    uint32_t code[256];
+    uint32_t nprosign;
+    struct cache_prosign prosign[CACHE_MAX_PROSIGNS];
+    uint32_t nword;			// words of the whole word dictionary
+    uint32_t word[CACHE_MAX_WORDS];
+    char pool[];
+};
+
+static char *active_table[256];
+
+static int cache_src_stat(const char *path, struct cache_src *src)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1)
+        return -1;
+    src->ino = st.st_ino;
+    src->size = st.st_size;
+    src->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL
+                  + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+ * $XDG_CACHE_HOME/morse or ~/.cache/morse, created when mkdirs is set.
+ * Returns the length of the path or -1.
+ */
+int morse_cache_dir(char *path, size_t len, int mkdirs)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+
+    if (xdg && *xdg)
+        n = snprintf(path, len, "%s/morse", xdg);
+    else if (home && *home)
+        n = snprintf(path, len, "%s/.cache/morse", home);
+    else
+        return -1;
+    if (n < 0 || (size_t)n >= len)
+        return -1;
+    if (mkdirs) {
+        char *p = path + 1;
+
+        while ((p = strchr(p, '/'))) {
+            *p = '\0';
+            mkdir(path, 0755);
+            *p++ = '/';
+        }
+        mkdir(path, 0755);
+    }
+    return n;
+}
+
+/*
+ * One cache per set of config files, so alternating -c files does not
+ * rebuild the cache every run.
+ */
+static int cache_path(const char **srcs, int nsrc, char *path, size_t len,
+                      int mkdirs)
+{
+    uint32_t hash = 2166136261u;
+    int n = morse_cache_dir(path, len, mkdirs);
+
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < nsrc; i++)
+        for (const char *p = srcs[i]; ; p++) {
+            hash = (hash ^ (unsigned char)*p) * 16777619u;	// FNV-1a
+            if (!*p)
+                break;
+        }
+    n = snprintf(path + n, len - n, "/config-%08x.bin", hash);
+    return n < 0 ? -1 : 0;
+}
+
+// Point the active tables and settings into a mapped cache.
+static void cache_apply(struct cache_file *c, struct start_options *options)
+{
+    static struct morse_prosign prosigns[CACHE_MAX_PROSIGNS];
+    static char *words[CACHE_MAX_WORDS];
+
+    for (int i = 0; i < 256; i++)
+        active_table[i] = c->pool + c->code[i];
+    morse_active = active_table;
+    morse_active_size = 256;
+
+    for (uint32_t i = 0; i < c->nprosign; i++) {
+        prosigns[i].name = c->pool + c->prosign[i].name;
+        prosigns[i].code = c->pool + c->prosign[i].code;
+        prosigns[i].len = strlen(prosigns[i].name);
+    }
+    morse_prosigns = c->nprosign ? prosigns : NULL;
+    morse_nprosigns = c->nprosign;
+
+    if (!options->wpm)
+        options->wpm = c->wpm;
+    if (!options->farnsworth)
+        options->farnsworth = c->farnsworth;
+    if (options->mode == MORS_NONE)
+        options->mode = c->mode;
+    if (!options->jobs)
+        options->jobs = c->jobs;
+    if (!options->outdir && c->outdir)
+        options->outdir = c->pool + c->outdir;
+
+    // Config words turn the dictionary on as well.
+    for (uint32_t i = 0; i < c->nword; i++)
+        words[i] = c->pool + c->word[i];
+    if (c->nword) {
+        options->words = 1;
+        options->extra_words = words;
+        options->nextra_words = c->nword;
+    }
+}
+
+// The string at pool offset off, NULL when it is outside or too long.
+static const char *cache_str(const struct cache_file *c, size_t pool_len,
+                             uint32_t off, size_t max)
+{
+    if (off >= pool_len)
+        return NULL;
+    return strlen(c->pool + off) <= max ? c->pool + off : NULL;
+}
+
+// Space and newline are sent as the word gap, " ".
+static int cache_code(const char *code, size_t max)
+{
+    return code && strlen(code) <= max && strspn(code, ".- ") == strlen(code);
+}
+
+/*
+ * A truncated or corrupt cache must not send a lookup outside the
+ * mapping.  The pool has to end in a NUL, then every string in it is
+ * checked the way the parser checked it before it was stored.
+ */
+static int cache_valid(const struct cache_file *c, size_t pool_len)
+{
+    const char *name, *code, *word;
+
+    if (!pool_len || c->pool[0] || c->pool[pool_len - 1] || c->mode > MORS_DECO)
+        return 0;
+    for (int i = 0; i < 256; i++)
+        if (!cache_code(cache_str(c, pool_len, c->code[i], MORSE_CODE_MAX),
+                        MORSE_CODE_MAX))
+            return 0;
+    for (uint32_t i = 0; i < c->nprosign; i++) {
+        name = cache_str(c, pool_len, c->prosign[i].name, MORSE_TOKEN_MAX);
+        code = cache_str(c, pool_len, c->prosign[i].code, MORSE_TOKEN_MAX);
+        if (!name || !*name || !cache_code(code, MORSE_TOKEN_MAX)
+            || strlen(name) + 2 > strlen(code) + 1)
+            return 0;
+    }
+    for (uint32_t i = 0; i < c->nword; i++) {
+        word = cache_str(c, pool_len, c->word[i], MORSE_WORD_MAX);
+        if (!word || strlen(word) < 2)
+            return 0;
+    }
+    return cache_str(c, pool_len, c->outdir, PATH_MAX) != NULL;
+}
+
+static int cache_load(const char **srcs, int nsrc, struct start_options *options)
+{
+    char path[PATH_MAX];
+    struct cache_file *c;
+    struct stat st;
+    int fd;
+
+    if (cache_path(srcs, nsrc, path, sizeof(path), 0))
+        return -1;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*c)) {
+        close(fd);
+        return -1;
+    }
+    c = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (c == MAP_FAILED)
+        return -1;
+
+    if (memcmp(c->magic, CACHE_MAGIC, sizeof(c->magic))
+        || c->size != st.st_size || c->nsrc != (uint32_t)nsrc
+        || c->nprosign > CACHE_MAX_PROSIGNS || c->nword > CACHE_MAX_WORDS
+        || !cache_valid(c, st.st_size - sizeof(*c)))
+        goto stale;
+    for (int i = 0; i < nsrc; i++) {
+        struct cache_src src;
+
+        if (cache_src_stat(srcs[i], &src)
+            || memcmp(&src, &c->src[i], sizeof(src)))
+            goto stale;
+    }
+
+    // The mapping stays for the life of the process, the tables live in it.
+    cache_apply(c, options);
+    return 0;
+
+stale:
+    munmap(c, st.st_size);
+    return -1;
+}
+
+struct cache_build {
+    struct cache_file *c;
+    size_t pool_len;
+};
+
+static uint32_t pool_add(struct cache_build *b, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    uint32_t off = b->pool_len;
+
+    if (len == 1)
+        return 0;
+    if (b->pool_len + len > CACHE_POOL_MAX) {
+        fprintf(stderr, "Error: config too large\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(b->c->pool + off, s, len);
+    b->pool_len += len;
+    return off;
+}
+
+static int valid_code(const char *code)
+{
+    size_t n = strspn(code, ".-");
+
+    return n && n == strlen(code) && n <= MORSE_CODE_MAX;
+}
+
+static void config_error(const char *path, const char *what, const char *title)
+{
+    fprintf(stderr, "Error: %s: bad %s \"%s\"\n", path, what, title);
+    exit(EXIT_FAILURE);
+}
+
+static void config_parse(struct cache_build *b, const char *path)
+{
+    static cfg_opt_t code_opts[] = {
+        CFG_STR("code", "", CFGF_NONE),
+        CFG_END()
+    };
+    static cfg_opt_t opts[] = {
+        CFG_INT("wpm", 0, CFGF_NONE),
+        CFG_INT("farnsworth", 0, CFGF_NONE),
+        CFG_STR("mode", NULL, CFGF_NONE),
+        CFG_INT("jobs", 0, CFGF_NONE),
+        CFG_STR("outdir", NULL, CFGF_NONE),
+        CFG_STR_LIST("words", NULL, CFGF_NONE),
+        CFG_SEC("letter", code_opts, CFGF_MULTI | CFGF_TITLE),
+        CFG_SEC("prosign", code_opts, CFGF_MULTI | CFGF_TITLE),
+        CFG_END()
+    };
+    struct cache_file *c = b->c;
+    cfg_t *cfg = cfg_init(opts, CFGF_NONE);
+    const char *mode;
+
+    if (cfg_parse(cfg, path) != CFG_SUCCESS) {
+        // libconfuse already reported where.
+        fprintf(stderr, "Error: can't parse %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg_getint(cfg, "wpm"))
+        c->wpm = cfg_getint(cfg, "wpm");
+    if (cfg_getint(cfg, "farnsworth"))
+        c->farnsworth = cfg_getint(cfg, "farnsworth");
+    if (cfg_getint(cfg, "jobs"))
+        c->jobs = cfg_getint(cfg, "jobs");
+    if (cfg_getstr(cfg, "outdir"))
+        c->outdir = pool_add(b, cfg_getstr(cfg, "outdir"));
+    mode = cfg_getstr(cfg, "mode");
+    if (mode) {
+        if (!strcmp(mode, "encode"))
+            c->mode = MORS_ENCO;
+        else if (!strcmp(mode, "decode"))
+            c->mode = MORS_DECO;
+        else
+            config_error(path, "mode", mode);
+    }
+
+    for (unsigned i = 0; i < cfg_size(cfg, "letter"); i++) {
+        cfg_t *sec = cfg_getnsec(cfg, "letter", i);
+        const char *title = cfg_title(sec), *code = cfg_getstr(sec, "code");
+
+        // Anything past ASCII is UTF-8 text and goes to the alphabets.
+        if (strlen(title) != 1 || (unsigned char)title[0] >= 0x80)
+            config_error(path, "letter", title);
+        if (*code && !valid_code(code))
+            config_error(path, "code", code);
+        c->code[(unsigned char)title[0]] = pool_add(b, code);
+    }
+
+    for (unsigned i = 0; i < cfg_size(cfg, "prosign"); i++) {
+        cfg_t *sec = cfg_getnsec(cfg, "prosign", i);
+        const char *title = cfg_title(sec), *code = cfg_getstr(sec, "code");
+
+        /*
+         * Decoding writes "<NAME>" for the code, keep that no longer than
+         * the code and its gap so the decode buffer bound still holds.
+         */
+        if (!*title || strlen(title) + 2 > strlen(code) + 1
+            || strpbrk(title, "<> "))
+            config_error(path, "prosign", title);
+        if (strspn(code, ".-") != strlen(code) || strlen(code) > MORSE_TOKEN_MAX)
+            config_error(path, "code", code);
+        if (c->nprosign == CACHE_MAX_PROSIGNS)
+            config_error(path, "prosign, too many", title);
+        c->prosign[c->nprosign].name = pool_add(b, title);
+        c->prosign[c->nprosign].code = pool_add(b, code);
+        c->nprosign++;
+    }
+
+    for (unsigned i = 0; i < cfg_size(cfg, "words"); i++) {
+        const char *word = cfg_getnstr(cfg, "words", i);
+        size_t len = strlen(word);
+
+        if (len < 2 || len > MORSE_WORD_MAX
+            || strspn(word, "abcdefghijklmnopqrstuvwxyz"
+                            "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") != len)
+            config_error(path, "word", word);
+        if (c->nword == CACHE_MAX_WORDS)
+            config_error(path, "word, too many", word);
+        c->word[c->nword++] = pool_add(b, word);
+    }
+
+    cfg_free(cfg);
+}
+
+static void cache_store(const char **srcs, int nsrc, struct cache_file *c)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    int fd, ok;
+
+    if (cache_path(srcs, nsrc, path, sizeof(path), 1))
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return;
+    ok = write(fd, c, c->size) == (ssize_t)c->size;
+    if (close(fd) == -1)
+        ok = 0;
+    // Readers either see the old cache or the complete new one.
+    if (!ok || rename(tmp, path) == -1)
+        unlink(tmp);
+}
+
+static void config_compile(const char **srcs, int nsrc,
+                           struct start_options *options)
+{
+    struct cache_build b;
+    struct cache_file *c;
+
+    c = calloc(1, sizeof(*c) + CACHE_POOL_MAX);
+    if (!c) {
+        perror("Error loading config");
+        exit(EXIT_FAILURE);
+    }
+    b.c = c;
+    b.pool_len = 1;			// offset 0 is ""
+
+    memcpy(c->magic, CACHE_MAGIC, sizeof(c->magic));
+    for (int i = 0; i < MORSE_CODE_SIZE; i++)
+        c->code[i] = pool_add(&b, morse_code[i]);
+
+    for (int i = 0; i < nsrc; i++) {
+        if (cache_src_stat(srcs[i], &c->src[i])) {
+            perror(srcs[i]);
+            exit(EXIT_FAILURE);
+        }
+        config_parse(&b, srcs[i]);
+    }
+    c->nsrc = nsrc;
+    c->size = sizeof(*c) + b.pool_len;
+
+    cache_store(srcs, nsrc, c);
+    // Keep the heap copy, the active tables point into it from now on.
+    cache_apply(c, options);
+}
+
+void process_config_file(struct start_options *options)
+{
+    const char *srcs[CACHE_MAX_SRC];
+    char dot[PATH_MAX];
+    const char *home = getenv("HOME");
+    int nsrc = 0;
+
+    if (options->config_file)
+        srcs[nsrc++] = options->config_file;
+    else {
+        if (access(ETC_FILE_PATH_AND_NAME, R_OK) == 0)
+            srcs[nsrc++] = ETC_FILE_PATH_AND_NAME;
+        if (home && snprintf(dot, sizeof(dot), "%s/%s", home, DOT_FILE_NAME)
+                    < (int)sizeof(dot)
+            && access(dot, R_OK) == 0)
+            srcs[nsrc++] = dot;
+    }
+    if (!nsrc)
+        return;
+
+    if (cache_load(srcs, nsrc, options) == 0)
+        return;
+    config_compile(srcs, nsrc, options);
+}
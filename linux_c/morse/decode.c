@@ -62,115 +62,27 @@
  *  
  */
 #include "morse.h"
-#include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 
-/* WARNING WARNING This array of strings is position sensitive WARNING WARNING */
-/* Do NOT make changes unless you fully understand what this table does.       */
+/* The table is in morse_table.h, shared with morse.hpp. */
 char *morse_code[] = {
-	"", "", "", "", "", "", "", "", "", "",
-	" ",		/* use space instead of \n Use this for timing of words, this is not in Morse code */
-	"", "", "", "", "", "", "", "", "",
-	"", "", "", "", "", "", "", "", "", "",
-	"", "",
-	" ",	 	/* space Use this for timing of words, this is not in Morse code */	
-	"-.-.--",	/* !	Not in ITU-R recommendation */
-	".-..-.",	/* " */	
-	"",		/* #	Char not in Morse Code */
-	"",		/* $	Char not in Morse Code */
-	"",		/* %	Char not in Morse Code */
-	".-...",	/* & */	
-	".----.",	/* ' */	
-	"-.--.",	/* ( */	
-	"-.--.-",	/* ) */	
-	"",		/* *	Char not in Morse Code */
-	".-.-.",	/* + */	
-	"--..--",	/* , */	
-	"-....-",	/* - */	
-	".-.-.-",	/* . */	
-	"-..-.",	/* / */	
-	"-----",	/* 0 */	
-	".----",	/* 1 */	
-	"..---",	/* 2 */	
-	"...--",	/* 3 */	
-	"....-",	/* 4 */	
-	".....",	/* 5 */	
-	"-....",	/* 6 */		
-	"--...",	/* 7 */		
-	"---..",	/* 8 */		
-	"----.",	/* 9 */		
-	"---...",	/* : */		
-	"",		/* ;	Char not in Morse Code */
-	"",		/* <	Char not in Morse Code */
-	"-...-",	/* = */	
-	"",		/* >	Char not in Morse Code */
-	"..--..",	/* ? */	
-	".--.-.",	/* @ */	
-	".-",		/* A */	
-	"-...",		/* B */	
-	"-.-.",		/* C */	
-	"-..",		/* D */	
-	".",		/* E */	
-	"..-.",		/* F */	
-	"--.",		/* G */	
-	"....",		/* H */	
-	"..",		/* I */	
-	".---",		/* J */	
-	"-.-",		/* K */	
-	".-..",		/* L */	
-	"--",		/* M */	
-	"-.",		/* N */	
-	"---",		/* O */	
-	".--.",		/* P */	
-	"--.-",		/* Q */	
-	".-.",		/* R */	
-	"...",		/* S */	
-	"-",		/* T */	
-	"..-",		/* U */	
-	"...-",		/* V */	
-	".--",		/* W */	
-	"-..-",		/* X */	
-	"-.--",		/* Y */	
-	"--..",		/* Z */	
-	"",		/* [	Char not in Morse Code */
-	"",		/* \	Char not in Morse Code */
-	"",		/* ]	Char not in Morse Code */
-	"",		/* ^	Char not in Morse Code */
-	"",		/* _	Char not in Morse Code */
-	"",		/* `	Char not in Morse Code */
-	".-",		/* a */	
-	"-...",		/* b */	
-	"-.-.",		/* c */	
-	"-..",		/* d */	
-	".",		/* e */	
-	"..-.",		/* f */	
-	"--.",		/* g */	
-	"....",		/* h */	
-	"..",		/* i */	
-	".---",		/* j */	
-	"-.-",		/* k */	
-	".-..",		/* l */	
-	"--",		/* m */	
-	"-.",		/* n */	
-	"---",		/* o */	
-	".--.",		/* p */	
-	"--.-",		/* q */	
-	".-.",		/* r */	
-	"...",		/* s */	
-	"-",		/* t */	
-	"..-",		/* u */	
-	"...-",		/* v */	
-	".--",		/* w */	
-	"-..-",		/* x */	
-	"-.--",		/* y */	
-	"--.."		/* z */	
+#include "morse_table.h"
 	};// Nothing below in the ASCII table in Morse Code
 
 int sizeof_morsecode() { return sizeof(morse_code)/sizeof(char *);};
 
+// Switched over by process_config_file().
+char **morse_active = morse_code;
+size_t morse_active_size = MORSE_CODE_SIZE;
+struct morse_prosign *morse_prosigns;
+size_t morse_nprosigns;
+
+_Static_assert(sizeof(morse_code)/sizeof(char *) == MORSE_CODE_SIZE,
+	       "MORSE_CODE_SIZE out of sync with morse_code[]");
+
 #define HASHSIZE 256
 
 // NOTE: should typedef before declaring the struct. 
@@ -184,21 +96,23 @@ struct _hash_item {
 
 
 static hash_item hmorse[HASHSIZE];
+static int hmorse_built;
 
-static int hash_func(char * str) {
-	long val =0;
-	for (int i=0; i< strlen(str); i++) {
-		val += (long)pow(137, strlen(str) - (i + 1)*str[i]);
-		val %= HASHSIZE;
-	}
+// Nodes of the chains and the alphabet indexes, freed in one go.
+struct arena morse_tables;
+
+static int hash_func(const char * str) {
+	unsigned val = 0;
 
-	return (int)val;
+	for (; *str; str++)
+		val = val * 137 + (unsigned char)*str;
+	return val % HASHSIZE;
 }
 
 static void hash_insert(char * k, char v) {
 	hash_item *tp;
 	for (tp=&hmorse[hash_func(k)]; tp->nxt; tp=tp->nxt) {
-		if (strlen(tp->morse)==strlen(k) &&!strncmp(tp->morse, k, strlen(tp->morse))) {
+		if (!strcmp(tp->morse, k)) {
 			pr_dbg("conflict tab entry: k1: %s, v1: %c, \
 					k2: %s, v2: %c\n", tp->morse, tp->c, k, v);
 			return;
@@ -206,14 +120,21 @@ static void hash_insert(char * k, char v) {
 	}
 	tp->morse = k;
 	tp->c = v;
-	tp->nxt = calloc(1, sizeof(hash_item));
+	tp->nxt = arena_alloc(&morse_tables, sizeof(hash_item));
+	memset(tp->nxt, 0, sizeof(hash_item));
 }
 
 void hmorse_init() {
 	char *ts;
-	pr_dbg("tab size: %d\n", sizeof_morsecode());
-	for (uint8_t i=0; i< sizeof_morsecode(); i++) {
-		ts = morse_code[i];
+
+	// Tables are read only once built, build them once per process.
+	if (hmorse_built)
+		return;
+	hmorse_built = 1;
+	alphabet_init();
+	pr_dbg("tab size: %zu\n", morse_active_size);
+	for (size_t i=0; i< morse_active_size; i++) {
+		ts = morse_active[i];
 		if(ts[0] == '\0')
 			continue;
 		pr_dbg("morse hash tab:%s\n", ts);
@@ -221,29 +142,18 @@ void hmorse_init() {
 	}
 }
 
+// Drop the tables, the next hmorse_init() builds them again.
 void hmorse_relase() {
-	hash_item *tp, *tn=NULL;
-	for (int i=0;i<HASHSIZE; i++) {
-		tp=hmorse[i].nxt;
-		if (!tp)
-			continue;
-		for (;tp->nxt; tp=tp->nxt) {
-			tn = tp->nxt;
-			free(tp);
-			tp = tn;
-		}
-		if (tp)
-			free(tp);
-		if (tn)
-			free(tn);
-	}
+	memset(hmorse, 0, sizeof(hmorse));
+	arena_reset(&morse_tables);
+	hmorse_built = 0;
 }
 
 char morse2char(char *s) {
 	hash_item *tp;
 
 	for (tp=&hmorse[hash_func(s)]; tp->nxt; tp=tp->nxt) {
-		if (!strncmp(tp->morse, s, strlen(tp->morse)))
+		if (!strcmp(tp->morse, s))
 			return tp->c;
 	}
 
@@ -252,15 +162,192 @@ char morse2char(char *s) {
 	return ' ';
 }
 
+/*
+ * Streaming decoder, tokens are split on any white space and may straddle
+ * calls to morse_decoder_feed().  A run of more than one separator is a
+ * word gap (encoding a space gives three) and decodes to a single space.
+ */
+void morse_decoder_init(struct morse_decoder *d) {
+	memset(d, 0, sizeof(*d));
+}
+
+static inline int is_separator(char c) {
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static size_t decoder_prosign(const char *tok, char *out) {
+	for (size_t i = 0; i < morse_nprosigns; i++) {
+		struct morse_prosign *ps = &morse_prosigns[i];
+
+		if (!strcmp(ps->code, tok)) {
+			out[0] = '<';
+			memcpy(out + 1, ps->name, ps->len);
+			out[ps->len + 1] = '>';
+			return ps->len + 2;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Letters of the selected alphabet win over ASCII, the Latin extensions
+ * only fill in codes the ASCII table does not have.
+ */
+static size_t decoder_letter(char *tok, char *out, struct morse_stats *st) {
+	uint32_t cp;
+	char c;
+
+	if (morse_alphabet->prefer && (cp = alphabet_decode(morse_alphabet, tok)))
+		return utf8_encode(cp, out);
+	c = morse2char(tok);
+	if (c == ' ' && (cp = alphabet_decode(alphabet_latin(), tok)))
+		return utf8_encode(cp, out);
+	st->unknown += c == ' ';
+	out[0] = c;
+	return 1;
+}
+
+/*
+ * The letter or prosign of one token as the decoder gives it, 0 when the
+ * token has none.
+ */
+size_t morse_token_letter(const char *tok, char *out) {
+	uint32_t cp;
+	size_t n;
+	char c;
+
+	if (morse_nprosigns && (n = decoder_prosign(tok, out)))
+		return n;
+	if (morse_alphabet->prefer && (cp = alphabet_decode(morse_alphabet, tok)))
+		return utf8_encode(cp, out);
+	if ((c = morse2char((char *)tok)) != ' ') {
+		out[0] = c;
+		return 1;
+	}
+	if ((cp = alphabet_decode(alphabet_latin(), tok)))
+		return utf8_encode(cp, out);
+	return 0;
+}
+
+static inline size_t decoder_token(struct morse_decoder *d, char *out,
+				   struct morse_stats *st) {
+	size_t n = 0;
+
+	st->letters++;
+	if (d->ntok > MORSE_TOKEN_MAX) {
+		out[n++] = ' ';	// no code is that long
+		st->unknown++;
+	} else {
+		d->tok[d->ntok] = '\0';
+		if (morse_nprosigns)
+			n = decoder_prosign(d->tok, out);
+		if (!n)
+			n = decoder_letter(d->tok, out, st);
+	}
+	d->ntok = 0;
+	return n;
+}
+
+static inline size_t decoder_run(struct morse_decoder *d, const char *in,
+				 size_t len, char *out, struct morse_stats *st) {
+	char *p = out;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = in[i];
+
+		if (is_separator(c)) {
+			if (d->ntok)
+				p += decoder_token(d, p, st);
+			d->gap++;
+			continue;
+		}
+		if (d->gap > 1 && d->started)
+			*p++ = ' ';
+		d->gap = 0;
+		d->started = 1;
+		if (d->ntok < MORSE_TOKEN_MAX)
+			d->tok[d->ntok] = c;
+		d->ntok++;
+	}
+	return p - out;
+}
+
+size_t morse_decoder_feed(struct morse_decoder *d, const char *in, size_t len,
+			  char *out) {
+	struct morse_stats *st = morse_stats_get();
+	size_t n = decoder_run(d, in, len, out, st);
+
+	st->bytes_in += len;
+	st->bytes_out += n;
+	MORSE_PROBE3(decode, in, len, n);
+	return n;
+}
+
+size_t morse_decoder_finish(struct morse_decoder *d, char *out) {
+	struct morse_stats *st = morse_stats_get();
+	size_t n = 0;
+
+	if (d->ntok)
+		n = decoder_token(d, out, st);
+	st->bytes_out += n;
+	morse_decoder_init(d);
+	return n;
+}
+
+/*
+ * Decode len bytes of morse into out, which must hold at least
+ * MORSE_DECODE_BOUND(len) bytes.  The input is left untouched so it may
+ * be a read only mapping.
+ */
+size_t morse_decode_buf(const char *in, size_t len, char *out) {
+	struct morse_decoder d;
+	size_t n;
+
+	morse_decoder_init(&d);
+	n = morse_decoder_feed(&d, in, len, out);
+	return n + morse_decoder_finish(&d, out + n);
+}
+
+// See morse.h, every record starts a fresh decoder.
+size_t morse_decode_many(const char *const *rec, const size_t *len,
+			 size_t n, char *out, size_t *out_off) {
+	struct morse_stats *st = morse_stats_get();
+	struct morse_decoder d;
+	size_t total = 0, p = 0;
+
+	out_off[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		morse_decoder_init(&d);
+		p += decoder_run(&d, rec[i], len[i], out + p, st);
+		if (d.ntok)
+			p += decoder_token(&d, out + p, st);
+		out_off[i + 1] = p;
+		total += len[i];
+	}
+	st->bytes_in += total;
+	st->bytes_out += p;
+	MORSE_PROBE3(decode_many, n, total, p);
+	return p;
+}
+
 void morse_decode(struct start_options options) {
-// split by word space
-    char *s=options.message, *sec;
-    hmorse_init();
-    sec = strtok(s, " ");
-
-    while (sec) {
-        pr_dbg("sec: %s\n", sec);
-        printf("%c", morse2char(sec));
-        sec = strtok(NULL, " ");
-    }
+	char buf[MORSE_DECODE_BOUND(MORSE_CHUNK)];
+	struct morse_decoder d;
+	size_t off, n, total = 0;
+
+	hmorse_init();
+	morse_decoder_init(&d);
+	for (off = 0; off < options.length; off += n) {
+		uint64_t start = morse_stats_chunk_start();
+
+		n = options.length - off;
+		if (n > MORSE_CHUNK)
+			n = MORSE_CHUNK;
+		total += fwrite(buf, 1, morse_decoder_feed(&d, options.message + off,
+							   n, buf), stdout);
+		morse_stats_chunk_end(start);
+	}
+	total += fwrite(buf, 1, morse_decoder_finish(&d, buf), stdout);
+	fflush(stdout);
+	morse_stats_flush(total);
 }
@@ -31,6 +31,10 @@
 #include "morse.h"
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef RASPBERRY_PI
 #include <pigpiod_if2.h>
 #define ON 1
@@ -41,7 +45,7 @@ void encode_char(char letter)
 {
     char *morse_code_string;
     
-    morse_code_string = morse_code[(int)letter];
+    morse_code_string = morse_lookup(letter);
 
     while (*morse_code_string){
         printf("%c", *morse_code_string++);
@@ -49,16 +53,484 @@ void encode_char(char letter)
     return;
 }
 
+/*
+ * Match a configured prosign written as <NAME> at in, returns the number
+ * of input bytes it covers.
+ */
+static size_t encode_prosign(const char *in, size_t len, const char **code)
+{
+    for (size_t i = 0; i < morse_nprosigns; i++) {
+        struct morse_prosign *ps = &morse_prosigns[i];
+
+        if (ps->len + 2 <= len && in[ps->len + 1] == '>'
+            && !memcmp(in + 1, ps->name, ps->len)) {
+            *code = ps->code;
+            return ps->len + 2;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Length of the run of ASCII bytes at in, 16 bytes at a time where SSE2
+ * is available.  Pure ASCII text is then encoded by the plain table loop
+ * below without looking at UTF-8 at all.  Runs are scanned a block at a
+ * time so the text is still in cache when it is encoded.
+ */
+#define ASCII_BLOCK 256
+
+static size_t ascii_run(const char *in, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(in + i)));
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < len && !(in[i] & 0x80))
+        i++;
+    return i;
+}
+
+static inline char *encode_code(char *p, const char *code)
+{
+    while (*code)
+        *p++ = *code++;
+    *p++ = ' ';
+    return p;
+}
+
+/*
+ * Common words, encoded whole.  A word of the dictionary at the start of
+ * a word in the text is copied as its complete morse in one go instead of
+ * letter by letter, the bytes are the same either way.  The built in
+ * words are the most frequent of English and of amateur radio traffic, a
+ * config file may add more.  Every word is entered as written here, in
+ * upper case and capitalised, so the lookup needs no case folding.
+ *
+ * The word is its own key, up to MORSE_WORD_MAX letters read as two 64
+ * bit loads and masked to its length, and the morse is copied with a fixed
+ * WORD_SHORT or WORD_COPY bytes so neither takes a branch per letter.  Both read and
+ * write past the word, the path is only taken WORD_SLACK bytes or more
+ * before the end of the input: the output bound leaves 7 bytes per input
+ * byte still to come.
+ */
+#define WORD_COPY 96			// >= MORSE_WORD_MAX * (MORSE_CODE_MAX + 1)
+#define WORD_SHORT 32			// copy of the words with less morse
+#define WORD_SLACK 16			// input bytes, 7 * 16 >= WORD_COPY
+#define WORD_BITS 11			// hash table of 2^WORD_BITS slots
+
+_Static_assert(WORD_COPY >= MORSE_WORD_MAX * (MORSE_CODE_MAX + 1), "word copy too short");
+_Static_assert(WORD_SLACK * (MORSE_CODE_MAX + 1) >= WORD_COPY, "word slack too short");
+_Static_assert(MORSE_WORD_MAX < WORD_SLACK, "word key too long");
+
+struct word_slot {
+    uint64_t lo, hi;			// the word, zero padded
+    const char *morse;
+    size_t mlen;
+};
+
+static struct word_dict {
+    uint16_t tag[1 << WORD_BITS];	// hash bits of the slot, 0 is empty
+    struct word_slot slot[1 << WORD_BITS];
+    char (*morse)[WORD_COPY];
+    size_t nwords;
+} *morse_words;
+
+static const char *const common_words[] = {
+    // English
+    "the", "of", "and", "to", "in", "is", "you", "that", "it", "he", "was",
+    "for", "on", "are", "as", "with", "his", "they", "at", "be", "this",
+    "have", "from", "or", "one", "had", "by", "word", "but", "not", "what",
+    "all", "were", "we", "when", "your", "can", "said", "there", "use",
+    "an", "each", "which", "she", "do", "how", "their", "if", "will", "up",
+    "other", "about", "out", "many", "then", "them", "these", "so", "some",
+    "her", "would", "make", "like", "him", "into", "time", "has", "look",
+    "two", "more", "write", "go", "see", "number", "no", "way", "could",
+    "people", "my", "than", "first", "water", "been", "call", "who", "its",
+    "now", "find", "long", "down", "day", "did", "get", "come", "made",
+    "may", "part", "over", "new", "also", "after", "only", "any", "most",
+    "such", "where", "our", "me", "just", "very", "through", "back", "much",
+    "before", "should", "well", "because", "same", "between", "must",
+    "those", "here", "both", "used", "under", "while", "last", "never",
+    "us", "even", "again", "off", "work", "know", "take", "place", "year",
+    "years", "good", "give", "name", "still", "own", "why", "being",
+    "might", "every", "another", "without", "does", "set", "end", "three",
+    "small", "next", "right", "old", "per", "thing", "things", "need",
+    "since", "until", "around", "however", "house", "point", "world",
+    "still", "great", "little", "left", "life", "home", "want", "thought",
+    // amateur radio
+    "cq", "de", "rst", "ur", "es", "fb", "om", "yl", "hr", "hw", "pse",
+    "agn", "tnx", "tks", "tu", "bk", "kn", "sk", "ar", "qth", "qsl", "qso",
+    "qrz", "qrm", "qrn", "qrp", "qrt", "qrv", "qrx", "qsb", "qsy", "wx",
+    "rig", "ant", "pwr", "op", "dx", "gm", "ga", "ge", "gn", "cul", "cuagn",
+    "abt", "fer", "hi", "nr", "rpt", "sri", "vy", "wid", "wkd", "test",
+    "73", "88", "599", "5nn", "559", "579", "589", "100", "1200",
+};
+
+static inline int word_char(unsigned char c)
+{
+    return (unsigned)((c | 0x20) - 'a') < 26 || (unsigned)(c - '0') < 10;
+}
+
+// The n letters at w as a key, w must be readable for 16 bytes.
+static inline void word_key(const char *w, size_t n, uint64_t *lo, uint64_t *hi)
+{
+    memcpy(lo, w, 8);
+    memcpy(hi, w + 8, 8);
+    if (n < 8) {
+        *lo &= ~0ULL >> (64 - 8 * n);
+        *hi = 0;
+    } else if (n > 8)
+        *hi &= ~0ULL >> (64 - 8 * (n - 8));
+    else
+        *hi = 0;
+}
+
+static inline uint64_t word_hash(uint64_t lo, uint64_t hi)
+{
+    return (lo ^ hi * 0xbf58476d1ce4e5b9ULL) * 0x9e3779b97f4a7c15ULL;
+}
+
+// Slot in the top bits, tag below it, never 0.
+#define WORD_SLOT(h) ((uint32_t)((h) >> (64 - WORD_BITS)))
+#define WORD_TAG(h) ((uint16_t)((h) >> (48 - WORD_BITS)) | 1)
+
+static void words_add(struct word_dict *d, const char *w, size_t len)
+{
+    char key[16] = { 0 }, *m = d->morse[d->nwords], *p = m;
+    uint64_t lo, hi, h;
+    uint32_t k;
+
+    memcpy(key, w, len);
+    word_key(key, len, &lo, &hi);
+    h = word_hash(lo, hi);
+    for (k = WORD_SLOT(h); d->tag[k]; k = (k + 1) & ((1 << WORD_BITS) - 1))
+        if (d->slot[k].lo == lo && d->slot[k].hi == hi)
+            return;
+    // Only words the per letter path encodes without an unknown letter.
+    for (size_t i = 0; i < len; i++) {
+        const char *code = morse_lookup(w[i]);
+
+        if (!*code)
+            return;
+        p = encode_code(p, code);
+    }
+    d->tag[k] = WORD_TAG(h);
+    d->slot[k].lo = lo;
+    d->slot[k].hi = hi;
+    d->slot[k].morse = m;
+    d->slot[k].mlen = p - m;
+    d->nwords++;
+}
+
+/*
+ * Build the dictionary from the common words and the extra ones and turn
+ * the whole word path on.  Call once the code table is final, before any
+ * thread encodes.
+ */
+void morse_words_init(char *const *extra, size_t nextra)
+{
+    size_t nwords = sizeof(common_words) / sizeof(common_words[0]) + nextra;
+    struct word_dict *d = calloc(1, sizeof(*d));
+
+    // At most half full, three forms of every word.
+    if (nwords > (1 << WORD_BITS) / 6)
+        nwords = (1 << WORD_BITS) / 6;
+    if (d)
+        d->morse = malloc(3 * nwords * sizeof(*d->morse));
+    if (!d || !d->morse) {
+        perror("Error allocating word dictionary");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nwords; i++) {
+        const char *w = i < nextra ? extra[i] : common_words[i - nextra];
+        size_t len = strlen(w), k;
+        char upper[MORSE_WORD_MAX], cap[MORSE_WORD_MAX];
+
+        for (k = 0; k < len && k < MORSE_WORD_MAX && word_char(w[k]); k++) {
+            upper[k] = w[k] >= 'a' ? w[k] - 32 : w[k];
+            cap[k] = k ? w[k] : upper[k];
+        }
+        // One letter words are no faster whole.
+        if (k != len || len < 2)
+            continue;
+        words_add(d, w, len);
+        words_add(d, upper, len);
+        words_add(d, cap, len);
+    }
+    morse_words_free();
+    morse_words = d;
+}
+
+void morse_words_free(void)
+{
+    if (morse_words) {
+        free(morse_words->morse);
+        free(morse_words);
+        morse_words = NULL;
+    }
+}
+
+/*
+ * The dictionary word at in copied to *p, returns its length or 0 when
+ * there is none.  in must be readable for WORD_SLACK bytes and *p
+ * writable for WORD_COPY.
+ */
+static inline size_t encode_word(const struct word_dict *d, const char *in,
+                                 char **p)
+{
+    const struct word_slot *s;
+    uint64_t lo, hi, h;
+    size_t n = 0;
+    uint32_t k;
+    uint16_t tag;
+
+    while (n <= MORSE_WORD_MAX && word_char(in[n]))
+        n++;
+    if (n < 2 || n > MORSE_WORD_MAX)
+        return 0;
+    word_key(in, n, &lo, &hi);
+    h = word_hash(lo, hi);
+    tag = WORD_TAG(h);
+    for (k = WORD_SLOT(h); d->tag[k]; k = (k + 1) & ((1 << WORD_BITS) - 1))
+        if (d->tag[k] == tag && (s = &d->slot[k])->lo == lo && s->hi == hi) {
+            // Short words are most of them, do not store 96 bytes for those.
+            if (s->mlen <= WORD_SHORT)
+                memcpy(*p, s->morse, WORD_SHORT);
+            else
+                memcpy(*p, s->morse, WORD_COPY);
+            *p += s->mlen;
+            return n;
+        }
+    return 0;
+}
+
+// The encoder proper, the callers add up the counters.
+static inline size_t encode_text(const char *in, size_t len, char *out,
+                                 uint64_t *nletters, uint64_t *nunknown)
+{
+    const struct word_dict *words = morse_words;
+    uint64_t letters = 0, unknown = 0;
+    char *p = out;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t block = len - i < ASCII_BLOCK ? len - i : ASCII_BLOCK;
+        size_t end = i + ascii_run(in + i, block);
+        const char *codes[2];
+        uint32_t cp;
+        size_t n;
+        int ncodes;
+
+        for (; i < end; i++) {
+            const char *code;
+
+            if (words && (i == 0 || in[i - 1] == ' ') && len - i >= WORD_SLACK
+                && (n = encode_word(words, in + i, &p))) {
+                letters += n;
+                i += n - 1;
+                continue;
+            }
+            code = morse_lookup(in[i]);
+            if (in[i] == '<' && morse_nprosigns) {
+                n = encode_prosign(in + i, len - i, &code);
+                if (n)
+                    i += n - 1;
+            }
+            unknown += !*code;
+            letters++;
+            p = encode_code(p, code);
+        }
+        if (i == len)
+            break;
+        if (!(in[i] & 0x80))
+            continue;			// end of the block, or past a prosign
+
+        // One UTF-8 letter, bytes that are not valid UTF-8 encode to nothing.
+        n = utf8_decode((const unsigned char *)in + i, len - i, &cp);
+        ncodes = n ? alphabet_encode(cp, codes) : 0;
+        if (!ncodes)
+            p = encode_code(p, "");
+        for (int k = 0; k < ncodes; k++)
+            p = encode_code(p, codes[k]);
+        unknown += !ncodes;
+        letters++;
+        i += n ? n : 1;
+    }
+    *nletters += letters;
+    *nunknown += unknown;
+    return p - out;
+}
+
+/*
+ * Encode len bytes of text into out, which must hold at least
+ * MORSE_ENCODE_BOUND(len) bytes.  Same layout as display_message(), each
+ * letter followed by a space, without the final newline.  Returns the
+ * number of bytes written, out is not NUL terminated.
+ */
+size_t morse_encode_buf(const char *in, size_t len, char *out)
+{
+    struct morse_stats *st = morse_stats_get();
+    size_t n = encode_text(in, len, out, &st->letters, &st->unknown);
+
+    st->bytes_in += len;
+    st->bytes_out += n;
+    MORSE_PROBE3(encode, in, len, n);
+    return n;
+}
+
+// See morse.h, the per call costs are paid once for all records.
+size_t morse_encode_many(const char *const *rec, const size_t *len,
+                         size_t n, char *out, size_t *out_off)
+{
+    struct morse_stats *st = morse_stats_get();
+    uint64_t letters = 0, unknown = 0;
+    size_t total = 0, p = 0;
+
+    out_off[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        p += encode_text(rec[i], len[i], out + p, &letters, &unknown);
+        out_off[i + 1] = p;
+        total += len[i];
+    }
+    st->bytes_in += total;
+    st->bytes_out += p;
+    st->letters += letters;
+    st->unknown += unknown;
+    MORSE_PROBE3(encode_many, n, total, p);
+    return p;
+}
+
+/*
+ * Where to end a chunk of text that goes on in the next one: before a
+ * UTF-8 letter or a <prosign> cut by the end, the rest is carried over.
+ * A prosign name is shorter than its code, so "<NAME" is at most
+ * MORSE_TOKEN_MAX bytes.
+ */
+size_t encode_boundary(const char *in, size_t len)
+{
+    size_t whole = utf8_boundary(in, len);
+
+    if (morse_nprosigns)
+        for (size_t i = whole; i > 0 && whole - i < MORSE_TOKEN_MAX; i--) {
+            if (in[i - 1] == '>')
+                break;
+            if (in[i - 1] == '<')
+                return i - 1;
+        }
+    return whole;
+}
+
 void display_message(struct start_options options) {
 
-    char *pstring = options.message;
+    char buf[MORSE_ENCODE_BOUND(MORSE_CHUNK)];
+    size_t off, n, total = 1;
+
+    for (off = 0; off < options.length; off += n) {
+        uint64_t start = morse_stats_chunk_start();
 
-    while (*pstring) {
-        encode_char(*pstring++);
-        printf(" ");
+        n = options.length - off;
+        if (n > MORSE_CHUNK)
+            n = encode_boundary(options.message + off, MORSE_CHUNK);
+        total += fwrite(buf, 1, morse_encode_buf(options.message + off, n, buf),
+                        stdout);
+        morse_stats_chunk_end(start);
     }
     printf("\n");
+    fflush(stdout);
+    morse_stats_flush(total);
     return;
 }
 
+/*
+ * display_message() on nthreads threads for a large file, same output.
+ * The text is cut into parts of about chunk bytes after a space or a
+ * newline, so neither a UTF-8 letter nor a <prosign> is split, and every
+ * part is encoded by a pool task into a buffer of its own.  One part per
+ * thread makes a round; the parts of a round are written in order while
+ * the next round is already being encoded.
+ */
+struct encode_part {
+    const char *in;
+    size_t len, n;
+    char *out;
+};
+
+static void encode_part_task(void *arg, int worker)
+{
+    struct encode_part *part = arg;
+    uint64_t start = morse_stats_chunk_start();
+
+    (void)worker;
+    part->n = morse_encode_buf(part->in, part->len, part->out);
+    morse_stats_chunk_end(start);
+}
+
+static size_t encode_cut(const char *in, size_t len, size_t chunk)
+{
+    if (len <= chunk)
+        return len;
+    for (size_t k = chunk; k > chunk - 256; k--)
+        if (in[k - 1] == ' ' || in[k - 1] == '\n')
+            return k;
+    return encode_boundary(in, chunk);
+}
+
+// Queue the next round, returns its number of parts.
+static int encode_round(struct pool *pool, struct encode_part *parts,
+                        int nparts, struct start_options *options,
+                        size_t *off, size_t chunk)
+{
+    int i;
+
+    for (i = 0; i < nparts && *off < options->length; i++) {
+        parts[i].in = options->message + *off;
+        parts[i].len = encode_cut(parts[i].in, options->length - *off, chunk);
+        *off += parts[i].len;
+        pool_submit(pool, encode_part_task, &parts[i]);
+    }
+    return i;
+}
+
+void display_message_parallel(struct start_options *options, int nthreads,
+                              size_t chunk)
+{
+    struct encode_part *parts = calloc(2 * nthreads, sizeof(*parts));
+    char *buf = malloc(2 * nthreads * MORSE_ENCODE_BOUND(chunk));
+    size_t off = 0, total = 1;
+    struct pool *pool;
+    int cur = 0, have, next;
+
+    if (!parts || !buf) {
+        perror("Error allocating encode buffers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 2 * nthreads; i++)
+        parts[i].out = buf + i * MORSE_ENCODE_BOUND(chunk);
+    pool = pool_create(nthreads);
 
+    have = encode_round(pool, parts, nthreads, options, &off, chunk);
+    pool_wait(pool);
+    while (have) {
+        next = encode_round(pool, parts + (cur ^ 1) * nthreads, nthreads,
+                            options, &off, chunk);
+        for (int i = 0; i < have; i++)
+            total += fwrite(parts[cur * nthreads + i].out, 1,
+                            parts[cur * nthreads + i].n, stdout);
+        pool_wait(pool);
+        cur ^= 1;
+        have = next;
+    }
+    printf("\n");
+    fflush(stdout);
+    morse_stats_flush(total);
+
+    pool_destroy(pool);
+    free(buf);
+    free(parts);
+}
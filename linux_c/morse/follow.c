@@ -0,0 +1,250 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Follow mode, morse -e|-d -F <file>, convert a file as it grows.
+ *
+ * The file is converted from the start, then only the bytes appended
+ * since the last read are read and converted, so a day of log costs one
+ * pass over it instead of one pass per run.  Output goes straight to
+ * stdout as soon as it is converted.
+ *
+ * inotify watches the file for writes and its directory for a new file
+ * under the same name.  A file that shrinks below what was read was
+ * truncated and is read again from the start, a file that is renamed or
+ * deleted and replaced (log rotation) is drained to its end and then the
+ * new one is opened and read from its start, like tail -F.
+ *
+ * Encoding holds back a UTF-8 letter cut off at the end of what was
+ * written so far, decoding keeps a partial token in the stream decoder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "morse.h"
+
+#define FOLLOW_READ 65536
+
+struct follow {
+    const char *path;
+    int mode;
+    int fd;
+    int ifd;				// inotify
+    int wd_file, wd_dir;
+    const char *name;			// basename of path, matched in dir events
+    off_t off;				// bytes of the file already converted
+    struct morse_decoder dec;
+    char in[FOLLOW_READ + MORSE_CARRY_MAX];
+    size_t carry;			// incomplete letter or prosign at in[0]
+    char out[MORSE_ENCODE_BOUND(FOLLOW_READ + MORSE_CARRY_MAX) + 1];
+};
+
+static void follow_write(const char *buf, size_t len)
+{
+    size_t total = len;
+
+    while (len) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error writing output");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+    morse_stats_flush(total);
+}
+
+static void follow_convert(struct follow *f, size_t len)
+{
+    uint64_t start = morse_stats_chunk_start();
+    size_t n, whole;
+
+    if (f->mode == MORS_ENCO) {
+        len += f->carry;
+        whole = encode_boundary(f->in, len);
+        n = morse_encode_buf(f->in, whole, f->out);
+        f->carry = len - whole;
+        memmove(f->in, f->in + whole, f->carry);
+    } else
+        n = morse_decoder_feed(&f->dec, f->in, len, f->out);
+    morse_stats_chunk_end(start);
+    if (n)
+        follow_write(f->out, n);
+}
+
+// End of one file's data, flush what the converter still holds.
+static void follow_finish(struct follow *f)
+{
+    size_t n = 0;
+
+    if (f->mode == MORS_ENCO) {
+        if (f->carry)
+            n = morse_encode_buf(f->in, f->carry, f->out);
+        f->carry = 0;
+    } else
+        n = morse_decoder_finish(&f->dec, f->out);
+    if (n)
+        follow_write(f->out, n);
+}
+
+// Read and convert everything appended since the last call.
+static void follow_read(struct follow *f)
+{
+    struct stat st;
+
+    if (f->fd == -1)
+        return;
+    if (fstat(f->fd, &st) == -1) {
+        perror(f->path);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size < f->off) {
+        fprintf(stderr, "morse: %s: file truncated\n", f->path);
+        follow_finish(f);
+        f->off = 0;
+    }
+
+    for (;;) {
+        ssize_t n = pread(f->fd, f->in + f->carry, FOLLOW_READ, f->off);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror(f->path);
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        f->off += n;
+        follow_convert(f, n);
+    }
+}
+
+static void follow_open(struct follow *f)
+{
+    f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (f->fd == -1) {
+        if (errno != ENOENT) {
+            perror(f->path);
+            exit(EXIT_FAILURE);
+        }
+        return;				// wait for it to show up
+    }
+    f->off = 0;
+    f->wd_file = inotify_add_watch(f->ifd, f->path,
+                                   IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF
+                                   | IN_DELETE_SELF);
+    if (f->wd_file == -1) {
+        perror(f->path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The name now points at another file, finish the old one and switch.
+static void follow_reopen(struct follow *f)
+{
+    if (f->fd != -1) {
+        follow_read(f);
+        follow_finish(f);
+        inotify_rm_watch(f->ifd, f->wd_file);
+        close(f->fd);
+        fprintf(stderr, "morse: %s: file replaced, following the new file\n",
+                f->path);
+    }
+    f->fd = -1;
+    f->wd_file = -1;
+    follow_open(f);
+    follow_read(f);
+}
+
+void follow_file(struct start_options options)
+{
+    static struct follow f;
+    char dir[PATH_MAX], base[PATH_MAX];
+    char ev[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    f.path = options.follow;
+    f.mode = options.mode;
+    f.fd = f.wd_file = -1;
+    snprintf(dir, sizeof(dir), "%s", f.path);
+    snprintf(base, sizeof(base), "%s", f.path);
+    f.name = basename(base);
+    hmorse_init();
+    morse_decoder_init(&f.dec);
+
+    f.ifd = inotify_init1(IN_CLOEXEC);
+    if (f.ifd == -1) {
+        perror("Error initializing inotify");
+        exit(EXIT_FAILURE);
+    }
+    f.wd_dir = inotify_add_watch(f.ifd, dirname(dir),
+                                 IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (f.wd_dir == -1) {
+        perror(f.path);
+        exit(EXIT_FAILURE);
+    }
+    follow_open(&f);
+    if (f.fd == -1)
+        fprintf(stderr, "morse: %s: waiting for the file to appear\n", f.path);
+    follow_read(&f);
+
+    for (;;) {
+        ssize_t len = read(f.ifd, ev, sizeof(ev));
+        int replaced = 0, grown = 0;
+
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading inotify events");
+            exit(EXIT_FAILURE);
+        }
+        for (char *p = ev; p < ev + len;) {
+            struct inotify_event *e = (struct inotify_event *)p;
+
+            if (e->wd == f.wd_dir && e->len && !strcmp(e->name, f.name))
+                replaced = 1;
+            else if (e->wd == f.wd_file)
+                grown = 1;
+            p += sizeof(*e) + e->len;
+        }
+        if (replaced)
+            follow_reopen(&f);
+        else if (grown)
+            follow_read(&f);
+    }
+}
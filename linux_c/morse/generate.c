@@ -0,0 +1,615 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Test corpus generator, morse --generate <out>[.wav] -s msg | -f file
+ *                        [-w wpm] [--farnsworth wpm] [--seed n]
+ *                        [--impair drift=%,fist=%,snr=dB,qsb=Hz[:%],qrm=Hz[:dB],tone=Hz,rate=Hz]
+ *
+ * Keys the text the way the keyer would and writes either the timing, one
+ * line per letter with the letter and its key down (+) and up (-)
+ * durations in microseconds,
+ *
+ *   A	+60000 -60000 +180000 -180000
+ *    	-240000			(rest of a word gap, no letter)
+ *
+ * or, for a .wav name, 16 bit mono audio with the letters labelled in
+ * <out>.txt, start, end and letter per line as Audacity reads labels.
+ *
+ * The impairments:
+ *   drift  speed wanders by up to this many percent, over GEN_DRIFT_PERIOD
+ *          letters of text
+ *   fist   every element is off by this many percent, standard deviation
+ *   snr    white gaussian noise, signal to noise ratio over the whole band
+ *   qsb    fading at this rate, down to depth percent (default 50)
+ *   qrm    a steady carrier at this pitch and level against the signal
+ *   tone   pitch of the signal, default GEN_TONE; rate, default GEN_RATE
+ *
+ * The text is cut into GEN_CHUNK sized chunks and each chunk has random
+ * number generators of its own seeded from --seed and its index, so the
+ * output only depends on the text, the settings and the seed, not on -j.
+ * A first pass on the pool keys every chunk to learn its length, a second
+ * keys it again and renders it straight into the mapped output at its
+ * place.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+#define GEN_CHUNK (64 * 1024)
+#define GEN_DRIFT_PERIOD 600		// letters
+#define GEN_TONE 700
+#define GEN_RATE 8000
+#define GEN_RAMP_NS 5000000ULL		// raised cosine key edges
+#define GEN_FULL_SCALE 32767.0
+#define GEN_HEADROOM 0.5		// signal alone peaks at half scale
+#define GEN_NOISE_PEAK 5.0		// standard deviations kept unclipped
+#define GEN_LINE_MAX 512
+#define GEN_WAV_HDR 44
+
+struct gen_chunk {
+    const char *in;
+    size_t len, offset, index;
+    // first pass
+    uint64_t ns;
+    size_t letters, ntext;
+    // second pass, where it goes
+    uint64_t start_ns;
+    size_t text_off;
+};
+
+static struct gen {
+    struct timing_keying timing;
+    uint64_t seed;
+    int wav;
+    unsigned tone, rate;
+    double drift, fist;
+    double amplitude, noise, qsb_hz, qsb_depth, qrm_hz, qrm;
+    unsigned char *audio;		// mapped output, after the header
+    char *text;				// mapped timing or labels
+    int sec_digits;			// of label times, 0 while measuring
+} gen;
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t gen_rand(uint64_t *s)
+{
+    uint64_t x = *s;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static inline double gen_uniform(uint64_t *s)
+{
+    return ((gen_rand(s) >> 11) + 0.5) * 0x1p-53;
+}
+
+// Box-Muller, two normal deviates per call.
+static inline void gen_gauss2(uint64_t *s, double *a, double *b)
+{
+    double r = sqrt(-2.0 * log(gen_uniform(s))), t = 2.0 * M_PI * gen_uniform(s);
+
+    *a = r * cos(t);
+    *b = r * sin(t);
+}
+
+/*
+ * Ziggurat normal deviates for the noise, Marsaglia and Tsang's 128 layer
+ * tables.  Nearly every sample is a multiply and a compare, the layer
+ * comes from other bits than the value.
+ */
+#define ZIG_R 3.442619855899
+#define ZIG_V 9.91256303526217e-3
+
+static uint32_t zig_k[128];
+static double zig_w[128], zig_f[128];
+
+static void zig_init(void)
+{
+    double dn = ZIG_R, tn = dn, q = ZIG_V / exp(-0.5 * dn * dn);
+
+    zig_k[0] = (dn / q) * 2147483648.0;
+    zig_k[1] = 0;
+    zig_w[0] = q / 2147483648.0;
+    zig_w[127] = dn / 2147483648.0;
+    zig_f[0] = 1;
+    zig_f[127] = exp(-0.5 * dn * dn);
+    for (int i = 126; i >= 1; i--) {
+        dn = sqrt(-2 * log(ZIG_V / dn + exp(-0.5 * dn * dn)));
+        zig_k[i + 1] = (dn / tn) * 2147483648.0;
+        tn = dn;
+        zig_f[i] = exp(-0.5 * dn * dn);
+        zig_w[i] = dn / 2147483648.0;
+    }
+}
+
+static double zig_tail(uint64_t *s, int32_t hz, unsigned iz)
+{
+    for (;;) {
+        double x = hz * zig_w[iz], y;
+        uint64_t r;
+
+        if (iz == 0) {
+            do {
+                x = -log(gen_uniform(s)) / ZIG_R;
+                y = -log(gen_uniform(s));
+            } while (y + y < x * x);
+            return hz > 0 ? ZIG_R + x : -ZIG_R - x;
+        }
+        if (zig_f[iz] + gen_uniform(s) * (zig_f[iz - 1] - zig_f[iz]) < exp(-0.5 * x * x))
+            return x;
+        r = gen_rand(s);
+        hz = (int32_t)(r >> 32);
+        iz = r & 127;
+        if ((uint32_t)llabs(hz) < zig_k[iz])
+            return hz * zig_w[iz];
+    }
+}
+
+static inline double gen_gauss(uint64_t *s)
+{
+    uint64_t r = gen_rand(s);
+    int32_t hz = (int32_t)(r >> 32);
+    unsigned iz = r & 127;
+
+    if ((uint32_t)llabs(hz) < zig_k[iz])
+        return hz * zig_w[iz];
+    return zig_tail(s, hz, iz);
+}
+
+static void gen_bad(const char *what)
+{
+    fprintf(stderr, "--impair: bad %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+static void gen_impair(const char *spec)
+{
+    char *copy, *item, *save, *val, *end;
+    double snr = INFINITY, qrm_db = -6;
+
+    gen.tone = GEN_TONE;
+    gen.rate = GEN_RATE;
+    gen.qsb_depth = 0.5;
+    if (spec) {
+        copy = strdup(spec);
+        if (!copy) {
+            perror("Error allocating impairments");
+            exit(EXIT_FAILURE);
+        }
+        for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+            double v, w = NAN;
+
+            val = strchr(item, '=');
+            if (!val)
+                gen_bad(item);
+            *val++ = '\0';
+            v = strtod(val, &end);
+            if (*end == ':')
+                w = strtod(end + 1, &end);
+            if (end == val || *end)
+                gen_bad(item);
+            if (!strcmp(item, "drift"))
+                gen.drift = v / 100;
+            else if (!strcmp(item, "fist"))
+                gen.fist = v / 100;
+            else if (!strcmp(item, "snr"))
+                snr = v;
+            else if (!strcmp(item, "qsb")) {
+                gen.qsb_hz = v;
+                if (!isnan(w))
+                    gen.qsb_depth = w / 100;
+            } else if (!strcmp(item, "qrm")) {
+                gen.qrm_hz = v;
+                if (!isnan(w))
+                    qrm_db = w;
+            } else if (!strcmp(item, "tone"))
+                gen.tone = v;
+            else if (!strcmp(item, "rate"))
+                gen.rate = v;
+            else
+                gen_bad(item);
+        }
+        free(copy);
+    }
+    if (gen.drift < 0 || gen.drift >= 1 || gen.fist < 0 || gen.qsb_depth < 0
+        || gen.qsb_depth > 1 || gen.rate < 1000 || gen.tone == 0
+        || gen.tone * 2 >= gen.rate || gen.qrm_hz * 2 >= gen.rate)
+        gen_bad("value");
+    /*
+     * Relative to the signal, its power is A^2 / 2.  All of it scaled so
+     * the noise is not clipped this side of GEN_NOISE_PEAK deviations.
+     */
+    gen.noise = isinf(snr) ? 0 : 1 / sqrt(2 * pow(10, snr / 10));
+    gen.qrm = gen.qrm_hz ? pow(10, qrm_db / 20) : 0;
+    gen.amplitude = GEN_FULL_SCALE / (1 + gen.qrm + GEN_NOISE_PEAK * gen.noise);
+    if (gen.amplitude > GEN_HEADROOM * GEN_FULL_SCALE)
+        gen.amplitude = GEN_HEADROOM * GEN_FULL_SCALE;
+    gen.noise *= gen.amplitude;
+    gen.qrm *= gen.amplitude;
+}
+
+static size_t put_u64(char *p, uint64_t v)
+{
+    char tmp[20];
+    size_t n = 0;
+
+    do
+        tmp[n++] = '0' + v % 10;
+    while (v /= 10);
+    for (size_t i = 0; i < n; i++)
+        p[i] = tmp[n - 1 - i];
+    return n;
+}
+
+/*
+ * Seconds with six decimals, the whole seconds zero padded to
+ * gen.sec_digits.  The first pass does not know where its chunk starts
+ * and leaves them out, every label then grows by the same width.
+ */
+static size_t put_seconds(char *p, uint64_t ns)
+{
+    uint64_t us = (ns + 500) / 1000, sec = us / 1000000;
+    size_t n = gen.sec_digits;
+
+    for (int i = n - 1; i >= 0; i--, sec /= 10)
+        p[i] = '0' + sec % 10;
+    p[n++] = '.';
+    for (int i = 5; i >= 0; i--, us /= 10)
+        p[n + i] = '0' + us % 10;
+    return n + 6;
+}
+
+static inline uint64_t gen_sample(uint64_t ns)
+{
+    return (uint64_t)(((unsigned __int128)ns * gen.rate + 500000000) / 1000000000);
+}
+
+/*
+ * Samples [s0, s1) of one element.  The key edges are raised cosine ramps
+ * inside the key down element, the carriers are rotated phasors started
+ * from the absolute sample so chunks join without a phase step.
+ */
+static void gen_render(uint64_t s0, uint64_t s1, int down, uint64_t *noise)
+{
+    double w = 2 * M_PI * gen.tone / gen.rate, c = cos(w * s0), s = sin(w * s0);
+    double dc = cos(w), ds = sin(w);
+    double qw = 2 * M_PI * gen.qsb_hz / gen.rate, qc = cos(qw * s0), qs = sin(qw * s0);
+    double qdc = cos(qw), qds = sin(qw);
+    double rw = 2 * M_PI * gen.qrm_hz / gen.rate, rc = cos(rw * s0), rs = sin(rw * s0);
+    double rdc = cos(rw), rds = sin(rw);
+    uint64_t n = s1 - s0, ramp = gen_sample(GEN_RAMP_NS);
+    unsigned char *p = gen.audio + 2 * s0;
+
+    if (ramp > n / 2)
+        ramp = n / 2;
+    for (uint64_t i = 0; i < n; i++) {
+        double v = 0, t;
+        long x;
+        uint16_t u;
+
+        if (down) {
+            double env = 1;
+
+            if (i < ramp)
+                env = 0.5 - 0.5 * cos(M_PI * (i + 0.5) / ramp);
+            else if (n - i <= ramp)
+                env = 0.5 - 0.5 * cos(M_PI * (n - i - 0.5) / ramp);
+            v = gen.amplitude * env * s;
+            if (gen.qsb_hz)
+                v *= 1 - gen.qsb_depth * (0.5 - 0.5 * qc);
+        }
+        if (gen.qrm)
+            v += gen.qrm * rs;
+        if (gen.noise)
+            v += gen.noise * gen_gauss(noise);
+        x = lrint(v);
+        x = x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+        u = (uint16_t)x;
+        p[2 * i] = u;
+        p[2 * i + 1] = u >> 8;
+
+        t = c * dc - s * ds;
+        s = s * dc + c * ds;
+        c = t;
+        t = qc * qdc - qs * qds;
+        qs = qs * qdc + qc * qds;
+        qc = t;
+        t = rc * rdc - rs * rds;
+        rs = rs * rdc + rc * rds;
+        rc = t;
+    }
+}
+
+/*
+ * Key one chunk.  Without render only its length, letters and text bytes
+ * are counted, with it the same keying is written out.
+ */
+static void gen_chunk(struct gen_chunk *c, int render)
+{
+    uint64_t rng = splitmix64(gen.seed ^ splitmix64(c->index));
+    uint64_t noise = splitmix64(rng ^ 0x6e6f697365ULL);
+    uint64_t t = 0;
+    size_t pos = 0;
+
+    c->letters = 0;
+    for (size_t i = 0, n; i < c->len; i += n) {
+        struct timing_element el[2 * TIMING_MAX_ELEMENTS];
+        const char *codes[2];
+        char line[GEN_LINE_MAX], *p = line;
+        size_t nel = 0;
+        double speed;
+        uint64_t end = t, d;
+        int ncodes;
+
+        n = morse_letter_codes(c->in + i, c->len - i, codes, &ncodes);
+        if (!ncodes)
+            continue;
+        for (int j = 0; j < ncodes; j++)
+            nel += timing_schedule(&gen.timing, codes[j], el + nel);
+
+        speed = 1 + gen.drift * sin(2 * M_PI * (c->offset + i) / GEN_DRIFT_PERIOD);
+        for (size_t j = 0; j < nel; j++) {
+            double f = 1 / speed;
+
+            if (gen.fist) {
+                double a, b;
+
+                gen_gauss2(&rng, &a, &b);
+                f *= 1 + gen.fist * a;
+                if (f < 0.25 / speed)
+                    f = 0.25 / speed;
+            }
+            el[j].ns = el[j].ns * f;
+        }
+
+        // The label, white space has none.
+        if (strcmp(codes[0], " ")) {
+            c->letters++;
+            if (gen.wav) {
+                for (size_t j = 0; j + 1 < nel; j++)
+                    end += el[j].ns;
+                p += put_seconds(p, c->start_ns + t);
+                *p++ = '\t';
+                p += put_seconds(p, c->start_ns + end);
+                *p++ = '\t';
+            }
+            memcpy(p, c->in + i, n);
+            p += n;
+        }
+        if (!gen.wav) {
+            *p++ = '\t';
+            for (size_t j = 0; j < nel; j++) {
+                if (j)
+                    *p++ = ' ';
+                *p++ = el[j].down ? '+' : '-';
+                p += put_u64(p, (el[j].ns + 500) / 1000);
+            }
+        }
+        if (p != line) {
+            *p++ = '\n';
+            if (render)
+                memcpy(gen.text + c->text_off + pos, line, p - line);
+            pos += p - line;
+        }
+
+        for (size_t j = 0; j < nel; j++, t += d) {
+            d = el[j].ns;
+            if (render && gen.wav)
+                gen_render(gen_sample(c->start_ns + t),
+                           gen_sample(c->start_ns + t + d), el[j].down, &noise);
+        }
+    }
+    c->ns = t;
+    c->ntext = pos;
+}
+
+static void gen_measure_task(void *arg, int worker)
+{
+    (void)worker;
+    gen_chunk(arg, 0);
+}
+
+static void gen_render_task(void *arg, int worker)
+{
+    (void)worker;
+    gen_chunk(arg, 1);
+}
+
+static void *gen_map(const char *name, size_t size, int *fd)
+{
+    void *map;
+
+    *fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (*fd == -1 || ftruncate(*fd, size) == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    if (!size)
+        return NULL;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    return map;
+}
+
+static void put_le(unsigned char *p, uint32_t v, int n)
+{
+    for (int i = 0; i < n; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void gen_wav_header(unsigned char *h, uint64_t data)
+{
+    uint32_t size = data;		// generate_run() checked it fits
+
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, size + 36, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);
+    put_le(h + 20, 1, 2);		// PCM
+    put_le(h + 22, 1, 2);		// mono
+    put_le(h + 24, gen.rate, 4);
+    put_le(h + 28, gen.rate * 2, 4);
+    put_le(h + 32, 2, 2);
+    put_le(h + 34, 16, 2);
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, size, 4);
+}
+
+void generate_run(struct start_options *options)
+{
+    const char *name = options->generate;
+    size_t len, nchunks = 0, text = 0, letters = 0;
+    struct gen_chunk *chunks;
+    struct pool *pool;
+    struct stat st;
+    uint64_t ns = 0, samples = 0;
+    unsigned char *wav = NULL;
+    char *in = NULL, *labels = NULL;
+    int fd = -1, wfd = -1;
+
+    hmorse_init();
+    timing_keying_init(&gen.timing, options->wpm, options->farnsworth);
+    gen.seed = options->seed;
+    gen.wav = strlen(name) > 4 && !strcasecmp(name + strlen(name) - 4, ".wav");
+    gen_impair(options->impair);
+    zig_init();
+
+    if (options->message) {
+        in = options->message;
+        len = strlen(in);
+    } else {
+        fd = open(options->filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            perror(options->filename);
+            exit(EXIT_FAILURE);
+        }
+        len = st.st_size;
+        if (len) {
+            in = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (in == MAP_FAILED) {
+                perror(options->filename);
+                exit(EXIT_FAILURE);
+            }
+            madvise(in, len, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    chunks = calloc(len / (GEN_CHUNK - 4) + 1, sizeof(*chunks));
+    if (!chunks) {
+        perror("Error allocating chunks");
+        exit(EXIT_FAILURE);
+    }
+    pool = pool_create(batch_threads(options));
+    for (size_t off = 0, n; off < len; off += n, nchunks++) {
+        n = len - off > GEN_CHUNK ? utf8_boundary(in + off, GEN_CHUNK) : len - off;
+        chunks[nchunks].in = in + off;
+        chunks[nchunks].len = n;
+        chunks[nchunks].offset = off;
+        chunks[nchunks].index = nchunks;
+        pool_submit(pool, gen_measure_task, &chunks[nchunks]);
+    }
+    pool_wait(pool);
+
+    for (size_t i = 0; i < nchunks; i++)
+        ns += chunks[i].ns;
+    // Enough whole second digits for the last label, two labels a letter.
+    gen.sec_digits = 1;
+    for (uint64_t sec = (ns + 500) / 1000 / 1000000; sec >= 10; sec /= 10)
+        gen.sec_digits++;
+    ns = 0;
+    for (size_t i = 0; i < nchunks; i++) {
+        if (gen.wav)
+            chunks[i].ntext += 2 * chunks[i].letters * gen.sec_digits;
+        chunks[i].start_ns = ns;
+        chunks[i].text_off = text;
+        ns += chunks[i].ns;
+        text += chunks[i].ntext;
+        letters += chunks[i].letters;
+    }
+
+    if (gen.wav) {
+        char label_name[PATH_MAX];
+
+        // RIFF sizes are 32 bits, the header counts 36 bytes of its own.
+        samples = gen_sample(ns);
+        if (2 * samples > UINT32_MAX - 36) {
+            fprintf(stderr, "Error: %s: %.0f s of audio is too long for a WAV "
+                    "file, lower rate= or split the text\n", name, ns / 1e9);
+            exit(EXIT_FAILURE);
+        }
+        wav = gen_map(name, GEN_WAV_HDR + 2 * samples, &wfd);
+        gen_wav_header(wav, 2 * samples);
+        gen.audio = wav + GEN_WAV_HDR;
+        snprintf(label_name, sizeof(label_name), "%s.txt", name);
+        labels = gen_map(label_name, text, &fd);
+    } else {
+        labels = gen_map(name, text, &fd);
+    }
+    gen.text = labels;
+
+    for (size_t i = 0; i < nchunks; i++)
+        pool_submit(pool, gen_render_task, &chunks[i]);
+    pool_wait(pool);
+    pool_destroy(pool);
+
+    if (labels)
+        munmap(labels, text);
+    close(fd);
+    if (wav) {
+        munmap(wav, GEN_WAV_HDR + 2 * samples);
+        close(wfd);
+    }
+    if (in && in != options->message)
+        munmap(in, len);
+    free(chunks);
+
+    fprintf(stderr, "%s: %zu letters, %.1f s of keying, %s%zu bytes\n", name,
+            letters, ns / 1e9, gen.wav ? "audio " : "",
+            gen.wav ? (size_t)(GEN_WAV_HDR + 2 * samples) : text);
+}
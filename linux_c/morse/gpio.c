@@ -0,0 +1,270 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * GPIO input backend: decode a straight key (or a tone detector output)
+ * wired to a GPIO line.
+ *
+ * The line is requested through the GPIO v2 character device with both
+ * edges enabled, so the kernel timestamps every transition when the
+ * interrupt fires.  Durations are taken from those timestamps rather than
+ * from when we get around to reading them, which keeps user space
+ * scheduling jitter out of the measurements.  The request fd is non
+ * blocking and driven by epoll; every wakeup drains the kernel event fifo
+ * in batches of GPIO_EVENT_BATCH.
+ *
+ * The line is given as "<chip>:<offset>[:low]", e.g. "gpiochip0:17" or
+ * "/dev/gpiochip1:3:low" for a key that pulls the line to ground.
+ *
+ * For testing without hardware use the gpio-sim module, see
+ * test/gpio_sim_key.sh.
+ *
+ * The keyer drives a line the other way, as an output for a transmitter
+ * keying input or a buzzer (gpio_open_output()).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/gpio.h>
+
+#include "morse.h"
+
+#define GPIO_EVENT_BATCH 64
+#define GPIO_CONSUMER "morse"
+
+static void gpio_emit(char c, void *arg)
+{
+    (void)arg;
+    putchar(c);
+    fflush(stdout);
+}
+
+static int gpio_parse_spec(const char *spec, char *chip, size_t len,
+                           unsigned *offset, int *active_low)
+{
+    const char *p = strchr(spec, ':');
+    char *end;
+
+    if (!p || p == spec)
+        return -1;
+
+    if (spec[0] == '/')
+        snprintf(chip, len, "%.*s", (int)(p - spec), spec);
+    else
+        snprintf(chip, len, "/dev/%.*s", (int)(p - spec), spec);
+
+    *offset = strtoul(p + 1, &end, 10);
+    if (end == p + 1)
+        return -1;
+
+    *active_low = 0;
+    if (*end == '\0')
+        return 0;
+    if (!strcmp(end, ":low")) {
+        *active_low = 1;
+        return 0;
+    }
+    return -1;
+}
+
+static int gpio_request_line(const char *chip, unsigned offset, int active_low,
+                             uint64_t flags)
+{
+    struct gpio_v2_line_request req;
+    int fd, ret;
+
+    fd = open(chip, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Error opening gpio chip");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = offset;
+    req.num_lines = 1;
+    req.event_buffer_size = GPIO_EVENT_BATCH * 4;
+    snprintf(req.consumer, sizeof(req.consumer), GPIO_CONSUMER);
+    req.config.flags = flags;
+    if (active_low)
+        req.config.flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+
+    ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(fd);
+    if (ret == -1) {
+        perror("Error requesting gpio line");
+        return -1;
+    }
+
+    if (fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("Error setting gpio line non blocking");
+        close(req.fd);
+        return -1;
+    }
+    return req.fd;
+}
+
+static int gpio_line_value(int fd)
+{
+    struct gpio_v2_line_values vals = { .bits = 0, .mask = 1 };
+
+    if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) == -1)
+        return 0;
+    return vals.bits & 1;
+}
+
+// Output line for the keyer, starts inactive (key up).
+int gpio_open_output(const char *spec)
+{
+    char chip[256];
+    unsigned offset;
+    int active_low, fd;
+
+    if (gpio_parse_spec(spec, chip, sizeof(chip), &offset, &active_low)) {
+        fprintf(stderr, "Error: bad gpio line \"%s\", "
+                        "expected <chip>:<offset>[:low]\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    fd = gpio_request_line(chip, offset, active_low, GPIO_V2_LINE_FLAG_OUTPUT);
+    if (fd == -1)
+        exit(EXIT_FAILURE);
+    gpio_set(fd, 0);
+    return fd;
+}
+
+void gpio_set(int fd, int value)
+{
+    struct gpio_v2_line_values vals = { .bits = !!value, .mask = 1 };
+
+    if (ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &vals) == -1)
+        perror("Error setting gpio line");
+}
+
+static uint64_t gpio_now_ns(void)
+{
+    struct timespec ts;
+
+    // Line events are stamped with CLOCK_MONOTONIC by default.
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void gpio_decode(struct start_options options)
+{
+    struct gpio_v2_line_event ev[GPIO_EVENT_BATCH];
+    struct epoll_event eev;
+    struct timing_decoder td;
+    char chip[256];
+    unsigned offset;
+    int active_low, fd, epfd, level, timeout;
+    uint64_t last_ns, idle;
+    ssize_t n;
+
+    if (gpio_parse_spec(options.gpio_spec, chip, sizeof(chip),
+                        &offset, &active_low)) {
+        fprintf(stderr, "Error: bad gpio line \"%s\", "
+                        "expected <chip>:<offset>[:low]\n", options.gpio_spec);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = gpio_request_line(chip, offset, active_low,
+                           GPIO_V2_LINE_FLAG_INPUT
+                           | GPIO_V2_LINE_FLAG_EDGE_RISING
+                           | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+    if (fd == -1)
+        exit(EXIT_FAILURE);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    eev.events = EPOLLIN;
+    eev.data.fd = fd;
+    if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &eev) == -1) {
+        perror("Error setting up epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    hmorse_init();
+    timing_decoder_init(&td, options.wpm, gpio_emit, NULL);
+    timing_decoder_options(&td, &options);
+    level = gpio_line_value(fd);
+    last_ns = gpio_now_ns();
+    pr_dbg("gpio: %s line %u, initial level %d\n", chip, offset, level);
+
+    for (;;) {
+        /*
+         * While the key is up wake up when the current letter or word
+         * must have ended, so the last letter is printed without waiting
+         * for the next key down.
+         */
+        timeout = -1;
+        idle = level ? 0 : timing_decoder_idle_ns(&td);
+        if (idle) {
+            uint64_t now = gpio_now_ns();
+            timeout = now >= last_ns + idle ? 0
+                    : (int)((last_ns + idle - now) / 1000000) + 1;
+        }
+
+        n = epoll_wait(epfd, &eev, 1, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for gpio events");
+            break;
+        }
+        if (n == 0) {
+            timing_decoder_space(&td, gpio_now_ns() - last_ns);
+            continue;
+        }
+
+        while ((n = read(fd, ev, sizeof(ev))) > 0) {
+            for (size_t i = 0; i < n / sizeof(ev[0]); i++) {
+                uint64_t dur = ev[i].timestamp_ns - last_ns;
+                int rising = ev[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+
+                // Bounces can deliver the same edge twice, skip repeats.
+                if (rising == level)
+                    continue;
+                if (rising)
+                    timing_decoder_space(&td, dur);
+                else
+                    timing_decoder_mark(&td, dur);
+                level = rising;
+                last_ns = ev[i].timestamp_ns;
+            }
+        }
+        if (n == -1 && errno != EAGAIN) {
+            perror("Error reading gpio events");
+            break;
+        }
+    }
+
+    timing_decoder_flush(&td);
+    close(epfd);
+    close(fd);
+}
@@ -0,0 +1,405 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Keyboard keyer, morse --keyer [-w wpm] [--farnsworth wpm] [-g line]
+ *
+ * The terminal is put in raw mode and every keystroke is sent as soon as
+ * it is typed: straight away when the keyer is idle, otherwise after the
+ * letters typed ahead of it, up to KEYER_AHEAD of them.  Backspace takes
+ * back the last letter not yet started, Ctrl-U or Esc all of them, Ctrl-D
+ * sends what is queued and quits, Ctrl-C quits at once.
+ *
+ * The key drives a GPIO output line with -g (a transmitter or a buzzer),
+ * the console speaker where the terminal has one, and the symbols are
+ * printed as they are keyed.  With --udp-send every letter also goes to
+ * a --udp-listen peer the moment it starts, see udp.c.  Element edges are scheduled against
+ * CLOCK_MONOTONIC from the previous edge so timing does not drift, and
+ * the wait for the next edge or keystroke is one ppoll().
+ *
+ * Input that is not a terminal is read only as fast as the queue empties,
+ * so a file can be piped through the keyer without losing letters.
+ *
+ * With --latency the time from ppoll() returning with a keystroke to the
+ * first key down is measured for every letter typed while idle and a
+ * summary printed at exit.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <linux/kd.h>
+
+#include "morse.h"
+
+#define KEYER_AHEAD 64			// letters typed ahead
+#define KEYER_TONE_HZ 700		// console speaker sidetone
+#define KEYER_LATENCY_MAX 65536		// samples kept for --latency
+#define KEYER_CLOCK_TICK 1193180	// PC speaker timer, KIOCSOUND units
+
+#ifndef CTRL
+#define CTRL(c) ((c) & 0x1f)
+#endif
+
+struct keyer_letter {
+    const char *codes[2];
+    int ncodes;
+    char text[4];			// as typed, for --udp-send
+    size_t ntext;
+};
+
+static struct keyer {
+    struct timing_keying timing;
+    struct keyer_letter ahead[KEYER_AHEAD];
+    unsigned head, count;
+    struct timing_element el[2 * TIMING_MAX_ELEMENTS];
+    size_t nel, pos;			// letter being sent, nel 0 when idle
+    uint64_t next_ns;			// end of el[pos]
+    unsigned char utf8[4];		// keystroke still missing bytes
+    size_t nutf8;
+    int gpio_fd;
+    int tone;				// console speaker works
+    int raw;				// terminal settings to restore
+    struct termios saved;
+    int udp;				// --udp-send
+    int measure;
+    uint64_t keyed_ns;			// first edge of the last letter started
+    uint64_t *lat;
+    size_t nlat;
+} keyer;
+
+static uint64_t keyer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void keyer_print(const char *s, size_t len)
+{
+    if (write(STDOUT_FILENO, s, len) == -1)
+        perror("Error writing output");
+}
+
+static void keyer_key(int down, uint64_t ns)
+{
+    if (keyer.gpio_fd != -1)
+        gpio_set(keyer.gpio_fd, down);
+    if (keyer.tone && ioctl(STDIN_FILENO, KIOCSOUND,
+                            down ? KEYER_CLOCK_TICK / KEYER_TONE_HZ : 0) == -1)
+        keyer.tone = 0;
+    if (down)
+        keyer_print(ns > keyer.timing.dot_ns ? "-" : ".", 1);
+}
+
+static void keyer_restore(void)
+{
+    if (keyer.gpio_fd != -1)
+        gpio_set(keyer.gpio_fd, 0);
+    if (keyer.tone)
+        ioctl(STDIN_FILENO, KIOCSOUND, 0);
+    if (keyer.raw)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &keyer.saved);
+}
+
+// Start the next queued letter at t, its first edge is due right now.
+static void keyer_start(uint64_t t)
+{
+    struct keyer_letter *l = &keyer.ahead[keyer.head];
+
+    keyer.nel = 0;
+    for (int i = 0; i < l->ncodes; i++)
+        keyer.nel += timing_schedule(&keyer.timing, l->codes[i],
+                                     keyer.el + keyer.nel);
+    keyer.head = (keyer.head + 1) % KEYER_AHEAD;
+    keyer.count--;
+    keyer.pos = 0;
+    keyer.next_ns = t + keyer.el[0].ns;
+    // Printed like the encoder, three spaces between words.
+    if (!strcmp(l->codes[0], " "))
+        keyer_print(" ", 1);
+    keyer_key(keyer.el[0].down, keyer.el[0].ns);
+    if (keyer.measure)
+        keyer.keyed_ns = keyer_now();
+    // After the key, the datagram carries t and need not hold it up.
+    if (keyer.udp) {
+        udp_send_letter(l->codes, l->ncodes, keyer.el, keyer.nel, t,
+                        l->text, l->ntext);
+        udp_send_flush();
+    }
+}
+
+// Take every edge that is due by now.
+static void keyer_advance(uint64_t now)
+{
+    while (keyer.nel && now >= keyer.next_ns) {
+        uint64_t t = keyer.next_ns;
+
+        if (++keyer.pos < keyer.nel) {
+            keyer.next_ns += keyer.el[keyer.pos].ns;
+            keyer_key(keyer.el[keyer.pos].down, keyer.el[keyer.pos].ns);
+            continue;
+        }
+        keyer_print(" ", 1);
+        keyer.nel = 0;
+        if (keyer.count)
+            keyer_start(t);
+    }
+}
+
+static void keyer_bell(void)
+{
+    keyer_print("\a", 1);
+}
+
+// Queue a typed letter, send it at once when idle.
+static void keyer_queue(const char *codes[2], int ncodes,
+                        const unsigned char *text, size_t ntext, uint64_t wake)
+{
+    struct keyer_letter *l;
+
+    if (keyer.count == KEYER_AHEAD) {
+        keyer_bell();
+        return;
+    }
+    l = &keyer.ahead[(keyer.head + keyer.count++) % KEYER_AHEAD];
+    l->codes[0] = codes[0];
+    l->codes[1] = ncodes > 1 ? codes[1] : NULL;
+    l->ncodes = ncodes;
+    memcpy(l->text, text, ntext);
+    l->ntext = ntext;
+    if (!keyer.nel) {
+        keyer_start(keyer_now());
+        if (keyer.measure && keyer.nlat < KEYER_LATENCY_MAX)
+            keyer.lat[keyer.nlat++] = keyer.keyed_ns - wake;
+    }
+}
+
+/*
+ * One byte typed, returns 0 to go on, 1 to quit once the queue is sent
+ * and -1 to quit now.
+ */
+static int keyer_byte(unsigned char c, uint64_t wake)
+{
+    const char *codes[2];
+    uint32_t cp;
+    size_t len;
+    int n;
+
+    if (keyer.nutf8 || c >= 0x80) {
+        keyer.utf8[keyer.nutf8++] = c;
+        if (!utf8_decode(keyer.utf8, keyer.nutf8, &cp)) {
+            // Not complete yet, or never will be.
+            if (keyer.nutf8 == sizeof(keyer.utf8)) {
+                keyer.nutf8 = 0;
+                keyer_bell();
+            }
+            return 0;
+        }
+        len = keyer.nutf8;
+        keyer.nutf8 = 0;
+        n = alphabet_encode(cp, codes);
+        if (n)
+            keyer_queue(codes, n, keyer.utf8, len, wake);
+        else
+            keyer_bell();
+        return 0;
+    }
+
+    switch (c) {
+    case CTRL('C'):
+        return -1;
+    case CTRL('D'):
+        return 1;
+    case 0x7f:
+    case CTRL('H'):
+        if (keyer.count)
+            keyer.count--;
+        else
+            keyer_bell();
+        return 0;
+    case CTRL('U'):
+        keyer.count = 0;
+        return 0;
+    case '\r':
+        c = '\n';
+        break;
+    }
+    codes[0] = morse_lookup(c);
+    if (*codes[0])
+        keyer_queue(codes, 1, &c, 1, wake);
+    else
+        keyer_bell();
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void keyer_report(void)
+{
+    uint64_t *l = keyer.lat, sum = 0;
+    size_t n = keyer.nlat;
+
+    if (!n) {
+        fprintf(stderr, "latency: no keystrokes sent while idle\n");
+        return;
+    }
+    qsort(l, n, sizeof(*l), cmp_u64);
+    for (size_t i = 0; i < n; i++)
+        sum += l[i];
+    fprintf(stderr, "latency: keystroke to key down, %zu letters\n"
+                    "  min %.1f us  avg %.1f us  p50 %.1f us  p99 %.1f us  max %.1f us\n",
+            n, l[0] / 1e3, (double)sum / n / 1e3, l[n / 2] / 1e3,
+            l[(n * 99) / 100] / 1e3, l[n - 1] / 1e3);
+}
+
+// Wake up on time for the edges, take what priority we are allowed.
+static void keyer_realtime(void)
+{
+    struct sched_param sp = { .sched_priority = 10 };
+
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1)
+        pr_dbg("keyer: no realtime priority: %s\n", strerror(errno));
+}
+
+void keyer_run(struct start_options *options)
+{
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    int quit = 0, eof = 0;
+
+    hmorse_init();
+    timing_keying_init(&keyer.timing, options->wpm, options->farnsworth);
+    keyer.gpio_fd = options->gpio_spec ? gpio_open_output(options->gpio_spec) : -1;
+    keyer.tone = ioctl(STDIN_FILENO, KIOCSOUND, 0) == 0;
+    keyer.measure = options->latency;
+    if (keyer.measure) {
+        keyer.lat = malloc(KEYER_LATENCY_MAX * sizeof(*keyer.lat));
+        if (!keyer.lat) {
+            perror("Error allocating latency samples");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (isatty(STDIN_FILENO)) {
+        struct termios t;
+
+        if (tcgetattr(STDIN_FILENO, &keyer.saved) == -1) {
+            perror("Error reading terminal settings");
+            exit(EXIT_FAILURE);
+        }
+        t = keyer.saved;
+        t.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+        t.c_iflag &= ~(IXON | ISTRIP);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &t) == -1) {
+            perror("Error setting terminal raw mode");
+            exit(EXIT_FAILURE);
+        }
+        keyer.raw = 1;
+        fprintf(stderr, "keyer at %u wpm, type to send, Backspace and Ctrl-U "
+                        "take back, Ctrl-D ends\r\n",
+                options->wpm ? options->wpm : DEFAULT_WPM);
+    }
+    atexit(keyer_restore);
+    keyer_realtime();
+    if (options->udp_send) {
+        udp_sender_open(options);
+        keyer.udp = 1;
+    }
+
+    while (quit >= 0) {
+        struct timespec ts, *tsp = NULL;
+        uint64_t now = keyer_now(), wake;
+        unsigned char buf[64];
+        size_t want = sizeof(buf);
+        ssize_t n;
+        int r;
+
+        keyer_advance(now);
+        if (eof && !keyer.nel)
+            break;
+        if (keyer.nel) {
+            uint64_t left = keyer.next_ns > now ? keyer.next_ns - now : 0;
+
+            ts.tv_sec = left / 1000000000ULL;
+            ts.tv_nsec = left % 1000000000ULL;
+            tsp = &ts;
+        }
+        if (!keyer.raw && want > KEYER_AHEAD - keyer.count)
+            want = KEYER_AHEAD - keyer.count;
+        pfd.fd = eof || !want ? -1 : STDIN_FILENO;
+        r = ppoll(&pfd, 1, tsp, NULL);
+        wake = keyer_now();
+        if (r == -1 && errno != EINTR) {
+            perror("Error waiting for input");
+            break;
+        }
+        if (r <= 0 || !(pfd.revents & (POLLIN | POLLHUP)))
+            continue;
+
+        keyer_advance(wake);
+        n = read(STDIN_FILENO, buf, want);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            eof = 1;
+            continue;
+        }
+        for (ssize_t i = 0; i < n && quit >= 0; i++) {
+            // Esc, and the rest of an escape sequence such as an arrow key
+            if (buf[i] == 0x1b) {
+                keyer.count = 0;
+                break;
+            }
+            quit = keyer_byte(buf[i], wake);
+            eof |= quit > 0;
+        }
+    }
+
+    if (keyer.udp)
+        udp_send_end(keyer_now());
+    keyer_restore();
+    keyer.raw = 0;
+    keyer_print("\n", 1);
+    if (keyer.measure)
+        keyer_report();
+}
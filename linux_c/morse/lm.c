@@ -0,0 +1,304 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Character and word n-gram model for the beam decoder,
+ *
+ *   morse --lm-build <model> -f corpus.txt	build it
+ *   morse -d --lm <model> ...			decode with it
+ *
+ * The corpus is reduced to what Morse can send: letters with a code in
+ * upper case, anything else one space.  Every character n-gram up to
+ * LM_ORDER and every word is counted and stored as its cost, the negative
+ * log2 of its probability in eighths of a bit, one byte in a hashed table
+ * with no keys:
+ *
+ *   char   P(c | the LM_ORDER - 1 letters before it), 2^LM_CHAR_BITS bytes
+ *   word   P(word), 2^LM_WORD_BITS bytes
+ *
+ * A missing n-gram backs off to the shorter context with LM_BACKOFF bits
+ * added.  Colliding entries keep the cheaper cost, so a collision can
+ * only make an n-gram look more likely than it is, never unknown.  The
+ * file is a struct lm_file header and the two tables, mapped read only,
+ * so any number of decoders share one copy in the page cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+#define LM_MAGIC "MORSELM1"
+#define LM_CHAR_BITS 22
+#define LM_WORD_BITS 20
+#define LM_UNSEEN 0xff
+#define LM_BACKOFF 1.3			// bits, stupid backoff 0.4
+#define LM_CHAR_OOV 16.0		// bits, a letter never seen alone
+
+struct lm_file {
+    char magic[8];
+    uint32_t order, char_bits, word_bits, unused;
+};
+
+static inline uint32_t lm_slot(uint64_t key, unsigned bits)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+// The n-gram of order n ending in c, ctx holds the letters before it.
+static inline uint64_t lm_char_key(uint32_t ctx, unsigned n, char c)
+{
+    uint32_t mask = n > 1 ? 0xffffffffU >> (32 - 8 * (n - 1)) : 0;
+
+    return ((uint64_t)(ctx & mask) << 8 | (unsigned char)c) << 3 | n;
+}
+
+uint32_t lm_word_hash(uint32_t h, char c)
+{
+    // FNV-1a, 0 is kept for no word
+    h = ((h ? h : 2166136261U) ^ (unsigned char)c) * 16777619U;
+    return h ? h : 1;
+}
+
+double lm_char_cost(const struct morse_lm *lm, uint32_t ctx, char c)
+{
+    double backoff = 0;
+
+    for (unsigned n = lm->order; n >= 1; n--) {
+        unsigned char q = lm->chars[lm_slot(lm_char_key(ctx, n, c), lm->char_bits)];
+
+        if (q != LM_UNSEEN)
+            return backoff + q / 8.0;
+        backoff += LM_BACKOFF;
+    }
+    return backoff + LM_CHAR_OOV;
+}
+
+// Cost of a letter on its own, no context.
+double lm_letter_cost(const struct morse_lm *lm, char c)
+{
+    unsigned char q = lm->chars[lm_slot(lm_char_key(0, 1, c), lm->char_bits)];
+
+    return q == LM_UNSEEN ? LM_CHAR_OOV : q / 8.0;
+}
+
+// Cost of a whole word, or a negative number when it was never seen.
+double lm_word_cost(const struct morse_lm *lm, uint32_t word)
+{
+    unsigned char q = lm->words[lm_slot(word, lm->word_bits)];
+
+    return q == LM_UNSEEN ? -1 : q / 8.0;
+}
+
+void lm_open(struct morse_lm *lm, const char *path)
+{
+    const struct lm_file *h;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    lm->size = st.st_size;
+    lm->map = lm->size >= sizeof(*h)
+            ? mmap(NULL, lm->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    h = lm->map;
+    if (lm->map == MAP_FAILED || memcmp(h->magic, LM_MAGIC, 8)
+        || h->order < 1 || h->order > LM_ORDER
+        || h->char_bits > 30 || h->word_bits > 30
+        || lm->size != sizeof(*h) + ((size_t)1 << h->char_bits)
+                                  + ((size_t)1 << h->word_bits)) {
+        fprintf(stderr, "%s: not a morse language model\n", path);
+        exit(EXIT_FAILURE);
+    }
+    lm->order = h->order;
+    lm->char_bits = h->char_bits;
+    lm->word_bits = h->word_bits;
+    lm->chars = (const unsigned char *)(h + 1);
+    lm->words = lm->chars + ((size_t)1 << h->char_bits);
+    madvise(lm->map, lm->size, MADV_WILLNEED);
+}
+
+void lm_close(struct morse_lm *lm)
+{
+    munmap(lm->map, lm->size);
+}
+
+/*
+ * Building.
+ */
+struct lm_counts {
+    uint32_t *chars, *words;
+    uint64_t letters, nwords;
+};
+
+// The corpus letter at c as the decoder would print it, 0 for a gap.
+static char lm_letter(unsigned char c)
+{
+    const char *code = morse_lookup(c);
+
+    if (!*code || *code == ' ')
+        return 0;
+    return toupper(c);
+}
+
+static unsigned char lm_quantise(double p)
+{
+    double q = ceil(-log2(p) * 8);
+
+    return q < 0 ? 0 : q > LM_UNSEEN - 1 ? LM_UNSEEN - 1 : q;
+}
+
+/*
+ * Walk the corpus, counting with store 0, storing the costs with 1.  The
+ * text starts as if after a space.
+ */
+static void lm_walk(struct lm_counts *k, unsigned char *chars,
+                    unsigned char *words, const char *in, size_t len, int store)
+{
+    uint32_t ctx = 0x202020, word = 0;
+    int gap = 1;
+
+    for (size_t i = 0; i <= len; i++) {
+        char c = i < len ? lm_letter(in[i]) : 0;
+
+        if (!c) {
+            if (gap)
+                continue;
+            gap = 1;
+            c = ' ';
+        } else {
+            gap = 0;
+        }
+        for (unsigned n = 1; n <= LM_ORDER; n++) {
+            uint32_t s = lm_slot(lm_char_key(ctx, n, c), LM_CHAR_BITS);
+
+            if (!store) {
+                k->chars[s]++;
+                continue;
+            }
+            // The context as an n-gram of its own counts its uses.
+            uint64_t total = n == 1 ? k->letters
+                           : k->chars[lm_slot(lm_char_key(ctx >> 8, n - 1, ctx & 0xff), LM_CHAR_BITS)];
+            unsigned char q = lm_quantise(total ? (double)k->chars[s] / total : 1);
+
+            if (q < chars[s] || chars[s] == LM_UNSEEN)
+                chars[s] = q;
+        }
+        k->letters += !store;
+        if (c != ' ') {
+            word = lm_word_hash(word, c);
+        } else if (word) {
+            uint32_t s = lm_slot(word, LM_WORD_BITS);
+
+            if (!store) {
+                k->words[s]++;
+                k->nwords++;
+            } else {
+                unsigned char q = lm_quantise((double)k->words[s] / k->nwords);
+
+                if (q < words[s] || words[s] == LM_UNSEEN)
+                    words[s] = q;
+            }
+            word = 0;
+        }
+        ctx = (ctx << 8 | (unsigned char)c) & 0xffffff;
+    }
+}
+
+void lm_build(struct start_options *options)
+{
+    struct lm_file h = { LM_MAGIC, LM_ORDER, LM_CHAR_BITS, LM_WORD_BITS, 0 };
+    size_t nchars = (size_t)1 << LM_CHAR_BITS, nwords = (size_t)1 << LM_WORD_BITS;
+    struct lm_counts k = { 0 };
+    unsigned char *table;
+    const char *in = options->message;
+    size_t len = in ? strlen(in) : 0, off = 0, size;
+    struct stat st;
+    int fd;
+
+    hmorse_init();
+    if (!in) {
+        fd = open(options->filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            perror(options->filename);
+            exit(EXIT_FAILURE);
+        }
+        len = st.st_size;
+        in = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+        if (in == MAP_FAILED) {
+            perror(options->filename);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    k.chars = calloc(nchars, sizeof(*k.chars));
+    k.words = calloc(nwords, sizeof(*k.words));
+    size = sizeof(h) + nchars + nwords;
+    table = malloc(size);
+    if (!k.chars || !k.words || !table) {
+        perror("Error allocating the model");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(table, &h, sizeof(h));
+    memset(table + sizeof(h), LM_UNSEEN, nchars + nwords);
+    lm_walk(&k, NULL, NULL, in, len, 0);
+    lm_walk(&k, table + sizeof(h), table + sizeof(h) + nchars, in, len, 1);
+
+    fd = open(options->lm_build, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(options->lm_build);
+        exit(EXIT_FAILURE);
+    }
+    while (off < size) {
+        ssize_t n = write(fd, table + off, size - off);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror(options->lm_build);
+            exit(EXIT_FAILURE);
+        }
+        off += n;
+    }
+    close(fd);
+    fprintf(stderr, "%s: %llu letters, %llu words, %zu bytes\n", options->lm_build,
+            (unsigned long long)k.letters, (unsigned long long)k.nwords, size);
+    if (!options->message && len)
+        munmap((void *)in, len);
+    free(k.chars);
+    free(k.words);
+    free(table);
+}
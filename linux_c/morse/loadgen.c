@@ -0,0 +1,299 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * morse-load, load generator for "morse --serve".
+ *
+ *   morse-load [-c conns] [-n requests] [-p depth] [-b] [-d] [-m msg] socket
+ *
+ * Every connection runs on its own thread and keeps <depth> requests in
+ * flight, sending a new one as each response arrives.  With -b it sends
+ * all of them at once and half closes the socket, like a client piping a
+ * file through, and reads the responses up to the end.  Latency is taken
+ * per request from the moment it is written to the moment its response
+ * is parsed, the run ends with the p50/p99/max latency and the request
+ * rate over all connections.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "morse.h"
+
+struct load_conn {
+    pthread_t thread;
+    uint64_t *lat;			// latency of each request, ns
+    size_t nlat;
+    int failed;
+};
+
+static const char *sock_path;
+static char *frame;
+static size_t frame_len;
+static size_t requests = 100000;
+static int depth = 16;
+static int half_close;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int load_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Error connecting");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_requests(int fd, int count)
+{
+    static __thread char *buf;
+    static __thread size_t size;
+    size_t len = frame_len * count, off = 0;
+
+    if (len > size) {
+        free(buf);
+        buf = malloc(len);
+        if (!buf)
+            return -1;
+        size = len;
+    }
+    for (int i = 0; i < count; i++)
+        memcpy(buf + i * frame_len, frame, frame_len);
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static void *load_thread(void *arg)
+{
+    struct load_conn *lc = arg;
+    uint64_t *sent = calloc(depth, sizeof(uint64_t));
+    size_t buf_size = 1 << 20, have = 0, issued = 0;
+    char *buf = malloc(buf_size);
+    int fd = load_connect();
+
+    lc->lat = malloc(requests * sizeof(uint64_t));
+    if (fd == -1 || !sent || !buf || !lc->lat)
+        goto fail;
+
+    // Fill the pipeline.
+    while (issued < requests && issued < (size_t)depth)
+        sent[issued++ % depth] = now_ns();
+    if (send_requests(fd, issued))
+        goto fail;
+    if (half_close && shutdown(fd, SHUT_WR) == -1)
+        goto fail;
+
+    while (lc->nlat < requests) {
+        size_t off = 0;
+        int more = 0;
+        ssize_t n = recv(fd, buf + have, buf_size - have, 0);
+
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            goto fail;
+        }
+        have += n;
+
+        while (have - off >= MORSE_SRV_HDR_SIZE) {
+            uint32_t len = morse_srv_get_len(buf + off);
+
+            if (have - off < MORSE_SRV_LEN_SIZE + len)
+                break;
+            if ((uint8_t)buf[off + MORSE_SRV_LEN_SIZE] != MORSE_SRV_OK)
+                goto fail;
+            lc->lat[lc->nlat] = now_ns() - sent[lc->nlat % depth];
+            lc->nlat++;
+            off += MORSE_SRV_LEN_SIZE + len;
+            if (issued < requests) {
+                sent[issued++ % depth] = now_ns();
+                more++;
+            }
+        }
+        if (have - off >= MORSE_SRV_HDR_SIZE
+            && MORSE_SRV_LEN_SIZE + morse_srv_get_len(buf + off) > buf_size) {
+            fprintf(stderr, "Error: response larger than %zu bytes\n", buf_size);
+            goto fail;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+        if (more && send_requests(fd, more))
+            goto fail;
+    }
+    close(fd);
+    free(sent);
+    free(buf);
+    return NULL;
+
+fail:
+    if (fd != -1)
+        close(fd);
+    lc->failed = 1;
+    free(sent);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    printf("morse-load [-c conns] [-n requests] [-p depth] [-b] [-d] [-m msg] socket\n\n");
+    printf("    -c <n> Concurrent connections, one thread each (default 4).\n");
+    printf("    -n <n> Requests per connection (default 100000).\n");
+    printf("    -p <n> Requests kept in flight per connection (default 16).\n");
+    printf("    -b     Send all requests, half close and read every response.\n");
+    printf("    -d     Send decode requests, -m is then morse code.\n");
+    printf("    -m <msg> Request payload (default \"CQ CQ DE TEST K\").\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *msg = NULL;
+    uint8_t op = MORSE_SRV_ENCODE;
+    struct load_conn *conns;
+    int nconns = 4, opt, failed = 0;
+    uint64_t start, elapsed, *all;
+    size_t total = 0;
+
+    while ((opt = getopt(argc, argv, "bc:dhm:n:p:")) != -1) {
+        switch (opt) {
+        case 'b':
+            half_close = 1;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            op = MORSE_SRV_DECODE;
+            break;
+        case 'm':
+            msg = optarg;
+            break;
+        case 'n':
+            requests = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+    if (optind != argc - 1 || nconns < 1 || depth < 1 || requests < 1) {
+        usage();
+        exit(-1);
+    }
+    sock_path = argv[optind];
+    if (half_close)
+        depth = requests;
+    if (!msg)
+        msg = op == MORSE_SRV_ENCODE ? "CQ CQ DE TEST K"
+                                     : "-.-. --.-   -.. .   - . ... -   -.-";
+
+    frame_len = MORSE_SRV_HDR_SIZE + strlen(msg);
+    frame = malloc(frame_len);
+    conns = calloc(nconns, sizeof(*conns));
+    if (!frame || !conns) {
+        perror("Error allocating");
+        exit(EXIT_FAILURE);
+    }
+    morse_srv_put_hdr(frame, strlen(msg) + 1, op);
+    memcpy(frame + MORSE_SRV_HDR_SIZE, msg, strlen(msg));
+
+    start = now_ns();
+    for (int i = 0; i < nconns; i++)
+        if (pthread_create(&conns[i].thread, NULL, load_thread, &conns[i])) {
+            perror("Error creating thread");
+            exit(EXIT_FAILURE);
+        }
+    for (int i = 0; i < nconns; i++) {
+        pthread_join(conns[i].thread, NULL);
+        total += conns[i].nlat;
+        failed += conns[i].failed;
+    }
+    elapsed = now_ns() - start;
+
+    all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!all) {
+        perror("Error allocating");
+        exit(EXIT_FAILURE);
+    }
+    total = 0;
+    for (int i = 0; i < nconns; i++) {
+        memcpy(all + total, conns[i].lat, conns[i].nlat * sizeof(uint64_t));
+        total += conns[i].nlat;
+    }
+    if (!total) {
+        fprintf(stderr, "Error: no responses\n");
+        exit(EXIT_FAILURE);
+    }
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+
+    printf("requests: %zu  connections: %d  depth: %d  failed connections: %d\n",
+           total, nconns, depth, failed);
+    printf("rate: %.0f req/s\n", total / (elapsed / 1e9));
+    printf("latency: p50 %.1f us  p99 %.1f us  max %.1f us\n",
+           all[total / 2] / 1e3, all[total * 99 / 100] / 1e3,
+           all[total - 1] / 1e3);
+    return failed ? EXIT_FAILURE : 0;
+}
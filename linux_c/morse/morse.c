@@ -64,6 +64,90 @@ int main(int argc, char* argv[]) {
     }
     // now process any command line arguments
     process_command_line(argc, argv, &options);
+    if (options.profile)
+        profile_start(options.profile);
+    if (options.stats) {
+        morse_stats_enabled = 1;
+        atexit(morse_stats_print);
+    }
+
+    if (options.serve_path) {
+        morse_serve(options);
+        return(0);
+    }
+
+    if (options.tune > 0) {
+        tune_run(&options);
+        return(0);
+    }
+
+    if (options.validate) {
+        validate_run(&options);
+        return(0);
+    }
+
+    if (options.verify) {
+        verify_run(&options);
+        return(0);
+    }
+
+    if (options.lm_build) {
+        lm_build(&options);
+        return(0);
+    }
+
+    if (options.timing) {
+        timing_file_decode(&options);
+        return(0);
+    }
+
+    if (options.generate) {
+        generate_run(&options);
+        return(0);
+    }
+
+    if (options.strict)
+        validate_strict(&options);
+
+    if (options.nfiles || options.from_list) {
+        batch_run(&options);
+        return(0);
+    }
+
+    if (options.follow) {
+        follow_file(options);
+        return(0);
+    }
+
+    if (options.udp_listen) {
+        udp_listen_run(&options);
+        return(0);
+    }
+
+    if (options.udp_send && !options.keyer) {
+        udp_send_run(&options);
+        return(0);
+    }
+
+    if (options.keyer) {
+        keyer_run(&options);
+        return(0);
+    }
+
+    if (options.gpio_spec) {
+        gpio_decode(options);
+        return(0);
+    }
+
+    if (options.records) {
+        records_run(&options);
+        return(0);
+    }
+
+    if (pipeline_wanted(&options)) {
+        pipeline_run(&options);
+        return(0);
+    }
 
     if (options.filename)
         printf("Options: filename = %s, ready to encode morse code...\n", 
@@ -71,7 +155,9 @@ int main(int argc, char* argv[]) {
 
     open_text_file(&options);
     if (options.mode == MORS_ENCO)
-        display_message(options);
+        tune_display_message(&options);
+    else if (options.segment)
+        segment_decode(&options);
     else
         morse_decode(options);
     close_text_file(options);
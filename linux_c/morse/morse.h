@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -55,24 +56,196 @@ enum {
     MORS_DECO
 };
 
+/*
+ * Arena allocator, memory is handed out by bumping a pointer through a
+ * chain of blocks and only given back all at once.  arena_reset() keeps
+ * the blocks for the next round so a worker that resets per request stops
+ * calling malloc once it has seen its largest request.  Not thread safe,
+ * every thread uses its own arena.
+ */
+#include <stddef.h>
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    max_align_t data[];
+};
+
+struct arena {
+    struct arena_block *first, *cur;
+    size_t used;			// bytes of cur handed out
+    size_t block_size;			// 0 is ARENA_BLOCK
+};
+
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN(n) (((n) + _Alignof(max_align_t) - 1) \
+                        & ~(_Alignof(max_align_t) - 1))
+
+/*
+ * Objects of one size from an arena, put back ones are reused first and
+ * come back as they were put, new ones are zeroed.
+ */
+struct arena_freelist {
+    void *head;
+};
+
+extern void *arena_grow(struct arena *a, size_t size);
+extern void arena_reset(struct arena *a);
+extern void arena_free(struct arena *a);
+extern char *arena_strdup(struct arena *a, const char *s);
+
+static inline void *arena_alloc(struct arena *a, size_t size)
+{
+    size = ARENA_ALIGN(size);
+    if (a->cur && size <= a->cur->size - a->used) {
+        void *p = (char *)a->cur->data + a->used;
+
+        a->used += size;
+        return p;
+    }
+    return arena_grow(a, size);
+}
+
+static inline void *arena_get(struct arena *a, struct arena_freelist *f,
+                              size_t size)
+{
+    void *p = f->head;
+
+    if (!p) {
+        if (size < sizeof(void *))
+            size = sizeof(void *);
+        return memset(arena_alloc(a, size), 0, size);
+    }
+    f->head = *(void **)p;
+    return p;
+}
+
+static inline void arena_put(struct arena_freelist *f, void *p)
+{
+    *(void **)p = f->head;
+    f->head = p;
+}
+
+extern struct arena morse_tables;	// decode tables, reset by hmorse_relase()
+
 void hmorse_init();
 void hmorse_relase();
 char morse2char(char *s);
 
 extern char *morse_code[];
+#define MORSE_CODE_SIZE ('z' + 1)	// nothing past 'z' is in the table
+
+/*
+ * The table in use, morse_code[] unless a config file changed letters,
+ * then a full 256 entry table.  Prosigns are only set from a config.
+ */
+struct morse_prosign {
+    const char *name;			// "AR", written as <AR> in text
+    const char *code;
+    size_t len;				// strlen(name)
+};
+
+extern char **morse_active;
+extern size_t morse_active_size;
+extern struct morse_prosign *morse_prosigns;
+extern size_t morse_nprosigns;
+
+// Bounds checked table lookup, bytes outside the table encode to nothing.
+static inline char *morse_lookup(char c)
+{
+    unsigned char u = (unsigned char)c;
+
+    return u < morse_active_size ? morse_active[u] : "";
+}
+
+/*
+ * Letters outside ASCII, looked up by Unicode code point.  Tables are
+ * sorted by code point, by_code is the same letters sorted by code.
+ */
+struct morse_letter {
+    uint32_t cp;
+    const char *code;
+};
+
+struct morse_alphabet {
+    const char *name;
+    struct morse_letter *letters;
+    size_t n;
+    int (*fold)(uint32_t cp, uint32_t out[2]);	// to canonical letters
+    int prefer;				// decode before the ASCII letters
+    struct morse_letter *by_code;
+};
+
+extern struct morse_alphabet *morse_alphabet;	// selected with -a
+extern struct morse_alphabet *alphabet_find(const char *name);
+extern struct morse_alphabet *alphabet_latin(void);
+extern const char *alphabet_names(void);
+extern void alphabet_init(void);
+extern int alphabet_encode(uint32_t cp, const char *codes[2]);
+extern size_t morse_letter_codes(const char *in, size_t len,
+                                 const char *codes[2], int *ncodes);
+extern int alphabet_canonical(uint32_t cp, uint32_t canon[2]);
+extern uint32_t alphabet_decode(struct morse_alphabet *a, const char *code);
+extern size_t utf8_decode(const unsigned char *p, size_t len, uint32_t *cp);
+extern size_t utf8_encode(uint32_t cp, char *out);
+extern size_t utf8_boundary(const char *p, size_t len);
 
 struct start_options {
     int fd;
     struct stat fileInfo;
     char *filename;			// Text file to open
     char * message;			// Pointer to the text to send
+    size_t length;			// Bytes in message
     int mode;
+    char *gpio_spec;			// GPIO line to decode from, <chip>:<offset>[:low]
+    unsigned wpm;			// Initial speed for timed input/output
+    char **files;			// Batch mode inputs
+    int nfiles;
+    char *from_list;			// File holding batch inputs, one per line
+    char *outdir;			// Batch mode output directory
+    int jobs;				// Worker threads, 0 is one per cpu
+    int io_uring;			// Batch mode on io_uring when available
+    char *config_file;			// Only read this config file
+    unsigned farnsworth;		// Character spacing speed, 0 is off
+    char *serve_path;			// UNIX socket to serve requests on
+    int stats;				// print the counters at exit
+    char *profile;			// folded stacks file of --profile
+    char *follow;			// file to follow as it grows, -F
+    char *output;			// single file mode output, default stdout
+    int compress;			// PIPE_* format of the output
+    int verify;				// round trip check, --verify
+    int records;			// one record per line, --records
+    int keyer;				// send keystrokes live, --keyer
+    int latency;			// measure the keyer, --latency
+    char *udp_send;			// send letters to <host>[:port], --udp-send
+    char *udp_listen;			// play letters from [<host>:]<port>, --udp-listen
+    int udp_letters;			// send codes instead of keying, --udp-letters
+    int udp_reorder;			// send every batch backwards, --udp-reorder
+    unsigned jitter;			// playout delay in ms, --jitter
+    char *generate;			// test corpus to write, --generate
+    char *impair;			// its impairments, --impair
+    uint64_t seed;			// its random numbers, --seed
+    char *lm;				// language model of --beam/--segment, --lm
+    char *lm_build;			// build a model from -f/-s, --lm-build
+    unsigned beam;			// beam width, --beam
+    int timing;				// -f/-s are key timings, --timing
+    int segment;			// find missing letter gaps, --segment
+    long cache;				// result cache bytes, --cache, -1 none
+    int words;				// whole word encoding, --words
+    char **extra_words;			// its words from the config files
+    int nextra_words;
+    int tune;				// 1 recalibrate, --tune, -1 never, --no-tune
+    unsigned validate;			// offsets to report, --validate[=N]
+    int strict;				// validate before converting, --strict
     };
 
 int sizeof_morsecode();
 
 extern void display_message(struct start_options options);
+extern void display_message_parallel(struct start_options *options,
+                                     int nthreads, size_t chunk);
 extern void process_config_file(struct start_options *options);
+extern int morse_cache_dir(char *path, size_t len, int mkdirs);
 extern void process_command_line(int argc, char *argv[], struct start_options *options);
 extern void open_text_file(struct start_options *options);
 extern void close_text_file(struct start_options options);
@@ -80,6 +253,390 @@ extern void close_text_file(struct start_options options);
 // encode/decode
 extern void morse_decode(struct start_options options);
 
+/*
+ * Buffer level encode/decode, used by every mode that does not print
+ * straight to stdout.  The longest letter is 6 symbols plus the letter
+ * gap, a UTF-8 letter takes at least two bytes and is at most two codes.
+ * A decoded letter is at most 4 bytes of UTF-8 for a token of one symbol
+ * plus gap, a decoded prosign is never longer than its code plus gap.
+ * The decode bound leaves room for a token carried in from the previous
+ * chunk of a stream.
+ */
+#define MORSE_CHUNK 4096
+#define MORSE_CODE_MAX 6		// longest letter
+#define MORSE_TOKEN_MAX 9		// longest prosign
+#define MORSE_WORD_MAX 12		// longest dictionary word
+// A UTF-8 letter and an unterminated "<NAME" cut by the end of a chunk.
+#define MORSE_CARRY_MAX (MORSE_TOKEN_MAX + 3)
+#define MORSE_ENCODE_BOUND(len) ((len) * (MORSE_CODE_MAX + 1))
+#define MORSE_DECODE_BOUND(len) (2 * (len) + MORSE_TOKEN_MAX + 1)
+
+struct morse_decoder {
+    char tok[MORSE_TOKEN_MAX + 1];	// token carried over between chunks
+    size_t ntok;
+    size_t gap;				// separators seen since the last token
+    int started;
+};
+
+extern size_t morse_encode_buf(const char *in, size_t len, char *out);
+extern size_t encode_boundary(const char *in, size_t len);
+extern void morse_words_init(char *const *extra, size_t nextra);
+extern void morse_words_free(void);
+extern size_t morse_decode_buf(const char *in, size_t len, char *out);
+extern void morse_decoder_init(struct morse_decoder *d);
+extern size_t morse_decoder_feed(struct morse_decoder *d, const char *in,
+                                 size_t len, char *out);
+extern size_t morse_decoder_finish(struct morse_decoder *d, char *out);
+extern size_t morse_token_letter(const char *tok, char *out);
+
+/*
+ * Segmenting decoder for morse with missing letter gaps, see segment.c.
+ * It holds up to MORSE_SEGMENT_WINDOW symbols back, each gives at most 4
+ * bytes.
+ */
+#define MORSE_SEGMENT_WINDOW 1024
+#define MORSE_SEGMENT_BOUND(len) (4 * ((len) + MORSE_SEGMENT_WINDOW) + 1)
+
+struct morse_segmenter;
+
+extern struct morse_segmenter *segment_create(struct start_options *options);
+extern void segment_destroy(struct morse_segmenter *s);
+extern size_t segment_feed(struct morse_segmenter *s, const char *in,
+                           size_t len, char *out);
+extern size_t segment_finish(struct morse_segmenter *s, char *out);
+extern void segment_decode(struct start_options *options);
+
+/*
+ * Many short records in one call, record i is rec[i], len[i] bytes.  The
+ * results go back to back into out, record i at out + out_off[i] up to
+ * out + out_off[i + 1], out_off has n + 1 entries.  out must hold the
+ * MORSE_*_MANY_BOUND of the total input length.  Returns out_off[n].
+ */
+#define MORSE_ENCODE_MANY_BOUND(total, n) MORSE_ENCODE_BOUND(total)
+#define MORSE_DECODE_MANY_BOUND(total, n) \
+    (2 * (total) + (n) * (MORSE_TOKEN_MAX + 1))
+
+extern size_t morse_encode_many(const char *const *rec, const size_t *len,
+                                size_t n, char *out, size_t *out_off);
+extern size_t morse_decode_many(const char *const *rec, const size_t *len,
+                                size_t n, char *out, size_t *out_off);
+
+/*
+ * Counters, per thread and summed by --stats at exit (stats.c).  The
+ * USDT probes compile to nothing without <sys/sdt.h>, with it they can be
+ * attached to without a rebuild, e.g.
+ *   bpftrace -e 'usdt:./build/morse:morse:encode { @ = hist(arg2); }'
+ */
+struct morse_stats {
+    uint64_t bytes_in, bytes_out;
+    uint64_t letters;			// letters encoded or tokens decoded
+    uint64_t unknown;			// no code for the letter or token
+    uint64_t chunks, chunk_ns, chunk_max_ns;
+    uint64_t flushes, flush_bytes;	// output handed to the kernel
+    uint64_t cache_hits, cache_misses, cache_evictions;
+    struct morse_stats *next;
+};
+
+extern __thread struct morse_stats *morse_tstats;
+extern int morse_stats_enabled;
+extern struct morse_stats *morse_stats_register(void);
+extern uint64_t morse_stats_chunk_start(void);
+extern void morse_stats_chunk_end(uint64_t start);
+extern void morse_stats_flush(size_t bytes);
+extern void morse_stats_print(void);
+extern void morse_stats_reset(void);
+
+/*
+ * Result cache of the daemon and batch workers, one per thread (cache.c).
+ * The mode is MORS_ENCO or MORS_DECO.
+ */
+#define MORSE_CACHE_DEFAULT (16L << 20)	// bytes over all workers
+
+struct morse_cache;
+
+extern struct morse_cache *cache_create(size_t budget);
+extern void cache_destroy(struct morse_cache *c);
+extern const char *cache_get(struct morse_cache *c, int mode, const char *in,
+                             size_t len, size_t *out_len);
+extern void cache_put(struct morse_cache *c, int mode, const char *in,
+                      size_t len, const char *out, size_t out_len);
+extern struct morse_cache *cache_for_worker(struct start_options *options,
+                                            int nthreads);
+
+/*
+ * Calibration of this machine, measured on first use and kept in the
+ * cache directory (tune.c).  The engines ask it for their thread count,
+ * chunk size and I/O path when the command line does not set them.
+ */
+#define TUNE_MIN (64 * 1024)		// smaller inputs run on one thread
+
+struct morse_tune {
+    char magic[8];
+    uint64_t machine;			// cpu model and count it was taken on
+    uint32_t ncpu;
+    uint32_t chunk;			// text per parallel encode task
+    uint32_t read_max;			// read() files up to this, mmap above
+    uint32_t uring;			// io_uring batches beat the mmap ones
+    double encode_ns, decode_ns;	// per input byte on one thread
+    double speedup;			// of ncpu threads over one
+    double thread_ns;			// start and join one worker
+    double file_ns, uring_file_ns;	// per small batch file
+};
+
+extern const struct morse_tune *tune_get(struct start_options *options);
+extern int tune_threads(const struct morse_tune *t, double bytes, size_t ntasks,
+                        int mode);
+extern void tune_display_message(struct start_options *options);
+extern void tune_run(struct start_options *options);
+
+/*
+ * Bytes without a code and tokens without a letter, counted by --validate
+ * and --strict with the offsets of the first max of each (validate.c).
+ */
+#define MORSE_VALIDATE_FIRST 10		// offsets reported by default
+
+struct morse_validate {
+    uint64_t bad_chars, bad_tokens;	// letters with no code or stray bytes
+    uint64_t *char_at, *token_at;
+    size_t max;
+};
+
+extern void validate_buf(struct morse_validate *v, int mode, const char *in,
+                         size_t len, uint64_t base);
+extern void validate_run(struct start_options *options);
+extern void validate_strict(struct start_options *options);
+
+// --profile, self sampling through perf_event_open (profile.c)
+extern void profile_start(const char *path);
+
+static inline struct morse_stats *morse_stats_get(void)
+{
+    return morse_tstats ? morse_tstats : morse_stats_register();
+}
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MORSE_PROBE1(name, a) DTRACE_PROBE1(morse, name, a)
+#define MORSE_PROBE3(name, a, b, c) DTRACE_PROBE3(morse, name, a, b, c)
+#endif
+#endif
+#ifndef MORSE_PROBE1
+#define MORSE_PROBE1(name, a) do { } while (0)
+#define MORSE_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+/*
+ * PARIS timing, a word is 50 dot units so one dot lasts 1200ms / WPM.
+ */
+#define DEFAULT_WPM 18
+#define MORSE_DOT_NS(wpm) (1200000000ULL / (wpm))
+
+// timing decoder, key down/up durations to letters
+#define TIMING_MAX_SYMBOLS 8
+
+struct beam_decoder;
+
+struct timing_decoder {
+    struct beam_decoder *beam;		// decides instead, -d --lm/--beam
+    uint64_t dot_ns;			// running estimate of the dot length
+    char sym[TIMING_MAX_SYMBOLS + 1];	// elements of the letter being keyed
+    int nsym;
+    int word_pending;			// letters seen since the last word gap
+    void (*emit)(char c, void *arg);
+    void *arg;
+};
+
+extern void timing_decoder_init(struct timing_decoder *td, unsigned wpm,
+                                void (*emit)(char c, void *arg), void *arg);
+extern void timing_decoder_mark(struct timing_decoder *td, uint64_t ns);
+extern void timing_decoder_space(struct timing_decoder *td, uint64_t ns);
+extern uint64_t timing_decoder_idle_ns(struct timing_decoder *td);
+extern void timing_decoder_flush(struct timing_decoder *td);
+extern void timing_decoder_options(struct timing_decoder *td,
+                                   struct start_options *options);
+extern void timing_file_decode(struct start_options *options);
+
+/*
+ * Character and word n-gram model, see lm.c.  Costs are -log2 of the
+ * probability, in bits.
+ */
+#define LM_ORDER 4
+
+struct morse_lm {
+    void *map;
+    size_t size;
+    unsigned order, char_bits, word_bits;
+    const unsigned char *chars, *words;
+};
+
+extern void lm_open(struct morse_lm *lm, const char *path);
+extern void lm_close(struct morse_lm *lm);
+extern double lm_char_cost(const struct morse_lm *lm, uint32_t ctx, char c);
+extern double lm_letter_cost(const struct morse_lm *lm, char c);
+extern double lm_word_cost(const struct morse_lm *lm, uint32_t word);
+extern uint32_t lm_word_hash(uint32_t h, char c);
+extern void lm_build(struct start_options *options);
+
+// beam search timing decoder, see beam.c
+extern struct beam_decoder *beam_create(const struct morse_lm *lm,
+                                        unsigned width, uint64_t dot_ns,
+                                        void (*emit)(char c, void *arg),
+                                        void *arg);
+extern void beam_destroy(struct beam_decoder *b);
+extern void beam_mark(struct beam_decoder *b, uint64_t ns);
+extern void beam_space(struct beam_decoder *b, uint64_t ns);
+extern uint64_t beam_idle_ns(const struct beam_decoder *b);
+extern void beam_flush(struct beam_decoder *b);
+
+/*
+ * Keying schedule, the key down/up durations that send a code.  With
+ * Farnsworth timing the letters keep their speed and the letter and word
+ * gaps are stretched so the overall speed drops to the Farnsworth WPM:
+ * of the 50 units of PARIS, 31 are letters and 19 are gaps.
+ */
+#define MORSE_GAP_NS(wpm, fwpm) \
+    ((60000000000ULL / (fwpm) - 31 * MORSE_DOT_NS(wpm)) / 19)
+#define TIMING_MAX_ELEMENTS (2 * MORSE_TOKEN_MAX)
+
+struct timing_keying {
+    uint64_t dot_ns;			// element length
+    uint64_t gap_ns;			// unit of the letter and word gaps
+};
+
+struct timing_element {
+    int down;				// key down or up
+    uint64_t ns;
+};
+
+extern void timing_keying_init(struct timing_keying *k, unsigned wpm,
+                               unsigned farnsworth);
+extern size_t timing_schedule(const struct timing_keying *k, const char *code,
+                              struct timing_element *out);
+
+// batch mode
+#define MORSE_FILE_SUFFIX ".morse"
+#define TEXT_FILE_SUFFIX ".txt"
+
+struct pool;
+typedef void (*pool_fn)(void *arg, int worker);
+
+extern struct pool *pool_create(int nthreads);
+extern void pool_submit(struct pool *p, pool_fn fn, void *arg);
+extern void pool_wait(struct pool *p);
+extern void pool_destroy(struct pool *p);
+
+extern int batch_threads(struct start_options *options);
+extern int batch_output_path(int mode, const char *outdir, const char *in,
+                             char *path, size_t len);
+extern void batch_run(struct start_options *options);
+extern int batch_files(struct start_options *options, int nthreads,
+                       size_t read_max);
+extern void batch_read_list(struct start_options *options);
+extern int uring_batch_run(struct start_options *options, int nthreads);
+
+/*
+ * Daemon protocol, every frame is a 32 bit big endian length followed by
+ * that many bytes.  The first byte is the operation in a request and the
+ * status in a response, the rest is the payload.
+ */
+#define MORSE_SRV_LEN_SIZE 4
+#define MORSE_SRV_HDR_SIZE (MORSE_SRV_LEN_SIZE + 1)
+#define MORSE_SRV_MAX_REQUEST (1 << 20)
+
+enum {
+    MORSE_SRV_ENCODE = 'e',
+    MORSE_SRV_DECODE = 'd',
+};
+
+enum {
+    MORSE_SRV_OK,
+    MORSE_SRV_BAD_REQUEST,
+};
+
+static inline void morse_srv_put_hdr(char *p, uint32_t len, uint8_t code)
+{
+    p[0] = len >> 24;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    p[4] = code;
+}
+
+static inline uint32_t morse_srv_get_len(const char *p)
+{
+    const uint8_t *u = (const uint8_t *)p;
+
+    return (uint32_t)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+extern void morse_serve(struct start_options options);
+
+/*
+ * Morse over UDP, one datagram per letter, big endian:
+ *
+ *   0  magic 2, version 1, flags 1
+ *   4  stream 4, random per sender run
+ *   8  sequence 4
+ *  12  start of the letter 8, microseconds on the sender's clock
+ *  20  lead 4, signed microseconds the datagram left before the start
+ *  24  elements 1, code bytes 1, text bytes 1
+ *  27  elements x 4, microseconds with the top bit set for key down
+ *      the code(s), space separated
+ *      the letter as text, UTF-8
+ *
+ * A letter carries its keying or its code, never both.  The last datagram
+ * of a stream has MORSE_UDP_END set and nothing else.
+ */
+#define MORSE_UDP_PORT 7373
+#define MORSE_UDP_MAGIC 0x4d4b		// "MK"
+#define MORSE_UDP_VERSION 1
+#define MORSE_UDP_HDR_SIZE 27
+#define MORSE_UDP_CODE_MAX (2 * MORSE_TOKEN_MAX + 1)
+#define MORSE_UDP_TEXT_MAX 8
+#define MORSE_UDP_MAX (MORSE_UDP_HDR_SIZE + 4 * 2 * TIMING_MAX_ELEMENTS \
+                       + MORSE_UDP_CODE_MAX + MORSE_UDP_TEXT_MAX)
+
+enum {
+    MORSE_UDP_END = 1,
+};
+
+extern void udp_sender_open(struct start_options *options);
+extern void udp_send_letter(const char *const *codes, int ncodes,
+                            const struct timing_element *el, size_t nel,
+                            uint64_t t, const char *text, size_t ntext);
+extern void udp_send_flush(void);
+extern void udp_send_end(uint64_t t);
+extern void udp_send_run(struct start_options *options);
+extern void udp_listen_run(struct start_options *options);
+
+// compressed single file mode, pipeline.c
+enum {
+    PIPE_AUTO,				// from the --output suffix
+    PIPE_PLAIN,
+    PIPE_GZIP,
+    PIPE_ZSTD,
+};
+
+extern int pipeline_format(const char *name);
+extern int pipeline_wanted(struct start_options *options);
+extern void pipeline_run(struct start_options *options);
+struct pipe_source;
+extern struct pipe_source *pipeline_open(int fd, int stream, int *fmt);
+extern ssize_t pipeline_read(struct pipe_source *s, char *buf, size_t len);
+extern const char *pipeline_error(struct pipe_source *s, char *buf, size_t len);
+extern void pipeline_close(struct pipe_source *s);
+
+// live input backends
+extern void gpio_decode(struct start_options options);
+extern int gpio_open_output(const char *spec);
+extern void gpio_set(int fd, int value);
+extern void follow_file(struct start_options options);
+extern void verify_run(struct start_options *options);
+extern void records_run(struct start_options *options);
+extern void keyer_run(struct start_options *options);
+extern void generate_run(struct start_options *options);
+
 #define DOT_FILE_NAME ".morsecode.cfg"
 #define ETC_FILE_PATH_AND_NAME "/etc/morsecode.cfg"
 
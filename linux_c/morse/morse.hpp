@@ -0,0 +1,309 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Header only C++20 Morse code, for firmware and tools that embed morse.
+ *
+ *   #include "morse.hpp"
+ *   using namespace morse::literals;
+ *
+ *   static constexpr auto beacon = "CQ CQ DE N0CALL K"_morse;	// .rodata
+ *   uart_write(beacon.data(), beacon.size());
+ *
+ *   char buf[morse::encode_bound(64)];
+ *   std::size_t n = morse::encode(text, buf);
+ *   morse::encode(text, [&](std::string_view s) { uart_write(s.data(), s.size()); });
+ *
+ * The table is morse_table.h, the same one decode.c builds morse_code[]
+ * from, and the output is byte for byte what morse_encode_buf() and
+ * morse_decode_buf() give for ASCII with the built in table: every letter
+ * is followed by a space, a space in the text is sent as a word gap,
+ * letters without a code as a lone space.  Config file letters, prosigns
+ * and the alphabets outside ASCII are C side only, bytes above 0x7f
+ * encode to nothing here.
+ *
+ * Everything is constexpr, the _morse literal is consteval so a fixed
+ * message costs no code at run time.  The sink overloads take any callable
+ * accepting std::string_view and are instantiated for each sink, so a
+ * UART or ring buffer writer is inlined into the loop.  The span overloads
+ * write at most out.size() bytes and return the full length, like
+ * snprintf().
+ */
+#ifndef MORSE_HPP
+#define MORSE_HPP
+
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+namespace morse {
+
+inline constexpr std::array<std::string_view, 'z' + 1> table = {
+#include "morse_table.h"
+};
+
+inline constexpr std::size_t token_max = 9;	// MORSE_TOKEN_MAX in morse.h
+
+// Output size limits, same as MORSE_ENCODE_BOUND/MORSE_DECODE_BOUND.
+constexpr std::size_t encode_bound(std::size_t len) noexcept
+{
+    return len * 7;
+}
+
+constexpr std::size_t decode_bound(std::size_t len) noexcept
+{
+    return 2 * len + token_max + 1;
+}
+
+template <class S>
+concept sink = std::invocable<S &, std::string_view>;
+
+// Code of one character, empty when it has none.
+constexpr std::string_view code(char c) noexcept
+{
+    unsigned char u = static_cast<unsigned char>(c);
+
+    return u < table.size() ? table[u] : std::string_view{};
+}
+
+namespace detail {
+
+/*
+ * Codes as a binary heap, the root is 1 and a dot goes left, a dash
+ * right.  Letters sharing a code decode to the first in the table, upper
+ * case, as morse2char() does.
+ */
+inline constexpr std::size_t depth = [] {
+    std::size_t d = 0;
+
+    for (std::string_view c : table)
+        if (c.size() > d && c != " ")
+            d = c.size();
+    return d;
+}();
+
+inline constexpr std::array<char, (std::size_t{2} << depth)> heap = [] {
+    std::array<char, (std::size_t{2} << depth)> h{};
+
+    for (std::size_t i = 0; i < table.size(); i++) {
+        std::size_t k = 1;
+
+        if (table[i].empty() || table[i] == " ")
+            continue;
+        for (char s : table[i])
+            k = 2 * k + (s == '-');
+        if (!h[k])
+            h[k] = static_cast<char>(i);
+    }
+    return h;
+}();
+
+// Bounded writes into a caller buffer, counts what did not fit as well.
+struct span_sink {
+    std::span<char> out;
+    std::size_t n = 0;
+
+    constexpr void operator()(std::string_view s) noexcept
+    {
+        for (char c : s) {
+            if (n < out.size())
+                out[n] = c;
+            n++;
+        }
+    }
+};
+
+constexpr bool is_separator(char c) noexcept
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+} // namespace detail
+
+// Character for one code, a space when it has none.
+constexpr char letter(std::string_view code) noexcept
+{
+    std::size_t k = 1;
+
+    if (code.empty() || code.size() > detail::depth)
+        return ' ';
+    for (char s : code) {
+        if (s != '.' && s != '-')
+            return ' ';
+        k = 2 * k + (s == '-');
+    }
+    return detail::heap[k] ? detail::heap[k] : ' ';
+}
+
+template <sink Sink>
+constexpr void encode(std::string_view text, Sink &&out)
+{
+    for (char c : text) {
+        out(code(c));
+        out(std::string_view{" "});
+    }
+}
+
+constexpr std::size_t encode(std::string_view text, std::span<char> out) noexcept
+{
+    detail::span_sink s{out};
+
+    encode(text, s);
+    return s.n;
+}
+
+constexpr std::size_t encoded_size(std::string_view text) noexcept
+{
+    return encode(text, std::span<char>{});
+}
+
+/*
+ * Streaming decoder, the twin of struct morse_decoder: tokens may be split
+ * across feed() calls and a run of more than one separator between two
+ * tokens is a word gap, decoded to one space.
+ */
+class decoder {
+public:
+    template <sink Sink>
+    constexpr void feed(std::string_view in, Sink &&out)
+    {
+        for (char c : in) {
+            if (detail::is_separator(c)) {
+                if (ntok_)
+                    token(out);
+                gap_++;
+                continue;
+            }
+            if (gap_ > 1 && started_)
+                out(std::string_view{" "});
+            gap_ = 0;
+            started_ = true;
+            if (ntok_ < token_max)
+                tok_[ntok_] = c;
+            ntok_++;
+        }
+    }
+
+    template <sink Sink>
+    constexpr void finish(Sink &&out)
+    {
+        if (ntok_)
+            token(out);
+        *this = decoder{};
+    }
+
+private:
+    template <sink Sink>
+    constexpr void token(Sink &out)
+    {
+        char c = ntok_ > token_max ? ' '
+               : letter(std::string_view{tok_.data(), ntok_});
+
+        out(std::string_view{&c, 1});
+        ntok_ = 0;
+    }
+
+    std::array<char, token_max> tok_{};
+    std::size_t ntok_ = 0;
+    std::size_t gap_ = 0;
+    bool started_ = false;
+};
+
+template <sink Sink>
+constexpr void decode(std::string_view in, Sink &&out)
+{
+    decoder d;
+
+    d.feed(in, out);
+    d.finish(out);
+}
+
+constexpr std::size_t decode(std::string_view in, std::span<char> out) noexcept
+{
+    detail::span_sink s{out};
+
+    decode(in, s);
+    return s.n;
+}
+
+/*
+ * A string literal as a template argument, N counts the terminating NUL
+ * which is not part of the text.
+ */
+template <std::size_t N>
+struct fixed_string {
+    char s[N];
+
+    consteval fixed_string(const char (&str)[N])
+    {
+        for (std::size_t i = 0; i < N; i++)
+            s[i] = str[i];
+    }
+
+    constexpr std::string_view view() const noexcept
+    {
+        return {s, N - 1};
+    }
+};
+
+// Encoded text of a fixed size, as produced at compile time.
+template <std::size_t N>
+struct encoded_text {
+    std::array<char, N> bytes;
+
+    constexpr const char *data() const noexcept { return bytes.data(); }
+    constexpr std::size_t size() const noexcept { return N; }
+    constexpr std::string_view view() const noexcept { return {bytes.data(), N}; }
+    constexpr operator std::string_view() const noexcept { return view(); }
+};
+
+template <fixed_string Text>
+consteval auto encode_literal()
+{
+    encoded_text<encoded_size(Text.view())> r{};
+
+    encode(Text.view(), std::span<char>{r.bytes});
+    return r;
+}
+
+// One object per distinct text, in .rodata.
+template <fixed_string Text>
+inline constexpr auto encoded = encode_literal<Text>();
+
+namespace literals {
+
+template <fixed_string Text>
+consteval auto operator""_morse()
+{
+    return encode_literal<Text>();
+}
+
+} // namespace literals
+
+} // namespace morse
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * The Morse code table, one entry per ASCII character from 0 to 'z'.
+ * Included as the initializer of morse_code[] in decode.c and of the
+ * constexpr table in morse.hpp, so C and C++ share one table.
+ */
+
+/* WARNING WARNING This array of strings is position sensitive WARNING WARNING */
+/* Do NOT make changes unless you fully understand what this table does.       */
+	"", "", "", "", "", "", "", "", "", "",
+	" ",		/* use space instead of \n Use this for timing of words, this is not in Morse code */
+	"", "", "", "", "", "", "", "", "",
+	"", "", "", "", "", "", "", "", "", "",
+	"", "",
+	" ",	 	/* space Use this for timing of words, this is not in Morse code */	
+	"-.-.--",	/* !	Not in ITU-R recommendation */
+	".-..-.",	/* " */	
+	"",		/* #	Char not in Morse Code */
+	"",		/* $	Char not in Morse Code */
+	"",		/* %	Char not in Morse Code */
+	".-...",	/* & */	
+	".----.",	/* ' */	
+	"-.--.",	/* ( */	
+	"-.--.-",	/* ) */	
+	"",		/* *	Char not in Morse Code */
+	".-.-.",	/* + */	
+	"--..--",	/* , */	
+	"-....-",	/* - */	
+	".-.-.-",	/* . */	
+	"-..-.",	/* / */	
+	"-----",	/* 0 */	
+	".----",	/* 1 */	
+	"..---",	/* 2 */	
+	"...--",	/* 3 */	
+	"....-",	/* 4 */	
+	".....",	/* 5 */	
+	"-....",	/* 6 */		
+	"--...",	/* 7 */		
+	"---..",	/* 8 */		
+	"----.",	/* 9 */		
+	"---...",	/* : */		
+	"",		/* ;	Char not in Morse Code */
+	"",		/* <	Char not in Morse Code */
+	"-...-",	/* = */	
+	"",		/* >	Char not in Morse Code */
+	"..--..",	/* ? */	
+	".--.-.",	/* @ */	
+	".-",		/* A */	
+	"-...",		/* B */	
+	"-.-.",		/* C */	
+	"-..",		/* D */	
+	".",		/* E */	
+	"..-.",		/* F */	
+	"--.",		/* G */	
+	"....",		/* H */	
+	"..",		/* I */	
+	".---",		/* J */	
+	"-.-",		/* K */	
+	".-..",		/* L */	
+	"--",		/* M */	
+	"-.",		/* N */	
+	"---",		/* O */	
+	".--.",		/* P */	
+	"--.-",		/* Q */	
+	".-.",		/* R */	
+	"...",		/* S */	
+	"-",		/* T */	
+	"..-",		/* U */	
+	"...-",		/* V */	
+	".--",		/* W */	
+	"-..-",		/* X */	
+	"-.--",		/* Y */	
+	"--..",		/* Z */	
+	"",		/* [	Char not in Morse Code */
+	"",		/* \	Char not in Morse Code */
+	"",		/* ]	Char not in Morse Code */
+	"",		/* ^	Char not in Morse Code */
+	"",		/* _	Char not in Morse Code */
+	"",		/* `	Char not in Morse Code */
+	".-",		/* a */	
+	"-...",		/* b */	
+	"-.-.",		/* c */	
+	"-..",		/* d */	
+	".",		/* e */	
+	"..-.",		/* f */	
+	"--.",		/* g */	
+	"....",		/* h */	
+	"..",		/* i */	
+	".---",		/* j */	
+	"-.-",		/* k */	
+	".-..",		/* l */	
+	"--",		/* m */	
+	"-.",		/* n */	
+	"---",		/* o */	
+	".--.",		/* p */	
+	"--.-",		/* q */	
+	".-.",		/* r */	
+	"...",		/* s */	
+	"-",		/* t */	
+	"..-",		/* u */	
+	"...-",		/* v */	
+	".--",		/* w */	
+	"-..-",		/* x */	
+	"-.--",		/* y */	
+	"--.."		/* z */	
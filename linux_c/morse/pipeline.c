@@ -0,0 +1,767 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Compressed input and output for single file mode.
+ *
+ *   morse -e -f notes.txt.gz --output notes.morse.zst
+ *
+ * gzip and zstd input is recognised by its magic number, output is
+ * compressed with --compress or when --output ends in .gz or .zst.  zstd
+ * is only available when the Makefile found its header (HAVE_ZSTD).
+ *
+ * The work is split in three stages on their own threads:
+ *
+ *   reader     read the file and decompress it into text blocks
+ *   convert    encode or decode the blocks
+ *   writer     compress and write the result (the calling thread)
+ *
+ * linked by single producer, single consumer rings of PIPE_DEPTH fixed
+ * size blocks, so a full ring stalls the stage in front of it and a run
+ * goes as fast as its slowest stage rather than the sum of all three.
+ * The blocks live in the ring and are filled and used in place, nothing
+ * is allocated per block.
+ *
+ * Input that is not a regular file (-f - for stdin, a FIFO, a socket)
+ * cannot be mapped and goes through here too, so reading the next block
+ * overlaps with converting and writing the last one.
+ *
+ * The reader's decompression is a pipe_source of its own (pipeline_open()
+ * and pipeline_read()), --validate scans compressed inputs through one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "morse.h"
+
+#define PIPE_BLOCK 65536		// text per block
+#define PIPE_HEAD MORSE_CARRY_MAX	// room to prepend a cut letter or prosign
+#define PIPE_DEPTH 8			// blocks per ring, a power of two
+#define PIPE_IO 65536			// compressed read/write size
+#define PIPE_SPIN 128			// polls before sleeping on a ring
+
+struct pipe_block {
+    size_t len;
+    char data[];
+};
+
+/*
+ * head is only written by the consumer and tail by the producer.  The
+ * producer waits for the consumer on a futex on head, the consumer waits
+ * on posted, which ring_put() and ring_close() both bump so that closing
+ * changes the word it sleeps on too.  A side only makes the wake up call
+ * when the other one said it is going to sleep (the *_wait flags), the
+ * seq_cst stores and loads on both sides order the flag against the
+ * counters so a wake up cannot be missed.
+ */
+struct pipe_ring {
+    _Alignas(64) atomic_uint head;	// next block to consume
+    atomic_int consumer_wait;
+    _Alignas(64) atomic_uint tail;	// next block to fill
+    atomic_uint posted;			// puts and the close, consumer futex
+    atomic_int producer_wait;
+    atomic_int closed;
+    _Alignas(64) char *blocks;
+    size_t block_size;
+};
+
+static struct {
+    struct start_options *options;
+    int in_fd, out_fd;
+    int in_fmt, out_fmt;
+    struct pipe_ring text, morse;
+    struct pipe_source *src;
+} pipe_run;
+
+struct pipe_source {
+    int fd, fmt;
+    unsigned char lead[4];		// sniffed from a pipe, read first
+    size_t nlead;
+    char *in;				// compressed bytes read ahead
+    size_t in_len, in_pos;
+    int end;				// at the end of a gzip member or zstd frame
+    const char *what, *why;		// the error, once there is one
+    char msg[128];
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *dctx;
+#endif
+};
+
+static void *pipe_alloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p) {
+        perror("Error allocating pipeline buffer");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void futex_wait(atomic_uint *addr, unsigned val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void ring_init(struct pipe_ring *r, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+    r->block_size = (sizeof(struct pipe_block) + size + 63) & ~(size_t)63;
+    r->blocks = pipe_alloc(PIPE_DEPTH * r->block_size);
+}
+
+static struct pipe_block *ring_block(struct pipe_ring *r, unsigned n)
+{
+    return (struct pipe_block *)(r->blocks + (n % PIPE_DEPTH) * r->block_size);
+}
+
+/*
+ * Wait until *counter moves away from val or the ring is closed, spinning
+ * a little first since the other side is usually just about done.  The
+ * futex is on *seq, which the other side changes before every wake up.
+ */
+static void ring_wait(struct pipe_ring *r, atomic_uint *counter, unsigned val,
+                      atomic_uint *seq, atomic_int *waiting)
+{
+    for (int i = 0; i < PIPE_SPIN; i++) {
+        if (atomic_load_explicit(counter, memory_order_acquire) != val
+            || atomic_load(&r->closed))
+            return;
+#ifdef __SSE2__
+        __builtin_ia32_pause();
+#endif
+    }
+    atomic_store(waiting, 1);
+    for (;;) {
+        unsigned s = atomic_load(seq);
+
+        if (atomic_load(counter) != val || atomic_load(&r->closed))
+            break;
+        futex_wait(seq, s);
+    }
+    atomic_store(waiting, 0);
+}
+
+// Producer, the next free block, waits while the ring is full.
+static struct pipe_block *ring_get(struct pipe_ring *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    struct pipe_block *b;
+
+    while (tail - atomic_load_explicit(&r->head, memory_order_acquire) == PIPE_DEPTH)
+        ring_wait(r, &r->head, tail - PIPE_DEPTH, &r->head,
+                  &r->producer_wait);
+    b = ring_block(r, tail);
+    b->len = 0;
+    return b;
+}
+
+// Producer, hand the block from ring_get() to the consumer.
+static void ring_put(struct pipe_ring *r)
+{
+    atomic_fetch_add(&r->tail, 1);
+    atomic_fetch_add(&r->posted, 1);
+    if (atomic_load(&r->consumer_wait))
+        futex_wake(&r->posted);
+}
+
+// Producer, no more blocks will be put.
+static void ring_close(struct pipe_ring *r)
+{
+    atomic_store(&r->closed, 1);
+    atomic_fetch_add(&r->posted, 1);
+    futex_wake(&r->posted);
+}
+
+// Consumer, the oldest block, NULL once the ring is closed and empty.
+static struct pipe_block *ring_peek(struct pipe_ring *r)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    for (;;) {
+        if (atomic_load_explicit(&r->tail, memory_order_acquire) != head)
+            return ring_block(r, head);
+        if (atomic_load(&r->closed)) {
+            // A block put just before closing still counts.
+            if (atomic_load(&r->tail) != head)
+                return ring_block(r, head);
+            return NULL;
+        }
+        ring_wait(r, &r->tail, head, &r->posted, &r->consumer_wait);
+    }
+}
+
+// Consumer, done with the block from ring_peek(), the producer may refill it.
+static void ring_done(struct pipe_ring *r)
+{
+    atomic_fetch_add(&r->head, 1);
+    if (atomic_load(&r->producer_wait))
+        futex_wake(&r->head);
+}
+
+static void pipe_fail(const char *what, const char *why)
+{
+    fprintf(stderr, "Error %s: %s\n", what, why);
+    exit(EXIT_FAILURE);
+}
+
+static ssize_t source_fail(struct pipe_source *s, const char *what,
+                           const char *why)
+{
+    s->what = what;
+    s->why = why;
+    return -1;
+}
+
+static ssize_t source_raw(struct pipe_source *s, char *buf, size_t len)
+{
+    if (s->nlead) {
+        size_t n = s->nlead < len ? s->nlead : len;
+
+        memcpy(buf, s->lead, n);
+        memmove(s->lead, s->lead + n, s->nlead - n);
+        s->nlead -= n;
+        return n;
+    }
+    for (;;) {
+        ssize_t n = read(s->fd, buf, len);
+
+        if (n >= 0)
+            return n;
+        if (errno != EINTR)
+            return source_fail(s, "reading input", strerror(errno));
+    }
+}
+
+// Fill buf with text unless the input ends first.
+static ssize_t source_gzip(struct pipe_source *s, char *buf, size_t len)
+{
+    z_stream *zs = &s->zs;
+    int ret;
+
+    zs->next_out = (Bytef *)buf;
+    zs->avail_out = len;
+    while (zs->avail_out) {
+        if (!zs->avail_in) {
+            ssize_t n = source_raw(s, s->in, PIPE_IO);
+
+            if (n == -1)
+                return -1;
+            if (!n) {
+                if (!s->end)
+                    return source_fail(s, "decompressing gzip input",
+                                       "unexpected end of file");
+                break;
+            }
+            zs->next_in = (Bytef *)s->in;
+            zs->avail_in = n;
+        }
+        // A finished member may be followed by another, as with cat a.gz b.gz.
+        if (s->end)
+            inflateReset(zs);
+        ret = inflate(zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            snprintf(s->msg, sizeof(s->msg), "%s", zs->msg ? zs->msg : "corrupt data");
+            return source_fail(s, "decompressing gzip input", s->msg);
+        }
+        s->end = ret == Z_STREAM_END;
+    }
+    return len - zs->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+static ssize_t source_zstd(struct pipe_source *s, char *buf, size_t len)
+{
+    ZSTD_outBuffer zout = { buf, len, 0 };
+
+    while (zout.pos < len) {
+        ZSTD_inBuffer zin;
+        size_t ret;
+
+        if (s->in_pos == s->in_len) {
+            ssize_t n = source_raw(s, s->in, PIPE_IO);
+
+            if (n == -1)
+                return -1;
+            if (!n) {
+                if (!s->end)
+                    return source_fail(s, "decompressing zstd input",
+                                       "unexpected end of file");
+                break;
+            }
+            s->in_len = n;
+            s->in_pos = 0;
+        }
+        zin.src = s->in;
+        zin.size = s->in_len;
+        zin.pos = s->in_pos;
+        ret = ZSTD_decompressStream(s->dctx, &zout, &zin);
+        s->in_pos = zin.pos;
+        if (ZSTD_isError(ret))
+            return source_fail(s, "decompressing zstd input",
+                               ZSTD_getErrorName(ret));
+        s->end = ret == 0;		// 0 only at the end of a frame
+    }
+    return zout.pos;
+}
+#endif
+
+/*
+ * Up to len bytes of text, 0 at the end of the input and -1 on an error,
+ * pipeline_error() tells which.  Compressed input fills buf unless it
+ * ends, plain input returns what one read() gives.
+ */
+ssize_t pipeline_read(struct pipe_source *s, char *buf, size_t len)
+{
+    if (s->what)
+        return -1;
+    if (s->fmt == PIPE_GZIP)
+        return source_gzip(s, buf, len);
+#ifdef HAVE_ZSTD
+    if (s->fmt == PIPE_ZSTD)
+        return source_zstd(s, buf, len);
+#endif
+    return source_raw(s, buf, len);
+}
+
+const char *pipeline_error(struct pipe_source *s, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s: %s", s->what, s->why);
+    return buf;
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    morse_stats_flush(len);
+    while (len) {
+        ssize_t n = write(pipe_run.out_fd, buf, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error writing output");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void read_source(void)
+{
+    for (;;) {
+        struct pipe_block *b = ring_get(&pipe_run.text);
+        ssize_t n = pipeline_read(pipe_run.src, b->data + PIPE_HEAD, PIPE_BLOCK);
+
+        if (n == -1)
+            pipe_fail(pipe_run.src->what, pipe_run.src->why);
+        if (!n)
+            return;
+        b->len = n;
+        ring_put(&pipe_run.text);
+    }
+}
+
+static void read_message(void)
+{
+    struct start_options *o = pipe_run.options;
+
+    for (size_t off = 0, n; off < o->length; off += n) {
+        struct pipe_block *b = ring_get(&pipe_run.text);
+
+        n = o->length - off < PIPE_BLOCK ? o->length - off : PIPE_BLOCK;
+        memcpy(b->data + PIPE_HEAD, o->message + off, n);
+        b->len = n;
+        ring_put(&pipe_run.text);
+    }
+}
+
+static void *pipe_reader(void *arg)
+{
+    (void)arg;
+    if (pipe_run.in_fd == -1)
+        read_message();
+    else
+        read_source();
+    ring_close(&pipe_run.text);
+    return NULL;
+}
+
+static void *pipe_convert(void *arg)
+{
+    int mode = pipe_run.options->mode;
+    struct morse_decoder dec;
+    struct morse_segmenter *seg = NULL;
+    struct pipe_block *b, *out;
+    char carry[PIPE_HEAD];
+    size_t ncarry = 0;
+
+    (void)arg;
+    morse_decoder_init(&dec);
+    if (mode == MORS_DECO && pipe_run.options->segment)
+        seg = segment_create(pipe_run.options);
+    while ((b = ring_peek(&pipe_run.text))) {
+        uint64_t start = morse_stats_chunk_start();
+
+        out = ring_get(&pipe_run.morse);
+        if (mode == MORS_ENCO) {
+            // Put what was cut off the last block in front of this one.
+            char *in = b->data + PIPE_HEAD - ncarry;
+            size_t len = b->len + ncarry, whole;
+
+            memcpy(in, carry, ncarry);
+            whole = encode_boundary(in, len);
+            out->len = morse_encode_buf(in, whole, out->data);
+            ncarry = len - whole;
+            memcpy(carry, in + whole, ncarry);
+        } else if (seg)
+            out->len = segment_feed(seg, b->data + PIPE_HEAD, b->len, out->data);
+        else
+            out->len = morse_decoder_feed(&dec, b->data + PIPE_HEAD, b->len,
+                                          out->data);
+        morse_stats_chunk_end(start);
+        ring_done(&pipe_run.text);
+        ring_put(&pipe_run.morse);
+    }
+
+    // Same ending as display_message() and morse_decode().
+    out = ring_get(&pipe_run.morse);
+    if (mode == MORS_ENCO) {
+        out->len = morse_encode_buf(carry, ncarry, out->data);
+        out->data[out->len++] = '\n';
+    } else if (seg) {
+        out->len = segment_finish(seg, out->data);
+        segment_destroy(seg);
+    } else
+        out->len = morse_decoder_finish(&dec, out->data);
+    ring_put(&pipe_run.morse);
+    ring_close(&pipe_run.morse);
+    return NULL;
+}
+
+static void write_plain(void)
+{
+    struct pipe_block *b;
+
+    while ((b = ring_peek(&pipe_run.morse))) {
+        write_all(b->data, b->len);
+        ring_done(&pipe_run.morse);
+    }
+}
+
+static void write_gzip(void)
+{
+    char *buf = pipe_alloc(PIPE_IO);
+    struct pipe_block *b;
+    z_stream zs;
+    int flush;
+
+    memset(&zs, 0, sizeof(zs));
+    // 16 + 15: gzip header, largest window
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        pipe_fail("initializing gzip", zs.msg ? zs.msg : "");
+    do {
+        b = ring_peek(&pipe_run.morse);
+        zs.next_in = b ? (Bytef *)b->data : NULL;
+        zs.avail_in = b ? b->len : 0;
+        flush = b ? Z_NO_FLUSH : Z_FINISH;
+        do {
+            zs.next_out = (Bytef *)buf;
+            zs.avail_out = PIPE_IO;
+            deflate(&zs, flush);
+            if (PIPE_IO - zs.avail_out)
+                write_all(buf, PIPE_IO - zs.avail_out);
+        } while (zs.avail_out == 0);
+        if (b)
+            ring_done(&pipe_run.morse);
+    } while (flush != Z_FINISH);
+    deflateEnd(&zs);
+    free(buf);
+}
+
+#ifdef HAVE_ZSTD
+static void write_zstd(void)
+{
+    char *buf = pipe_alloc(PIPE_IO);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    struct pipe_block *b;
+    ZSTD_EndDirective end;
+
+    if (!cctx)
+        pipe_fail("initializing zstd", "out of memory");
+    do {
+        ZSTD_inBuffer zin;
+        size_t left;
+
+        b = ring_peek(&pipe_run.morse);
+        zin.src = b ? b->data : NULL;
+        zin.size = b ? b->len : 0;
+        zin.pos = 0;
+        end = b ? ZSTD_e_continue : ZSTD_e_end;
+        do {
+            ZSTD_outBuffer zout = { buf, PIPE_IO, 0 };
+
+            left = ZSTD_compressStream2(cctx, &zout, &zin, end);
+            if (ZSTD_isError(left))
+                pipe_fail("compressing zstd output", ZSTD_getErrorName(left));
+            if (zout.pos)
+                write_all(buf, zout.pos);
+        } while (end == ZSTD_e_end ? left != 0 : zin.pos != zin.size);
+        if (b)
+            ring_done(&pipe_run.morse);
+    } while (end != ZSTD_e_end);
+    ZSTD_freeCCtx(cctx);
+    free(buf);
+}
+#endif
+
+int pipeline_format(const char *name)
+{
+    if (!strcmp(name, "gzip") || !strcmp(name, "gz"))
+        return PIPE_GZIP;
+    if (!strcmp(name, "zstd") || !strcmp(name, "zst"))
+        return PIPE_ZSTD;
+    if (!strcmp(name, "none"))
+        return PIPE_PLAIN;
+    return -1;
+}
+
+// Format of a file from its first bytes, the offset is left at 0.
+static int sniff_format(int fd)
+{
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return PIPE_GZIP;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f
+        && magic[3] == 0xfd)
+        return PIPE_ZSTD;
+    return PIPE_PLAIN;
+}
+
+/*
+ * Same for input that cannot be read twice, the bytes looked at are kept
+ * in lead for the reader.  Stops as soon as they cannot be a magic number
+ * so typing into a terminal is not held up.
+ */
+static int sniff_stream(struct pipe_source *s)
+{
+    static const unsigned char gz[] = { 0x1f, 0x8b }, zst[] = { 0x28, 0xb5, 0x2f, 0xfd };
+    unsigned char *m = s->lead;
+    size_t n = 0;
+
+    while (n < sizeof(s->lead)) {
+        ssize_t r = read(s->fd, m + n, 1);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1) {
+            source_fail(s, "reading input", strerror(errno));
+            break;
+        }
+        if (r == 0)
+            break;
+        n++;
+        if (n == sizeof(gz) && !memcmp(m, gz, n))
+            break;
+        if (memcmp(m, gz, n < sizeof(gz) ? n : sizeof(gz)) && memcmp(m, zst, n))
+            break;
+    }
+    s->nlead = n;
+    if (n == sizeof(gz) && !memcmp(m, gz, n))
+        return PIPE_GZIP;
+    if (n == sizeof(zst) && !memcmp(m, zst, n))
+        return PIPE_ZSTD;
+    return PIPE_PLAIN;
+}
+
+/*
+ * Text of fd in format *fmt, or with PIPE_AUTO decompressed when it
+ * starts with a gzip or zstd magic number and the format found is left
+ * in *fmt.  A stream (a pipe, stdin) is sniffed by reading, a regular
+ * file without moving its offset.
+ */
+struct pipe_source *pipeline_open(int fd, int stream, int *fmt)
+{
+    struct pipe_source *s = calloc(1, sizeof(*s));
+
+    if (!s) {
+        perror("Error allocating pipeline buffer");
+        exit(EXIT_FAILURE);
+    }
+    s->fd = fd;
+    if (*fmt == PIPE_AUTO)
+        *fmt = stream ? sniff_stream(s) : sniff_format(fd);
+    s->fmt = *fmt;
+    if (s->fmt == PIPE_PLAIN)
+        return s;
+    s->in = pipe_alloc(PIPE_IO);
+    if (s->fmt == PIPE_GZIP) {
+        // 32 + 15: gzip or zlib header, largest window
+        if (inflateInit2(&s->zs, 32 + 15) != Z_OK)
+            source_fail(s, "initializing gzip", "out of memory");
+    }
+#ifdef HAVE_ZSTD
+    else if (!(s->dctx = ZSTD_createDCtx()))
+        source_fail(s, "initializing zstd", "out of memory");
+#else
+    else
+        source_fail(s, "with zstd", "this morse was built without zstd support");
+#endif
+    return s;
+}
+
+// Frees the source, the fd stays open.
+void pipeline_close(struct pipe_source *s)
+{
+    if (s->fmt == PIPE_GZIP)
+        inflateEnd(&s->zs);
+#ifdef HAVE_ZSTD
+    if (s->dctx)
+        ZSTD_freeDCtx(s->dctx);
+#endif
+    free(s->in);
+    free(s);
+}
+
+/*
+ * Whether single file mode has to go through the pipeline, opens the
+ * input file to look at it.  -f - is stdin.
+ */
+int pipeline_wanted(struct start_options *options)
+{
+    const char *out = options->output;
+    size_t len = out ? strlen(out) : 0;
+    int stream = 0;
+
+    pipe_run.in_fd = -1;
+    if (options->filename && !options->message) {
+        struct stat st;
+
+        if (!strcmp(options->filename, "-"))
+            pipe_run.in_fd = STDIN_FILENO;
+        else
+            pipe_run.in_fd = open(options->filename, O_RDONLY | O_CLOEXEC);
+        if (pipe_run.in_fd == -1 || fstat(pipe_run.in_fd, &st) == -1) {
+            perror(options->filename);
+            exit(EXIT_FAILURE);
+        }
+        stream = pipe_run.in_fd == STDIN_FILENO || !S_ISREG(st.st_mode);
+        pipe_run.in_fmt = PIPE_AUTO;
+        pipe_run.src = pipeline_open(pipe_run.in_fd, stream, &pipe_run.in_fmt);
+    }
+
+    pipe_run.out_fmt = options->compress;
+    if (pipe_run.out_fmt == PIPE_AUTO) {
+        pipe_run.out_fmt = PIPE_PLAIN;
+        if (len > 3 && !strcmp(out + len - 3, ".gz"))
+            pipe_run.out_fmt = PIPE_GZIP;
+        else if (len > 4 && !strcmp(out + len - 4, ".zst"))
+            pipe_run.out_fmt = PIPE_ZSTD;
+    }
+
+    if (pipe_run.in_fmt == PIPE_PLAIN && pipe_run.out_fmt == PIPE_PLAIN && !out
+        && !stream) {
+        if (pipe_run.in_fd != -1) {
+            pipeline_close(pipe_run.src);
+            close(pipe_run.in_fd);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+void pipeline_run(struct start_options *options)
+{
+    pthread_t reader, convert;
+
+#ifndef HAVE_ZSTD
+    if (pipe_run.in_fmt == PIPE_ZSTD || pipe_run.out_fmt == PIPE_ZSTD)
+        pipe_fail("with zstd", "this morse was built without zstd support");
+#endif
+    pipe_run.options = options;
+    if (options->message)
+        options->length = strlen(options->message);
+    pipe_run.out_fd = STDOUT_FILENO;
+    if (options->output) {
+        pipe_run.out_fd = open(options->output,
+                               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (pipe_run.out_fd == -1) {
+            perror(options->output);
+            exit(EXIT_FAILURE);
+        }
+    }
+    hmorse_init();
+    ring_init(&pipe_run.text, PIPE_HEAD + PIPE_BLOCK);
+    // Encoding a block is the largest output, the last one adds a newline.
+    _Static_assert(MORSE_SEGMENT_BOUND(PIPE_BLOCK) <= MORSE_ENCODE_BOUND(PIPE_HEAD + PIPE_BLOCK),
+                   "segmented decoding must fit a morse block");
+    ring_init(&pipe_run.morse, MORSE_ENCODE_BOUND(PIPE_HEAD + PIPE_BLOCK) + 1);
+
+    if (pthread_create(&reader, NULL, pipe_reader, NULL)
+        || pthread_create(&convert, NULL, pipe_convert, NULL)) {
+        perror("Error creating pipeline threads");
+        exit(EXIT_FAILURE);
+    }
+    if (pipe_run.out_fmt == PIPE_GZIP)
+        write_gzip();
+#ifdef HAVE_ZSTD
+    else if (pipe_run.out_fmt == PIPE_ZSTD)
+        write_zstd();
+#endif
+    else
+        write_plain();
+    pthread_join(reader, NULL);
+    pthread_join(convert, NULL);
+
+    if (pipe_run.in_fd != -1) {
+        pipeline_close(pipe_run.src);
+        close(pipe_run.in_fd);
+    }
+    if (options->output && close(pipe_run.out_fd) == -1) {
+        perror(options->output);
+        exit(EXIT_FAILURE);
+    }
+}
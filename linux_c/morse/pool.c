@@ -0,0 +1,248 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Work stealing thread pool.
+ *
+ * Every worker owns a deque of tasks.  Tasks submitted from outside are
+ * dealt round robin onto the deques, a worker pops from the back of its
+ * own deque (most recently queued, still warm in cache) and when it runs
+ * dry steals from the front of the others.  Each deque has its own lock
+ * so workers only contend when stealing, and a worker only sleeps on the
+ * pool condition when there is nothing left to run anywhere.
+ *
+ * Tasks get the index of the worker running them so they can keep per
+ * worker scratch buffers without any locking.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "morse.h"
+
+struct pool_task {
+    pool_fn fn;
+    void *arg;
+};
+
+struct pool_deque {
+    pthread_mutex_t lock;
+    struct pool_task *tasks;
+    size_t head, tail, size;		// live tasks are [head, tail)
+};
+
+struct pool {
+    int nthreads;
+    pthread_t *threads;
+    struct pool_deque *deques;
+    unsigned next;			// round robin submit position, submitter only
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;		// tasks queued or shutting down
+    pthread_cond_t idle;		// pending dropped to zero
+    atomic_size_t queued;		// tasks sitting in deques
+    atomic_size_t pending;		// tasks queued or running
+    int stop;
+};
+
+struct pool_worker {
+    struct pool *pool;
+    int id;
+};
+
+static int deque_push(struct pool_deque *dq, struct pool_task t)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->size) {
+        size_t live = dq->tail - dq->head;
+        struct pool_task *nt;
+
+        if (dq->head > dq->size / 2) {
+            // Mostly stolen from the front, slide down instead of growing.
+            memmove(dq->tasks, dq->tasks + dq->head, live * sizeof(*nt));
+        } else {
+            size_t size = dq->size ? dq->size * 2 : 64;
+
+            nt = realloc(dq->tasks, size * sizeof(*nt));
+            if (!nt) {
+                pthread_mutex_unlock(&dq->lock);
+                return -1;
+            }
+            dq->tasks = nt;
+            dq->size = size;
+            if (dq->head)
+                memmove(dq->tasks, dq->tasks + dq->head, live * sizeof(*nt));
+        }
+        dq->head = 0;
+        dq->tail = live;
+    }
+    dq->tasks[dq->tail++] = t;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static int deque_pop(struct pool_deque *dq, struct pool_task *t, int steal)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail) {
+        *t = steal ? dq->tasks[dq->head++] : dq->tasks[--dq->tail];
+        if (dq->head == dq->tail)
+            dq->head = dq->tail = 0;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static int pool_take(struct pool *p, int id, struct pool_task *t)
+{
+    if (deque_pop(&p->deques[id], t, 0))
+        return 1;
+    for (int i = 1; i < p->nthreads; i++)
+        if (deque_pop(&p->deques[(id + i) % p->nthreads], t, 1))
+            return 1;
+    return 0;
+}
+
+static void *pool_thread(void *arg)
+{
+    struct pool_worker *w = arg;
+    struct pool *p = w->pool;
+    struct pool_task t;
+
+    for (;;) {
+        if (pool_take(p, w->id, &t)) {
+            atomic_fetch_sub(&p->queued, 1);
+            t.fn(t.arg, w->id);
+            if (atomic_fetch_sub(&p->pending, 1) == 1) {
+                pthread_mutex_lock(&p->lock);
+                pthread_cond_broadcast(&p->idle);
+                pthread_mutex_unlock(&p->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while (!p->queued && !p->stop)
+            pthread_cond_wait(&p->work, &p->lock);
+        if (!p->queued && p->stop) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(w);
+    return NULL;
+}
+
+struct pool *pool_create(int nthreads)
+{
+    struct pool *p;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->nthreads = nthreads;
+    p->threads = calloc(nthreads, sizeof(*p->threads));
+    p->deques = calloc(nthreads, sizeof(*p->deques));
+    if (!p->threads || !p->deques)
+        goto err;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->idle, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        struct pool_worker *w = malloc(sizeof(*w));
+
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+        if (!w)
+            goto err;
+        w->pool = p;
+        w->id = i;
+        if (pthread_create(&p->threads[i], NULL, pool_thread, w)) {
+            free(w);
+            goto err;
+        }
+    }
+    return p;
+
+err:
+    perror("Error creating thread pool");
+    exit(EXIT_FAILURE);
+}
+
+void pool_submit(struct pool *p, pool_fn fn, void *arg)
+{
+    struct pool_task t = { fn, arg };
+    unsigned id = p->next++ % p->nthreads;
+
+    atomic_fetch_add(&p->pending, 1);
+    atomic_fetch_add(&p->queued, 1);
+
+    if (deque_push(&p->deques[id], t)) {
+        perror("Error queueing task");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_wait(struct pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->pending)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(struct pool *p)
+{
+    pool_wait(p);
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->nthreads; i++) {
+        pthread_join(p->threads[i], NULL);
+        pthread_mutex_destroy(&p->deques[i].lock);
+        free(p->deques[i].tasks);
+    }
+    pthread_cond_destroy(&p->idle);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p->deques);
+    free(p->threads);
+    free(p);
+}
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <unistd.h>  
 #include <string.h>
+#include <getopt.h>
 
 #include "morse.h"
 
@@ -42,15 +43,127 @@ void display_help(void)
     printf("Morse may be called with command line options\n\n");
     printf("    -e encode morse code from ascii\n");
     printf("    -d deconde morse code to ascii\n");
-    printf("    -f <file_name> Sets the text file. It could be normal ascii file(encode, with -e) or morse code text file(with -d)  File paths are allowed (expected).\n");
+    printf("    -f <file_name> Sets the text file. It could be normal ascii file(encode, with -e) or morse code text file(with -d)  File paths are allowed (expected), - is stdin.\n");
+    printf("    -F <file> Follow <file> like tail -F, converting data as it is appended (survives rotation and truncation).\n");
     printf("    -s <msg> Sets the input string to be encoded or decode with Morse code. \n");
+    printf("    -a <name> Alphabet for letters outside ASCII, one of %s (default latin).\n",
+           alphabet_names());
+    printf("    --output <file> Single file mode, write to <file> instead of stdout.\n");
+    printf("    --compress <gzip|zstd|none> Compress the output (default from the --output suffix, .gz or .zst).\n");
+    printf("      gzip and zstd input is decompressed on the fly.\n");
+    printf("    -g <chip>:<line>[:low] Decode live keying from a GPIO line, e.g. gpiochip0:17 (with -d).\n");
+    printf("    -w <wpm> Initial speed of timed input, the decoder follows the sender from there (default %d).\n", DEFAULT_WPM);
+    printf("    --farnsworth <wpm> Stretch the gaps between letters and words down to <wpm>.\n");
+    printf("    -c <file> Read only this config file instead of %s and ~/%s.\n",
+           ETC_FILE_PATH_AND_NAME, DOT_FILE_NAME);
+    printf("    -j <n> Worker threads for batch mode (default one per cpu).\n");
+    printf("    -o <dir> Batch mode output directory (default next to each input).\n");
+    printf("    --from-list <file> Batch mode, read the input file names from <file>, one per line (- for stdin).\n");
+    printf("    --io-uring Batch mode I/O through io_uring, falls back to mmap when the kernel has none.\n");
+    printf("    --serve <socket> Run as a daemon answering encode/decode requests on a UNIX socket, -j sets the worker threads (default 1).\n");
+    printf("    --cache <MB> Keep the results of short daemon requests and batch files for repeats, 0 turns it off (default %ld).\n",
+           MORSE_CACHE_DEFAULT >> 20);
+    printf("    --words Encode common words (and the config file's words = {...}) whole instead of letter by letter.\n");
+    printf("    --tune Measure this machine again and show the threads, chunk and I/O path picked by input size.\n");
+    printf("    --no-tune Keep the fixed defaults (one thread per file, every cpu for batches) instead of the calibration.\n");
+    printf("    --validate[=N] With -e or -d, scan -f/-s/the batch inputs for letters with no code, stray bytes and tokens with no letter instead of converting, list the first N offsets (default %d), exit 1 if any.\n", MORSE_VALIDATE_FIRST);
+    printf("    --strict Run the --validate scan first and convert nothing when an input has such letters, bytes or tokens.\n");
+    printf("    --keyer Send what is typed as it is typed (-w, --farnsworth, -g <chip>:<line> to key a GPIO output).\n");
+    printf("    --latency With --keyer, report the keystroke to key down latency at exit.\n");
+    printf("    --udp-send <host>[:port] Send -s/-f, or with --keyer what is typed, to a --udp-listen peer (port %d by default).\n", MORSE_UDP_PORT);
+    printf("    --udp-letters With --udp-send, send each letter's code and let the receiver key it at its own -w.\n");
+    printf("    --udp-listen [<host>:]<port> Key the letters a --udp-send peer sends, print them and drive -g <chip>:<line>.\n");
+    printf("    --jitter <ms> Playout delay of --udp-listen, absorbs network jitter and reordering (default 40).\n");
+    printf("    --generate <file> Key -s/-f into a labelled test corpus, timing lines or .wav audio with labels in <file>.txt (-w, --farnsworth, -j).\n");
+    printf("    --impair <list> Impairments of --generate, e.g. drift=10,fist=15,snr=6,qsb=0.2:80,qrm=900:-10,tone=700,rate=8000.\n");
+    printf("    --seed <n> Random seed of --generate, the same seed gives the same output (default 0).\n");
+    printf("    --timing With -d, -f/-s hold key timings as --generate writes them instead of dots and dashes.\n");
+    printf("    --beam <n> Decode timings (-g, --timing) keeping the <n> best interpretations (default 8 with --lm, at most 64).\n");
+    printf("    --lm <model> Score the interpretations with this language model, implies --beam.\n");
+    printf("    --segment With -d, find the letter gaps missing from the input by letter frequencies (or --lm).\n");
+    printf("    --lm-build <model> Build a language model from the -f/-s text.\n");
+    printf("    --records Every input line is a record converted to one output line, for many short strings in one run.\n");
+    printf("    --verify Encode and decode the -f/-s input or each file in memory and report letters that do not come back (-j sets the threads).\n");
+    printf("    --stats Print byte, letter, chunk timing and flush counters to stderr at exit.\n");
+    printf("    --profile[=<file>] Sample the run, print a flat profile to stderr and write folded stacks to <file> (default morse.folded).\n");
     printf("      -h or -H displays this text.\n\n");
     printf(" \"$ morse -e -f example.txt\"\n");
+    printf(" \"$ morse -e -j 8 a.txt b.txt c.txt\"  writes a.txt.morse b.txt.morse c.txt.morse\n");
     printf("\n\n");
     return;
 }
 
   
+enum {
+    OPT_FROM_LIST = 256,
+    OPT_SERVE,
+    OPT_IO_URING,
+    OPT_FARNSWORTH,
+    OPT_STATS,
+    OPT_VERIFY,
+    OPT_RECORDS,
+    OPT_KEYER,
+    OPT_LATENCY,
+    OPT_UDP_SEND,
+    OPT_UDP_LISTEN,
+    OPT_UDP_LETTERS,
+    OPT_UDP_REORDER,
+    OPT_JITTER,
+    OPT_GENERATE,
+    OPT_IMPAIR,
+    OPT_SEED,
+    OPT_TIMING,
+    OPT_BEAM,
+    OPT_LM,
+    OPT_LM_BUILD,
+    OPT_SEGMENT,
+    OPT_CACHE,
+    OPT_WORDS,
+    OPT_TUNE,
+    OPT_NO_TUNE,
+    OPT_VALIDATE,
+    OPT_STRICT,
+    OPT_PROFILE,
+    OPT_OUTPUT,
+    OPT_COMPRESS,
+};
+
+static const struct option long_options[] = {
+    { "alphabet", required_argument, NULL, 'a' },
+    { "from-list", required_argument, NULL, OPT_FROM_LIST },
+    { "serve", required_argument, NULL, OPT_SERVE },
+    { "io-uring", no_argument, NULL, OPT_IO_URING },
+    { "farnsworth", required_argument, NULL, OPT_FARNSWORTH },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "verify", no_argument, NULL, OPT_VERIFY },
+    { "records", no_argument, NULL, OPT_RECORDS },
+    { "keyer", no_argument, NULL, OPT_KEYER },
+    { "latency", no_argument, NULL, OPT_LATENCY },
+    { "udp-send", required_argument, NULL, OPT_UDP_SEND },
+    { "udp-listen", required_argument, NULL, OPT_UDP_LISTEN },
+    { "udp-letters", no_argument, NULL, OPT_UDP_LETTERS },
+    { "udp-reorder", no_argument, NULL, OPT_UDP_REORDER },
+    { "jitter", required_argument, NULL, OPT_JITTER },
+    { "generate", required_argument, NULL, OPT_GENERATE },
+    { "impair", required_argument, NULL, OPT_IMPAIR },
+    { "seed", required_argument, NULL, OPT_SEED },
+    { "timing", no_argument, NULL, OPT_TIMING },
+    { "beam", required_argument, NULL, OPT_BEAM },
+    { "lm", required_argument, NULL, OPT_LM },
+    { "lm-build", required_argument, NULL, OPT_LM_BUILD },
+    { "segment", no_argument, NULL, OPT_SEGMENT },
+    { "cache", required_argument, NULL, OPT_CACHE },
+    { "words", no_argument, NULL, OPT_WORDS },
+    { "tune", no_argument, NULL, OPT_TUNE },
+    { "no-tune", no_argument, NULL, OPT_NO_TUNE },
+    { "validate", optional_argument, NULL, OPT_VALIDATE },
+    { "strict", no_argument, NULL, OPT_STRICT },
+    { "profile", optional_argument, NULL, OPT_PROFILE },
+    { "output", required_argument, NULL, OPT_OUTPUT },
+    { "compress", required_argument, NULL, OPT_COMPRESS },
+    { NULL, 0, NULL, 0 }
+};
+
 void process_command_line(int argc, char *argv[], struct start_options *options)
 {
     int opt;
@@ -58,7 +171,8 @@ void process_command_line(int argc, char *argv[], struct start_options *options)
     // put ':' in the starting of the 
     // string so that program can  
     //distinguish between '?' and ':'  
-    while((opt = getopt(argc, argv, ":def:hHs:")) != -1)  
+    while((opt = getopt_long(argc, argv, ":a:c:deF:f:g:hHj:o:s:w:",
+                             long_options, NULL)) != -1)  
     {  
         switch(opt)  
         {  
@@ -79,6 +193,154 @@ void process_command_line(int argc, char *argv[], struct start_options *options)
             case 's':
                 options->message = optarg;
                 break;
+            case 'a':
+                morse_alphabet = alphabet_find(optarg);
+                if (!morse_alphabet) {
+                    printf("unknown alphabet: %s, use one of %s\n", optarg,
+                           alphabet_names());
+                    exit(-1);
+                }
+                break;
+            case 'c':
+                options->config_file = optarg;
+                break;
+            case 'F':
+                options->follow = optarg;
+                break;
+            case 'g':
+                options->gpio_spec = optarg;
+                break;
+            case 'w':
+                options->wpm = atoi(optarg);
+                if (options->wpm == 0) {
+                    printf("invalid speed: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'j':
+                options->jobs = atoi(optarg);
+                if (options->jobs <= 0) {
+                    printf("invalid thread count: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'o':
+                options->outdir = optarg;
+                break;
+            case OPT_FROM_LIST:
+                options->from_list = optarg;
+                break;
+            case OPT_FARNSWORTH:
+                options->farnsworth = atoi(optarg);
+                if (options->farnsworth == 0) {
+                    printf("invalid speed: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_STATS:
+                options->stats = 1;
+                break;
+            case OPT_KEYER:
+                options->keyer = 1;
+                break;
+            case OPT_LATENCY:
+                options->latency = 1;
+                break;
+            case OPT_UDP_SEND:
+                options->udp_send = optarg;
+                break;
+            case OPT_UDP_LISTEN:
+                options->udp_listen = optarg;
+                break;
+            case OPT_UDP_LETTERS:
+                options->udp_letters = 1;
+                break;
+            case OPT_UDP_REORDER:
+                options->udp_reorder = 1;
+                break;
+            case OPT_JITTER:
+                options->jitter = atoi(optarg);
+                if (options->jitter == 0) {
+                    printf("invalid playout delay: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_GENERATE:
+                options->generate = optarg;
+                break;
+            case OPT_IMPAIR:
+                options->impair = optarg;
+                break;
+            case OPT_SEED:
+                options->seed = strtoull(optarg, NULL, 0);
+                break;
+            case OPT_TIMING:
+                options->timing = 1;
+                break;
+            case OPT_BEAM:
+                options->beam = atoi(optarg);
+                if (options->beam == 0) {
+                    printf("invalid beam width: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_LM:
+                options->lm = optarg;
+                break;
+            case OPT_LM_BUILD:
+                options->lm_build = optarg;
+                break;
+            case OPT_SEGMENT:
+                options->segment = 1;
+                break;
+            case OPT_CACHE:
+                options->cache = atol(optarg) << 20;
+                if (options->cache <= 0)
+                    options->cache = -1;
+                break;
+            case OPT_WORDS:
+                options->words = 1;
+                break;
+            case OPT_TUNE:
+                options->tune = 1;
+                break;
+            case OPT_NO_TUNE:
+                options->tune = -1;
+                break;
+            case OPT_VALIDATE:
+                options->validate = optarg ? strtoul(optarg, NULL, 10)
+                                           : MORSE_VALIDATE_FIRST;
+                if (!options->validate)
+                    options->validate = MORSE_VALIDATE_FIRST;
+                break;
+            case OPT_STRICT:
+                options->strict = 1;
+                break;
+            case OPT_RECORDS:
+                options->records = 1;
+                break;
+            case OPT_VERIFY:
+                options->verify = 1;
+                break;
+            case OPT_PROFILE:
+                options->profile = optarg ? optarg : "morse.folded";
+                break;
+            case OPT_OUTPUT:
+                options->output = optarg;
+                break;
+            case OPT_COMPRESS:
+                options->compress = pipeline_format(optarg);
+                if (options->compress == -1) {
+                    printf("unknown compression: %s, use gzip, zstd or none\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_IO_URING:
+                options->io_uring = 1;
+                break;
+            case OPT_SERVE:
+                options->serve_path = optarg;
+                break;
             case ':':  
                 printf("option needs a value\n");
                 display_help();
@@ -93,19 +355,56 @@ void process_command_line(int argc, char *argv[], struct start_options *options)
     }  
 
     // optind is for the extra arguments 
-    // which are not parsed 
-    for(; optind < argc; optind++){
-        options->filename = argv[optind];
-        printf("extra arguments: %s\n", options->filename);  
+    // which are not parsed, they are all input files.
+    options->files = &argv[optind];
+    options->nfiles = argc - optind;
+    if (options->filename && options->nfiles) {
+        char **files = malloc((options->nfiles + 1) * sizeof(char *));
+
+        if (!files) {
+            perror("Error allocating file list");
+            exit(EXIT_FAILURE);
+        }
+        files[0] = options->filename;
+        memcpy(files + 1, options->files, options->nfiles * sizeof(char *));
+        options->files = files;
+        options->nfiles++;
     }
 
+    // A single input without any batch option keeps the classic mode.
+    if (options->nfiles == 1 && !options->from_list && !options->jobs
+        && !options->outdir && !options->io_uring) {
+        options->filename = options->files[0];
+        options->nfiles = 0;
+    }
+
+    // Settings the command line left open come from the config files.
+    process_config_file(options);
+    if (options->words && options->mode != MORS_DECO)
+        morse_words_init(options->extra_words, options->nextra_words);
+
     /* 
      * Some final checks, file name must be set or it's an error, 
      * Farnsworth timing only used below 18 WPM
      */
+    if (options->farnsworth && options->farnsworth
+        >= (options->wpm ? options->wpm : DEFAULT_WPM))
+        options->farnsworth = 0;
+
+    if (options->serve_path || options->keyer || options->udp_listen
+        || options->tune > 0)
+        return;
+
     if ((options->filename == NULL 
-        && options->message == NULL)
-        || options->mode == MORS_NONE){
+        && options->message == NULL
+        && options->gpio_spec == NULL
+        && options->follow == NULL
+        && options->nfiles == 0
+        && options->from_list == NULL)
+        || (options->mode == MORS_NONE && !options->verify && !options->udp_send
+            && !options->generate && !options->lm_build)
+        || ((options->timing || options->segment) && options->mode != MORS_DECO)
+        || (options->gpio_spec && options->mode != MORS_DECO)){
         display_help();
         exit(-1);
     }      
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -53,8 +54,10 @@ void close_text_file(struct start_options options)
 
 void open_text_file(struct start_options *options)
 {    
-    if (options->message)
+    if (options->message) {
+        options->length = strlen(options->message);
         return;
+    }
 
     options->fd = open(options->filename, O_RDONLY, (mode_t)0600);
     
@@ -83,7 +86,7 @@ void open_text_file(struct start_options *options)
         perror("Error mmapping the file");
         exit(EXIT_FAILURE);
     }
-    pr_dbg("message %s\n", options->message);
+    options->length = options->fileInfo.st_size;
     return;
 }
 
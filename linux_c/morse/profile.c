@@ -0,0 +1,499 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Built in sampling profiler, --profile[=<file>].
+ *
+ * A CPU clock event is opened on every cpu for this process with inherit
+ * set, so every thread started afterwards (pool workers, daemon workers,
+ * io_uring threads) is sampled too.  Each sample carries the user space
+ * call chain, walked by the kernel over frame pointers (the Makefile
+ * keeps them).  A reader thread, started before the events so it is not
+ * sampled itself, drains the ring buffers into a table of distinct call
+ * chains.
+ *
+ * At exit the chains are symbolized against the symbol table of our own
+ * executable (static functions included, no -rdynamic needed) and with
+ * dladdr() for shared libraries.  A flat profile goes to stderr and the
+ * folded stacks ("main;batch_run;...;morse_encode_buf 42") to <file>,
+ * ready for flamegraph.pl.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "morse.h"
+
+#define PROFILE_HZ 999
+#define PROFILE_PAGES 64		// ring buffer data pages per cpu
+#define PROFILE_DEPTH 64		// frames kept per sample
+#define PROFILE_BUCKETS 4096
+#define PROFILE_TOP 25
+
+struct prof_stack {
+    struct prof_stack *next;
+    uint64_t hash;
+    uint64_t count;
+    int nr;
+    uint64_t ip[];			// leaf first, as the kernel hands them out
+};
+
+struct prof_ring {
+    int fd;
+    struct perf_event_mmap_page *meta;
+    char *data;
+    size_t size;
+};
+
+struct prof_sym {
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+};
+
+struct prof_func {
+    struct prof_func *next;
+    const char *name;
+    uint64_t self, total;
+    size_t stamp;			// last stack counted in total
+};
+
+static struct {
+    struct prof_ring *rings;
+    int nrings;
+    struct prof_stack *stacks[PROFILE_BUCKETS];
+    uint64_t samples, lost;
+    pthread_t reader;
+    pthread_barrier_t ready;
+    volatile int stop;
+    const char *path;
+    // symbols of our own executable
+    struct prof_sym *syms;
+    size_t nsyms;
+    uintptr_t bias;
+} prof;
+
+static uint64_t chain_hash(const uint64_t *ip, int nr)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < nr; i++)
+        h = (h ^ ip[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static void prof_add(const uint64_t *ip, uint64_t nr)
+{
+    uint64_t kept[PROFILE_DEPTH];
+    struct prof_stack *s, **b;
+    uint64_t h;
+    int n = 0;
+
+    // Drop the context markers the kernel puts into the chain.
+    for (uint64_t i = 0; i < nr && n < PROFILE_DEPTH; i++)
+        if (ip[i] < PERF_CONTEXT_MAX)
+            kept[n++] = ip[i];
+    if (!n)
+        return;
+
+    h = chain_hash(kept, n);
+    b = &prof.stacks[h % PROFILE_BUCKETS];
+    for (s = *b; s; s = s->next)
+        if (s->hash == h && s->nr == n && !memcmp(s->ip, kept, n * sizeof(*kept))) {
+            s->count++;
+            return;
+        }
+    s = malloc(sizeof(*s) + n * sizeof(*kept));
+    if (!s)
+        return;
+    s->hash = h;
+    s->count = 1;
+    s->nr = n;
+    memcpy(s->ip, kept, n * sizeof(*kept));
+    s->next = *b;
+    *b = s;
+}
+
+// Handle every complete record in one ring, records may wrap at the end.
+static void prof_drain(struct prof_ring *r)
+{
+    uint64_t head = __atomic_load_n(&r->meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->meta->data_tail;
+    static char rec[sizeof(struct perf_event_header) + 16
+                    + 8 * (PERF_MAX_STACK_DEPTH + 16)];
+
+    while (tail < head) {
+        struct perf_event_header *hdr = (void *)(r->data + (tail & (r->size - 1)));
+        size_t off = tail & (r->size - 1);
+
+        if (off + sizeof(*hdr) > r->size || off + hdr->size > r->size) {
+            // Straddles the end of the ring, copy it out in two pieces.
+            struct perf_event_header h;
+            size_t first;
+
+            first = r->size - off < sizeof(h) ? r->size - off : sizeof(h);
+            memcpy(&h, r->data + off, first);
+            memcpy((char *)&h + first, r->data, sizeof(h) - first);
+            if (h.size > sizeof(rec))
+                goto skip_wrapped;
+            first = r->size - off;
+            memcpy(rec, r->data + off, first);
+            memcpy(rec + first, r->data, h.size - first);
+            hdr = (void *)rec;
+        }
+
+        if (hdr->type == PERF_RECORD_SAMPLE) {
+            // sample_type is TID | CALLCHAIN: pid, tid, nr, ips[nr]
+            const uint64_t *p = (const uint64_t *)(hdr + 1) + 1;
+
+            prof_add(p + 1, p[0]);
+            prof.samples++;
+        } else if (hdr->type == PERF_RECORD_LOST)
+            prof.lost += ((const uint64_t *)(hdr + 1))[1];
+        tail += hdr->size;
+        continue;
+
+skip_wrapped:
+        tail = head;
+    }
+    __atomic_store_n(&r->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void *prof_reader(void *arg)
+{
+    struct pollfd *fds = calloc(prof.nrings, sizeof(*fds));
+
+    (void)arg;
+    pthread_barrier_wait(&prof.ready);
+    if (!fds)
+        return NULL;
+    for (int i = 0; i < prof.nrings; i++) {
+        fds[i].fd = prof.rings[i].fd;
+        fds[i].events = POLLIN;
+    }
+    while (!prof.stop) {
+        poll(fds, prof.nrings, 100);
+        for (int i = 0; i < prof.nrings; i++)
+            prof_drain(&prof.rings[i]);
+    }
+    free(fds);
+    return NULL;
+}
+
+static int cmp_sym(const void *a, const void *b)
+{
+    const struct prof_sym *x = a, *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int find_bias(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    (void)size;
+    *(uintptr_t *)arg = info->dlpi_addr;
+    return 1;				// the first object is the executable
+}
+
+// Function symbols of /proc/self/exe, the mapping is kept for the names.
+static void prof_load_syms(void)
+{
+    const Elf64_Ehdr *eh;
+    const Elf64_Shdr *sh;
+    struct stat st;
+    char *map;
+    int fd;
+
+    dl_iterate_phdr(find_bias, &prof.bias);
+    fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    eh = (const Elf64_Ehdr *)map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS64)
+        return;
+    sh = (const Elf64_Shdr *)(map + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++) {
+        const Elf64_Sym *sym;
+        const char *str;
+        size_t n;
+
+        if (sh[i].sh_type != SHT_SYMTAB)
+            continue;
+        sym = (const Elf64_Sym *)(map + sh[i].sh_offset);
+        str = map + sh[sh[i].sh_link].sh_offset;
+        n = sh[i].sh_size / sizeof(*sym);
+        prof.syms = malloc(n * sizeof(*prof.syms));
+        if (!prof.syms)
+            return;
+        for (size_t k = 0; k < n; k++)
+            if (ELF64_ST_TYPE(sym[k].st_info) == STT_FUNC && sym[k].st_value) {
+                prof.syms[prof.nsyms].addr = sym[k].st_value;
+                prof.syms[prof.nsyms].size = sym[k].st_size;
+                prof.syms[prof.nsyms].name = str + sym[k].st_name;
+                prof.nsyms++;
+            }
+        qsort(prof.syms, prof.nsyms, sizeof(*prof.syms), cmp_sym);
+        return;
+    }
+}
+
+// "[libc.so.6]" for addresses in an object without a symbol for them.
+static const char *prof_object(const char *path)
+{
+    static struct {
+        const char *path;
+        char *name;
+    } seen[16];
+    const char *base = strrchr(path, '/');
+    size_t i;
+
+    for (i = 0; i < 16 && seen[i].path; i++)
+        if (seen[i].path == path)
+            return seen[i].name;
+    if (i == 16 || !(seen[i].name = malloc(strlen(path) + 3)))
+        return "[unknown]";
+    seen[i].path = path;
+    sprintf(seen[i].name, "[%s]", base ? base + 1 : path);
+    return seen[i].name;
+}
+
+static const char *prof_symbol(uint64_t ip)
+{
+    uintptr_t a = ip - prof.bias;
+    size_t lo = 0, hi = prof.nsyms;
+    Dl_info info;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (prof.syms[mid].addr <= a)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && a < prof.syms[lo - 1].addr + (prof.syms[lo - 1].size ? prof.syms[lo - 1].size : 1))
+        return prof.syms[lo - 1].name;
+    if (dladdr((void *)ip, &info)) {
+        if (info.dli_sname)
+            return info.dli_sname;
+        if (info.dli_fname)
+            return prof_object(info.dli_fname);
+    }
+    return "[unknown]";
+}
+
+static struct prof_func *prof_func(struct prof_func **table, const char *name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    struct prof_func *f;
+
+    for (const char *p = name; *p; p++)
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    for (f = table[h % PROFILE_BUCKETS]; f; f = f->next)
+        if (!strcmp(f->name, name))
+            return f;
+    f = calloc(1, sizeof(*f));
+    if (!f) {
+        perror("Error allocating profile");
+        exit(EXIT_FAILURE);
+    }
+    f->name = name;
+    f->stamp = (size_t)-1;
+    f->next = table[h % PROFILE_BUCKETS];
+    table[h % PROFILE_BUCKETS] = f;
+    return f;
+}
+
+static int cmp_self(const void *a, const void *b)
+{
+    const struct prof_func *x = *(struct prof_func **)a, *y = *(struct prof_func **)b;
+
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    return (x->total < y->total) - (x->total > y->total);
+}
+
+static void prof_report(void)
+{
+    static struct prof_func *table[PROFILE_BUCKETS];
+    struct prof_func **all;
+    const char *names[PROFILE_DEPTH];
+    size_t id = 0, nfuncs = 0;
+    FILE *out;
+
+    prof_load_syms();
+    out = fopen(prof.path, "w");
+    if (!out)
+        perror(prof.path);
+
+    for (int b = 0; b < PROFILE_BUCKETS; b++)
+        for (struct prof_stack *s = prof.stacks[b]; s; s = s->next, id++) {
+            // Return addresses point past the call, look up the call itself.
+            for (int i = 0; i < s->nr; i++)
+                names[i] = prof_symbol(i ? s->ip[i] - 1 : s->ip[i]);
+
+            prof_func(table, names[0])->self += s->count;
+            for (int i = 0; i < s->nr; i++) {
+                struct prof_func *f = prof_func(table, names[i]);
+
+                if (f->stamp != id) {
+                    f->stamp = id;
+                    f->total += s->count;
+                }
+            }
+            if (out) {
+                for (int i = s->nr - 1; i >= 0; i--)
+                    fprintf(out, "%s%c", names[i], i ? ';' : ' ');
+                fprintf(out, "%llu\n", (unsigned long long)s->count);
+            }
+        }
+    if (out)
+        fclose(out);
+
+    for (int b = 0; b < PROFILE_BUCKETS; b++)
+        for (struct prof_func *f = table[b]; f; f = f->next)
+            nfuncs++;
+    all = malloc((nfuncs ? nfuncs : 1) * sizeof(*all));
+    if (!all)
+        return;
+    nfuncs = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++)
+        for (struct prof_func *f = table[b]; f; f = f->next)
+            all[nfuncs++] = f;
+    qsort(all, nfuncs, sizeof(*all), cmp_self);
+
+    fprintf(stderr, "profile: %llu samples at %d Hz, %llu lost, folded stacks in %s\n",
+            (unsigned long long)prof.samples, PROFILE_HZ,
+            (unsigned long long)prof.lost, prof.path);
+    fprintf(stderr, "  self%%  total%%  samples  function\n");
+    for (size_t i = 0; i < nfuncs && i < PROFILE_TOP; i++)
+        fprintf(stderr, "%6.2f  %6.2f  %7llu  %s\n",
+                prof.samples ? 100.0 * all[i]->self / prof.samples : 0.0,
+                prof.samples ? 100.0 * all[i]->total / prof.samples : 0.0,
+                (unsigned long long)all[i]->self, all[i]->name);
+    free(all);
+}
+
+static void prof_stop(void)
+{
+    for (int i = 0; i < prof.nrings; i++)
+        ioctl(prof.rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+    prof.stop = 1;
+    pthread_join(prof.reader, NULL);
+    for (int i = 0; i < prof.nrings; i++)
+        prof_drain(&prof.rings[i]);
+    prof_report();
+}
+
+void profile_start(const char *path)
+{
+    struct perf_event_attr attr;
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    size_t size = PROFILE_PAGES * sysconf(_SC_PAGESIZE);
+
+    prof.path = path;
+    prof.rings = calloc(ncpu, sizeof(*prof.rings));
+    if (!prof.rings) {
+        perror("Error allocating profile");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Start the reader before opening the events so it does not inherit
+     * them, it waits for the rings to be set up.
+     */
+    pthread_barrier_init(&prof.ready, NULL, 2);
+    if (pthread_create(&prof.reader, NULL, prof_reader, NULL)) {
+        perror("Error creating profile reader");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = PROFILE_HZ;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.inherit = 1;
+    attr.disabled = 1;
+    attr.wakeup_events = 64;
+
+    for (long cpu = 0; cpu < ncpu; cpu++) {
+        struct prof_ring *r = &prof.rings[prof.nrings];
+        void *m;
+
+        r->fd = syscall(SYS_perf_event_open, &attr, 0, (int)cpu, -1,
+                        PERF_FLAG_FD_CLOEXEC);
+        if (r->fd == -1) {
+            if (errno == ENODEV || errno == EINVAL)
+                continue;		// cpu not present
+            perror("Error opening profile event, see /proc/sys/kernel/perf_event_paranoid");
+            exit(EXIT_FAILURE);
+        }
+        m = mmap(NULL, size + sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, r->fd, 0);
+        if (m == MAP_FAILED) {
+            perror("Error mapping profile buffer");
+            exit(EXIT_FAILURE);
+        }
+        r->meta = m;
+        r->data = (char *)m + sysconf(_SC_PAGESIZE);
+        r->size = size;
+        prof.nrings++;
+    }
+    if (!prof.nrings) {
+        fprintf(stderr, "Error: no cpu to profile on\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&prof.ready);
+    atexit(prof_stop);
+    for (int i = 0; i < prof.nrings; i++)
+        ioctl(prof.rings[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+}
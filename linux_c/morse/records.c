@@ -0,0 +1,220 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Records mode, morse -e|-d --records -f <file>|-f -|-s <msg>
+ *
+ * Every line of the input is one record, every record gives one line of
+ * output, empty lines included, so line n of the output always belongs to
+ * line n of the input.  A trailing \r is dropped.
+ *
+ * Lines are gathered into batches of up to RECORDS_BATCH records or
+ * RECORDS_BYTES bytes and converted with one morse_encode_many() or
+ * morse_decode_many() call, so a record costs a few nanoseconds instead
+ * of a process or a request.  The batch buffers come from an arena that
+ * is reset for every batch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+#define RECORDS_BATCH 65536
+#define RECORDS_BYTES (1 << 20)
+#define RECORDS_READ 65536
+
+struct records {
+    int mode;
+    struct arena arena;			// per batch buffers
+    const char **rec;
+    size_t *len;
+    size_t *out_off;
+};
+
+static void records_write(const char *buf, size_t len)
+{
+    morse_stats_flush(len);
+    while (len) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error writing output");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Convert the complete lines of buf, returns the bytes used.  With last
+ * set the end of buf also ends a line.
+ */
+static size_t records_batch(struct records *r, const char *buf, size_t len,
+                            int last)
+{
+    size_t n = 0, total = 0, off = 0, bound, done;
+    uint64_t start;
+    char *out, *lines, *p;
+
+    while (off < len && n < RECORDS_BATCH && total < RECORDS_BYTES) {
+        const char *nl = memchr(buf + off, '\n', len - off);
+        size_t end = nl ? (size_t)(nl - buf) : len;
+
+        if (!nl && !last)
+            break;
+        r->rec[n] = buf + off;
+        r->len[n] = end - off;
+        if (r->len[n] && buf[end - 1] == '\r')
+            r->len[n]--;
+        total += r->len[n++];
+        off = nl ? end + 1 : len;
+    }
+    if (!n)
+        return 0;
+
+    start = morse_stats_chunk_start();
+    arena_reset(&r->arena);
+    if (r->mode == MORS_ENCO) {
+        out = arena_alloc(&r->arena, MORSE_ENCODE_MANY_BOUND(total, n));
+        done = morse_encode_many(r->rec, r->len, n, out, r->out_off);
+    } else {
+        out = arena_alloc(&r->arena, MORSE_DECODE_MANY_BOUND(total, n));
+        done = morse_decode_many(r->rec, r->len, n, out, r->out_off);
+    }
+
+    // One line per record.
+    bound = done + n;
+    p = lines = arena_alloc(&r->arena, bound);
+    for (size_t i = 0; i < n; i++) {
+        size_t k = r->out_off[i + 1] - r->out_off[i];
+
+        memcpy(p, out + r->out_off[i], k);
+        p += k;
+        *p++ = '\n';
+    }
+    morse_stats_chunk_end(start);
+    records_write(lines, p - lines);
+    return off;
+}
+
+// Input that cannot be mapped, read in pieces and keep the cut line.
+static void records_stream(struct records *r, int fd)
+{
+    size_t size = RECORDS_READ * 2, have = 0, used;
+    char *buf = malloc(size);
+    ssize_t n;
+
+    if (!buf) {
+        perror("Error allocating records buffer");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        if (size - have < RECORDS_READ) {
+            size *= 2;
+            buf = realloc(buf, size);
+            if (!buf) {
+                perror("Error allocating records buffer");
+                exit(EXIT_FAILURE);
+            }
+        }
+        n = read(fd, buf + have, size - have);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror("Error reading input");
+            exit(EXIT_FAILURE);
+        }
+        have += n;
+        while ((used = records_batch(r, buf, have, n == 0))) {
+            memmove(buf, buf + used, have - used);
+            have -= used;
+        }
+        if (n == 0)
+            break;
+    }
+    free(buf);
+}
+
+void records_run(struct start_options *options)
+{
+    static struct records r;
+    struct stat st;
+    char *map;
+    int fd;
+
+    r.mode = options->mode;
+    r.rec = malloc(RECORDS_BATCH * sizeof(*r.rec));
+    r.len = malloc(RECORDS_BATCH * sizeof(*r.len));
+    r.out_off = malloc((RECORDS_BATCH + 1) * sizeof(*r.out_off));
+    if (!r.rec || !r.len || !r.out_off) {
+        perror("Error allocating records buffers");
+        exit(EXIT_FAILURE);
+    }
+    hmorse_init();
+
+    if (options->message) {
+        size_t len = strlen(options->message), off = 0;
+
+        while (off < len)
+            off += records_batch(&r, options->message + off, len - off, 1);
+        goto out;
+    }
+
+    fd = strcmp(options->filename, "-")
+       ? open(options->filename, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(options->filename);
+        exit(EXIT_FAILURE);
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        records_stream(&r, fd);
+    } else {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror(options->filename);
+            exit(EXIT_FAILURE);
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        for (size_t off = 0; off < (size_t)st.st_size;)
+            off += records_batch(&r, map + off, st.st_size - off, 1);
+        munmap(map, st.st_size);
+    }
+    close(fd);
+
+out:
+    arena_free(&r.arena);
+    free(r.rec);
+    free(r.len);
+    free(r.out_off);
+}
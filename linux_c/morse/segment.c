@@ -0,0 +1,372 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Segmenting decoder, morse -d --segment [--lm <model>] -f <file>|-s <msg>
+ *
+ * For morse whose letter gaps are missing or unreliable.  A run of dots
+ * and dashes between two word gaps is cut into the letters that explain
+ * it best, a shortest path over the symbols: every letter costs what the
+ * letter frequencies (or the single letter costs of --lm) say it is
+ * worth in bits, a letter boundary where the input has no space costs
+ * SEG_SPLIT bits and a space inside a letter SEG_JOIN bits.  SEG_SPLIT
+ * is more than all but the rarest letters cost, so input with all its
+ * letter gaps in place decodes as morse_decode_buf() decodes it.
+ *
+ * Only the last MORSE_SEGMENT_WINDOW positions are kept.  Every
+ * SEG_CHECK symbols the best paths to the positions a letter can still
+ * start from are traced back, where they all meet the text before is
+ * settled and written out.  Should they not meet within the window the
+ * best of them is taken, so time is linear and memory fixed however long
+ * the run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "morse.h"
+
+#define SEG_WINDOW MORSE_SEGMENT_WINDOW
+#define SEG_MASK (SEG_WINDOW - 1)
+#define SEG_CODES (2 << MORSE_TOKEN_MAX)	// heap index, 1 is the root
+#define SEG_CHECK 64			// symbols between looks for a meeting
+#define SEG_SPLIT 8.0			// bits, a letter boundary without a space
+#define SEG_JOIN 16.0			// bits, a space inside a letter
+#define SEG_BAD_CODE 24.0		// bits, a symbol no letter explains
+#define SEG_RARE 12.0			// bits, a letter not in seg_english[]
+#define SEG_OUT 4			// bytes of output per symbol at most
+
+_Static_assert((SEG_WINDOW & SEG_MASK) == 0, "window must be a power of two");
+
+enum { SEG_DOT, SEG_DASH, SEG_OTHER };
+
+struct seg_letter {
+    float cost;				// bits
+    uint8_t len;			// bytes of out, 0 for no letter
+    char out[3 * SEG_OUT];
+};
+
+// Position p is after the p-th symbol of the run.
+struct seg_pos {
+    double cost;			// of the best path to here
+    uint16_t code;			// its last letter, 0 a bad symbol
+    uint8_t nsym;			// symbols of that letter
+    uint8_t sym;			// the symbol ending here, SEG_*
+    uint8_t space;			// a letter gap in the input here
+    uint8_t hits;			// paths through here, seg_meet()
+    uint32_t stamp;			// of the seg_meet() hits counts
+};
+
+struct morse_segmenter {
+    struct seg_letter letters[SEG_CODES];
+    unsigned maxsym;			// longest code with a letter
+    struct seg_pos pos[SEG_WINDOW];
+    uint64_t base, head;		// settled and last position of the run
+    uint64_t checked;			// head at the last seg_meet()
+    uint32_t stamp;
+    size_t gap;				// separators since the last symbol
+    int started;
+    uint32_t path[SEG_WINDOW];		// seg_emit() scratch
+};
+
+// Letter frequencies of English text, percent.
+static const double seg_english[26] = {
+    8.2, 1.5, 2.8, 4.3, 12.7, 2.2, 2.0, 6.1, 7.0, 0.15, 0.77, 4.0, 2.4,
+    6.7, 7.5, 1.9, 0.095, 6.0, 6.3, 9.1, 2.8, 0.98, 2.4, 0.15, 2.0, 0.074,
+};
+
+static double seg_cost(const struct morse_lm *lm, const char *out, size_t len)
+{
+    uint32_t cp = (unsigned char)out[0];
+
+    if (len > 1 && out[0] == '<')
+        return SEG_RARE;		// prosign
+    if (len > 1)
+        utf8_decode((const unsigned char *)out, len, &cp);
+    if (lm)
+        return lm_letter_cost(lm, cp < 0x80 ? (char)cp : (char)(0xc0 | cp >> 6));
+    if (cp >= 'A' && cp <= 'Z')
+        return -log2(seg_english[cp - 'A'] / 100);
+    return SEG_RARE;
+}
+
+struct morse_segmenter *segment_create(struct start_options *options)
+{
+    static struct morse_lm lm;
+    struct morse_segmenter *s = calloc(1, sizeof(*s));
+    char code[MORSE_TOKEN_MAX + 1], out[MORSE_TOKEN_MAX + 3 * SEG_OUT];
+
+    if (!s) {
+        perror("Error allocating segment decoder");
+        exit(EXIT_FAILURE);
+    }
+    if (options->lm && !lm.map)
+        lm_open(&lm, options->lm);
+
+    // Every code up to the longest prosign, dot 0 and dash 1.
+    for (unsigned n = 1; n <= MORSE_TOKEN_MAX; n++)
+        for (unsigned bits = 0; bits < 1U << n; bits++) {
+            struct seg_letter *l = &s->letters[1U << n | bits];
+            size_t len;
+
+            for (unsigned i = 0; i < n; i++)
+                code[i] = bits >> (n - 1 - i) & 1 ? '-' : '.';
+            code[n] = '\0';
+            len = morse_token_letter(code, out);
+            if (!len || len > SEG_OUT * n || len > sizeof(l->out))
+                continue;
+            memcpy(l->out, out, len);
+            l->len = len;
+            l->cost = seg_cost(options->lm ? &lm : NULL, out, len);
+            if (n > s->maxsym)
+                s->maxsym = n;
+        }
+    return s;
+}
+
+void segment_destroy(struct morse_segmenter *s)
+{
+    free(s);
+}
+
+static inline struct seg_pos *seg_at(struct morse_segmenter *s, uint64_t p)
+{
+    return &s->pos[p & SEG_MASK];
+}
+
+/*
+ * Best path to position h from the positions back to s->base, the
+ * symbols of the letter ending at h are h - nsym + 1 .. h.
+ */
+static void seg_relax(struct morse_segmenter *s, uint64_t h)
+{
+    struct seg_pos *ph = seg_at(s, h);
+    unsigned bits = 0, spaces = 0;
+
+    // A symbol no letter has is a letter of its own, it decodes to a space.
+    ph->cost = seg_at(s, h - 1)->cost + SEG_BAD_CODE;
+    ph->code = 0;
+    ph->nsym = 1;
+
+    for (unsigned n = 1; n <= s->maxsym && n <= h - s->base; n++) {
+        struct seg_pos *q = seg_at(s, h - n + 1), *from = seg_at(s, h - n);
+        const struct seg_letter *l;
+        double cost;
+
+        if (q->sym == SEG_OTHER)
+            break;
+        bits |= (unsigned)(q->sym == SEG_DASH) << (n - 1);
+        if (n > 1)
+            spaces += q->space;
+        l = &s->letters[1U << n | bits];
+        if (!l->len)
+            continue;
+        cost = from->cost + l->cost + spaces * SEG_JOIN
+             + (h - n > 0 && !from->space ? SEG_SPLIT : 0);
+        if (cost < ph->cost) {
+            ph->cost = cost;
+            ph->code = 1U << n | bits;
+            ph->nsym = n;
+        }
+    }
+}
+
+// Write the letters of the best path from s->base to p, p becomes the base.
+static size_t seg_emit(struct morse_segmenter *s, uint64_t p, char *out)
+{
+    struct morse_stats *st = morse_stats_get();
+    size_t n = 0, k = 0;
+
+    for (uint64_t q = p; q > s->base; q -= seg_at(s, q)->nsym)
+        s->path[k++] = q & SEG_MASK;
+    while (k--) {
+        const struct seg_pos *q = &s->pos[s->path[k]];
+
+        st->letters++;
+        if (!q->code) {
+            out[n++] = ' ';
+            st->unknown++;
+            continue;
+        }
+        memcpy(out + n, s->letters[q->code].out, s->letters[q->code].len);
+        n += s->letters[q->code].len;
+    }
+    s->base = p;
+    return n;
+}
+
+/*
+ * Settle what the best paths to every position a letter can still start
+ * from agree on, returns the bytes written.
+ */
+static size_t seg_meet(struct morse_segmenter *s, char *out)
+{
+    uint64_t first = s->head >= s->base + s->maxsym
+                   ? s->head - s->maxsym + 1 : s->base + 1;
+    unsigned paths = 0;
+
+    s->checked = s->head;
+    if (++s->stamp == 0)
+        s->stamp = 1;
+    for (uint64_t e = first; e <= s->head; e++, paths++)
+        for (uint64_t q = e; q > s->base; q -= seg_at(s, q)->nsym) {
+            struct seg_pos *pq = seg_at(s, q);
+
+            if (pq->stamp != s->stamp) {
+                pq->stamp = s->stamp;
+                pq->hits = 0;
+            }
+            pq->hits++;
+        }
+    for (uint64_t q = first; q > s->base; q--) {
+        struct seg_pos *pq = seg_at(s, q);
+
+        if (pq->stamp == s->stamp && pq->hits == paths)
+            return seg_emit(s, q, out);
+    }
+    return 0;
+}
+
+/*
+ * No meeting within the window, settle half of it along the best path
+ * and find the best paths after that again.
+ */
+static size_t seg_force(struct morse_segmenter *s, char *out)
+{
+    uint64_t best = s->head, p, half = s->base + SEG_WINDOW / 2;
+    size_t n;
+
+    for (uint64_t e = s->head - s->maxsym + 1; e < s->head; e++)
+        if (seg_at(s, e)->cost < seg_at(s, best)->cost)
+            best = e;
+    for (p = best; p > half; p -= seg_at(s, p)->nsym)
+        ;
+    if (p <= s->base)
+        p = best;
+    n = seg_emit(s, p, out);
+    for (uint64_t h = p + 1; h <= s->head; h++)
+        seg_relax(s, h);
+    return n;
+}
+
+// End of a run, everything up to its last symbol is settled.
+static size_t seg_end(struct morse_segmenter *s, char *out)
+{
+    size_t n = seg_emit(s, s->head, out);
+
+    s->base = s->head = s->checked = 0;
+    s->pos[0].cost = 0;
+    return n;
+}
+
+static size_t seg_symbol(struct morse_segmenter *s, char c, char *out)
+{
+    size_t n = 0;
+    struct seg_pos *p;
+
+    if (s->head - s->checked >= SEG_CHECK)
+        n += seg_meet(s, out);
+    if (s->head - s->base == SEG_WINDOW - 1)
+        n += seg_force(s, out + n);
+    p = seg_at(s, ++s->head);
+    p->sym = c == '.' ? SEG_DOT : c == '-' ? SEG_DASH : SEG_OTHER;
+    p->space = 0;
+    seg_relax(s, s->head);
+    return n;
+}
+
+static inline int is_separator(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/*
+ * Decode len bytes of morse, out must hold MORSE_SEGMENT_BOUND(len)
+ * bytes.  As with morse_decoder_feed(), a run of more than one
+ * separator is a word gap and decodes to one space.
+ */
+size_t segment_feed(struct morse_segmenter *s, const char *in, size_t len,
+                    char *out)
+{
+    struct morse_stats *st = morse_stats_get();
+    char *p = out;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = in[i];
+
+        if (is_separator(c)) {
+            if (++s->gap == 1 && s->head)
+                seg_at(s, s->head)->space = 1;
+            else if (s->gap == 2 && s->head)
+                p += seg_end(s, p);
+            continue;
+        }
+        if (s->gap > 1 && s->started)
+            *p++ = ' ';
+        s->gap = 0;
+        s->started = 1;
+        p += seg_symbol(s, c, p);
+    }
+    st->bytes_in += len;
+    st->bytes_out += p - out;
+    MORSE_PROBE3(segment, in, len, p - out);
+    return p - out;
+}
+
+size_t segment_finish(struct morse_segmenter *s, char *out)
+{
+    size_t n = s->head ? seg_end(s, out) : 0;
+
+    morse_stats_get()->bytes_out += n;
+    s->gap = 0;
+    s->started = 0;
+    return n;
+}
+
+// -d --segment with -s/-f, morse_decode() with this decoder.
+void segment_decode(struct start_options *options)
+{
+    char buf[MORSE_SEGMENT_BOUND(MORSE_CHUNK)];
+    struct morse_segmenter *s;
+    size_t off, n, total = 0;
+
+    hmorse_init();
+    s = segment_create(options);
+    for (off = 0; off < options->length; off += n) {
+        uint64_t start = morse_stats_chunk_start();
+
+        n = options->length - off;
+        if (n > MORSE_CHUNK)
+            n = MORSE_CHUNK;
+        total += fwrite(buf, 1, segment_feed(s, options->message + off, n, buf),
+                        stdout);
+        morse_stats_chunk_end(start);
+    }
+    total += fwrite(buf, 1, segment_finish(s, buf), stdout);
+    fflush(stdout);
+    morse_stats_flush(total);
+    segment_destroy(s);
+}
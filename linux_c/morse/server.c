@@ -0,0 +1,385 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Encode/decode daemon on a UNIX domain stream socket.
+ *
+ *   morse --serve /run/morse.sock [-j N]
+ *
+ * Requests and responses are length prefixed frames (see MORSE_SRV_* in
+ * morse.h), a client may pipeline as many requests as it likes on one
+ * connection and gets the responses back in order.
+ *
+ * Every worker thread runs its own epoll loop.  The listening socket is
+ * registered in all of them with EPOLLEXCLUSIVE so a new connection wakes
+ * a single worker, and that worker owns the connection from then on; no
+ * locks are taken on the request path.  The decode tables are built once
+ * before the workers start and are shared read only.
+ *
+ * Closed connections go on their worker's free list with their buffers,
+ * up to SRV_KEEP_BUF each, so a busy daemon reuses the same memory for
+ * new clients instead of allocating and freeing it for every one.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "morse.h"
+
+#define SRV_EVENTS 64
+#define SRV_READ_SIZE 65536
+// Stop reading from a client that does not collect its responses.
+#define SRV_OUT_HIGH (4 << 20)
+// Buffers of closed connections kept for the next one.
+#define SRV_KEEP_BUF (256 * 1024)
+
+struct srv_conn {
+    int fd;
+    char *in;				// unparsed request bytes
+    size_t in_len, in_size;
+    char *out;				// responses not yet written
+    size_t out_off, out_len, out_size;
+    uint32_t events;			// currently registered epoll events
+    int eof;				// no more requests, drain and close
+    struct morse_cache *cache;		// its worker's
+};
+
+struct srv_worker {
+    pthread_t thread;
+    int epfd;
+    int listen_fd;
+    struct arena conn_arena;
+    struct arena_freelist conns;	// closed, ready for reuse
+    struct morse_cache *cache;		// results of repeated requests
+};
+
+static int srv_reserve(char **buf, size_t *size, size_t need)
+{
+    char *p;
+    size_t n = *size ? *size : 4096;
+
+    if (need <= *size)
+        return 0;
+    while (n < need)
+        n *= 2;
+    p = realloc(*buf, n);
+    if (!p)
+        return -1;
+    *buf = p;
+    *size = n;
+    return 0;
+}
+
+static void srv_close(struct srv_worker *w, struct srv_conn *c)
+{
+    close(c->fd);
+    if (c->in_size > SRV_KEEP_BUF) {
+        free(c->in);
+        c->in = NULL;
+        c->in_size = 0;
+    }
+    if (c->out_size > SRV_KEEP_BUF) {
+        free(c->out);
+        c->out = NULL;
+        c->out_size = 0;
+    }
+    c->in_len = c->out_off = c->out_len = 0;
+    c->eof = 0;
+    arena_put(&w->conns, c);
+}
+
+/*
+ * Append the response for one request to the connection output buffer,
+ * converting straight into it so the payload is never copied.  A request
+ * seen before is copied from the worker's cache instead.
+ */
+static int srv_handle(struct srv_conn *c, const char *req, uint32_t len)
+{
+    uint8_t op = req[0];
+    const char *payload = req + 1, *hit = NULL;
+    size_t plen = len - 1, bound, n = 0;
+    uint8_t status = MORSE_SRV_OK;
+    uint64_t start = morse_stats_chunk_start();
+    int mode = MORS_NONE;
+    char *hdr;
+
+    if (op == MORSE_SRV_ENCODE) {
+        mode = MORS_ENCO;
+        bound = MORSE_ENCODE_BOUND(plen);
+    } else if (op == MORSE_SRV_DECODE) {
+        mode = MORS_DECO;
+        bound = MORSE_DECODE_BOUND(plen);
+    } else {
+        bound = 0;
+        status = MORSE_SRV_BAD_REQUEST;
+    }
+    if (mode != MORS_NONE && (hit = cache_get(c->cache, mode, payload, plen, &n)))
+        bound = n;
+
+    if (srv_reserve(&c->out, &c->out_size,
+                    c->out_len + MORSE_SRV_HDR_SIZE + bound))
+        return -1;
+    hdr = c->out + c->out_len;
+
+    if (hit)
+        memcpy(hdr + MORSE_SRV_HDR_SIZE, hit, n);
+    else if (mode != MORS_NONE) {
+        n = mode == MORS_ENCO
+          ? morse_encode_buf(payload, plen, hdr + MORSE_SRV_HDR_SIZE)
+          : morse_decode_buf(payload, plen, hdr + MORSE_SRV_HDR_SIZE);
+        cache_put(c->cache, mode, payload, plen, hdr + MORSE_SRV_HDR_SIZE, n);
+    }
+
+    morse_srv_put_hdr(hdr, n + 1, status);
+    c->out_len += MORSE_SRV_HDR_SIZE + n;
+    morse_stats_chunk_end(start);
+    return 0;
+}
+
+// Handle every complete frame in the input buffer, keep the partial tail.
+static int srv_parse(struct srv_conn *c)
+{
+    size_t off = 0;
+
+    while (c->in_len - off >= MORSE_SRV_LEN_SIZE) {
+        uint32_t len = morse_srv_get_len(c->in + off);
+
+        if (len == 0 || len > MORSE_SRV_MAX_REQUEST)
+            return -1;
+        if (c->in_len - off < MORSE_SRV_LEN_SIZE + len)
+            break;
+        if (srv_handle(c, c->in + off + MORSE_SRV_LEN_SIZE, len))
+            return -1;
+        off += MORSE_SRV_LEN_SIZE + len;
+    }
+
+    if (off) {
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
+    return 0;
+}
+
+static int srv_flush(struct srv_worker *w, struct srv_conn *c)
+{
+    struct epoll_event ev;
+
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return -1;
+            break;
+        }
+        c->out_off += n;
+        morse_stats_flush(n);
+    }
+    if (c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+
+    /*
+     * Only ask for EPOLLOUT while the socket buffer is full, and stop
+     * reading while too many responses are queued or after the last
+     * request.
+     */
+    ev.events = (c->out_len < SRV_OUT_HIGH && !c->eof ? EPOLLIN : 0)
+              | (c->out_len ? EPOLLOUT : 0);
+    if (ev.events != c->events) {
+        c->events = ev.events;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read and answer what the client sent.  A half close (or a request that
+ * does not parse) sets eof, the responses queued so far are still
+ * written before the connection closes.
+ */
+static int srv_read(struct srv_conn *c)
+{
+    while (c->out_len < SRV_OUT_HIGH) {
+        ssize_t n;
+
+        if (srv_reserve(&c->in, &c->in_size, c->in_len + SRV_READ_SIZE))
+            return -1;
+        n = recv(c->fd, c->in + c->in_len, c->in_size - c->in_len, 0);
+        if (n == 0) {
+            c->eof = 1;
+            return 0;
+        }
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->in_len += n;
+        if (srv_parse(c)) {
+            c->eof = 1;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void srv_accept(struct srv_worker *w)
+{
+    struct epoll_event ev;
+    struct srv_conn *c;
+    int fd;
+
+    while ((fd = accept4(w->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        c = arena_get(&w->conn_arena, &w->conns, sizeof(*c));
+        c->fd = fd;
+        c->cache = w->cache;
+        c->events = ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            srv_close(w, c);
+    }
+}
+
+static void *srv_thread(void *arg)
+{
+    struct srv_worker *w = arg;
+    struct epoll_event ev[SRV_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(w->epfd, ev, SRV_EVENTS, -1);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for connections");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct srv_conn *c = ev[i].data.ptr;
+
+            if (!c) {
+                srv_accept(w);
+                continue;
+            }
+            if ((ev[i].events & (EPOLLERR | EPOLLHUP)) && !(ev[i].events & EPOLLIN)) {
+                srv_close(w, c);
+                continue;
+            }
+            if ((ev[i].events & EPOLLIN) && srv_read(c)) {
+                srv_close(w, c);
+                continue;
+            }
+            if (srv_flush(w, c) || (c->eof && !c->out_len))
+                srv_close(w, c);
+        }
+    }
+    return NULL;
+}
+
+static int srv_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Error creating socket");
+        return -1;
+    }
+    // A stale socket from a previous run would make bind fail.
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(fd, SOMAXCONN) == -1) {
+        perror("Error binding socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void morse_serve(struct start_options options)
+{
+    struct srv_worker *workers;
+    struct epoll_event ev;
+    int nthreads = options.jobs > 0 ? options.jobs : 1;
+    int fd;
+
+    fd = srv_listen(options.serve_path);
+    if (fd == -1)
+        exit(EXIT_FAILURE);
+
+    hmorse_init();
+
+    workers = calloc(nthreads, sizeof(*workers));
+    if (!workers) {
+        perror("Error allocating workers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].listen_fd = fd;
+        workers[i].cache = cache_for_worker(&options, nthreads);
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (workers[i].epfd == -1
+            || epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("Error setting up epoll");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("serving on %s with %d worker%s\n", options.serve_path,
+           nthreads, nthreads > 1 ? "s" : "");
+    fflush(stdout);
+
+    for (int i = 1; i < nthreads; i++)
+        if (pthread_create(&workers[i].thread, NULL, srv_thread, &workers[i])) {
+            perror("Error creating worker");
+            exit(EXIT_FAILURE);
+        }
+    srv_thread(&workers[0]);
+}
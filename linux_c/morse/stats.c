@@ -0,0 +1,150 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Hot path counters, always compiled in.
+ *
+ * Every thread counts into a block of its own, allocated on first use and
+ * chained onto a global list so the totals can be summed at exit, the
+ * increments are plain stores to memory no other thread writes.  Chunk
+ * timings need a clock read on each side of a chunk and are only taken
+ * once --stats turned them on.  Totals are printed to stderr at exit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "morse.h"
+
+__thread struct morse_stats *morse_tstats;
+int morse_stats_enabled;
+
+static struct morse_stats *stats_list;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct morse_stats *morse_stats_register(void)
+{
+    struct morse_stats *st = calloc(1, sizeof(*st));
+
+    if (!st) {
+        perror("Error allocating stats");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&stats_lock);
+    st->next = stats_list;
+    stats_list = st;
+    pthread_mutex_unlock(&stats_lock);
+    return morse_tstats = st;
+}
+
+static uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t morse_stats_chunk_start(void)
+{
+    return morse_stats_enabled ? stats_now() : 0;
+}
+
+void morse_stats_chunk_end(uint64_t start)
+{
+    struct morse_stats *st = morse_stats_get();
+    uint64_t ns;
+
+    st->chunks++;
+    if (!start)
+        return;
+    ns = stats_now() - start;
+    st->chunk_ns += ns;
+    if (ns > st->chunk_max_ns)
+        st->chunk_max_ns = ns;
+}
+
+void morse_stats_flush(size_t bytes)
+{
+    struct morse_stats *st = morse_stats_get();
+
+    st->flushes++;
+    st->flush_bytes += bytes;
+    MORSE_PROBE1(flush, bytes);
+}
+
+// Forget what was counted so far, e.g. by a calibration run.
+void morse_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    for (struct morse_stats *st = stats_list; st; st = st->next) {
+        struct morse_stats *next = st->next;
+
+        memset(st, 0, sizeof(*st));
+        st->next = next;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void morse_stats_print(void)
+{
+    struct morse_stats sum = { 0 };
+
+    pthread_mutex_lock(&stats_lock);
+    for (struct morse_stats *st = stats_list; st; st = st->next) {
+        sum.bytes_in += st->bytes_in;
+        sum.bytes_out += st->bytes_out;
+        sum.letters += st->letters;
+        sum.unknown += st->unknown;
+        sum.chunks += st->chunks;
+        sum.chunk_ns += st->chunk_ns;
+        if (st->chunk_max_ns > sum.chunk_max_ns)
+            sum.chunk_max_ns = st->chunk_max_ns;
+        sum.flushes += st->flushes;
+        sum.flush_bytes += st->flush_bytes;
+        sum.cache_hits += st->cache_hits;
+        sum.cache_misses += st->cache_misses;
+        sum.cache_evictions += st->cache_evictions;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    fprintf(stderr, "bytes in:      %llu\n", (unsigned long long)sum.bytes_in);
+    fprintf(stderr, "bytes out:     %llu\n", (unsigned long long)sum.bytes_out);
+    fprintf(stderr, "letters:       %llu\n", (unsigned long long)sum.letters);
+    fprintf(stderr, "unknown:       %llu\n", (unsigned long long)sum.unknown);
+    fprintf(stderr, "chunks:        %llu", (unsigned long long)sum.chunks);
+    if (sum.chunks)
+        fprintf(stderr, "  avg %.1f us  max %.1f us",
+                sum.chunk_ns / 1e3 / sum.chunks, sum.chunk_max_ns / 1e3);
+    fprintf(stderr, "\nflushes:       %llu  (%llu bytes)\n",
+            (unsigned long long)sum.flushes, (unsigned long long)sum.flush_bytes);
+    if (sum.cache_hits + sum.cache_misses)
+        fprintf(stderr, "cache:         %llu hits  %llu misses  %llu evicted\n",
+                (unsigned long long)sum.cache_hits,
+                (unsigned long long)sum.cache_misses,
+                (unsigned long long)sum.cache_evictions);
+}
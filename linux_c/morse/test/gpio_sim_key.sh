@@ -0,0 +1,47 @@
+#!/bin/bash
+# Key a message into the morse GPIO decoder through the gpio-sim module.
+#
+# usage: sudo ./gpio_sim_key.sh ["SOS SOS"] [wpm]
+#
+# Creates a simulated gpio chip through configfs, starts
+# "morse -d -g <chip>:0" on it and toggles the line pull to key the
+# message.  Needs CONFIG_GPIO_SIM and configfs mounted.
+
+MSG=${1:-"PARIS PARIS"}
+WPM=${2:-15}
+MORSE=${MORSE:-$(dirname "$0")/../build/morse}
+CFS=/sys/kernel/config/gpio-sim/morse
+
+set -e
+modprobe gpio-sim
+mkdir -p $CFS/bank0
+echo 1 > $CFS/bank0/num_lines
+echo 1 > $CFS/live
+trap 'echo 0 > $CFS/live; rmdir $CFS/bank0 $CFS' EXIT
+
+CHIP=$(cat $CFS/bank0/chip_name)
+PULL=/sys/devices/platform/$(cat $CFS/dev_name)/$CHIP/sim_gpio0/pull
+
+$MORSE -d -g $CHIP:0 -w $WPM &
+PID=$!
+sleep 0.5
+
+DOT=$(echo "scale=4; 1.2 / $WPM" | bc)
+key() { echo pull-up > $PULL; sleep $(echo "$DOT * $1" | bc); echo pull-down > $PULL; }
+gap() { sleep $(echo "$DOT * $1" | bc); }
+
+for word in $MSG; do
+    for ((i = 0; i < ${#word}; i++)); do
+        code=$($MORSE -e -s "${word:$i:1}" | tr -d ' ')
+        for ((j = 0; j < ${#code}; j++)); do
+            [ "${code:$j:1}" = "." ] && key 1 || key 3
+            gap 1
+        done
+        gap 2
+    done
+    gap 4
+done
+
+sleep 1
+kill -INT $PID
+echo
@@ -0,0 +1,155 @@
+#!/bin/bash
+# Round trip and regression checks of the modes that keep state across
+# files, chunks and connections.
+#
+# usage: ./regress.sh   (or make test)
+#
+# Runs build/morse and build/morse-load on files in a scratch directory,
+# with a cache directory of its own so the calibration and the config
+# cache start fresh.  Prints one line per check, exits 1 if any failed.
+
+MORSE=${MORSE:-$(dirname "$0")/../build/morse}
+LOAD=${LOAD:-$(dirname "$0")/../build/morse-load}
+T=$(mktemp -d)
+SERVER=
+FAILED=0
+
+export XDG_CACHE_HOME=$T/cache
+trap '[ -n "$SERVER" ] && kill $SERVER 2>/dev/null; rm -rf $T' EXIT
+
+check() {
+    local name=$1
+    shift
+    if "$@" > $T/out 2>&1; then
+        echo "ok      $name"
+    else
+        echo "FAILED  $name"
+        sed 's/^/        /' $T/out | head -5
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# n bytes of the same letter
+fill() { head -c $2 /dev/zero | tr '\0' "$1"; }
+
+# Words and newlines, no byte without a code.
+text() {
+    local words=(CQ DE TEST PARIS QTH RST 599 NAME OP HW CPY K 73 SK)
+    for ((i = 0; i < $1; i++)); do
+        echo "${words[i % 14]} ${words[(i * 7) % 14]} ${words[(i * 3) % 14]}"
+    done
+}
+
+text 2000 > $T/text.txt
+
+# Newlines are sent as word gaps, compare the words.
+words() { tr '\n' ' ' | tr -s ' ' | sed 's/ $//'; }
+
+round_trip() {
+    $MORSE -e -f - < $T/text.txt | $MORSE -d -f - | words > $T/back
+    words < $T/text.txt | cmp - $T/back
+}
+check "encode and decode round trip" round_trip
+
+# The GPIO decoder keyed through gpio-sim, when run as root on a kernel
+# with CONFIG_GPIO_SIM.
+gpio_sim() {
+    MORSE=$MORSE "$(dirname "$0")"/gpio_sim_key.sh "SOS SOS" 20 > $T/gpio 2>&1
+    cat $T/gpio
+    grep -q 'SOS' $T/gpio
+}
+if [ "$(id -u)" = 0 ] && modprobe -q gpio-sim 2>/dev/null \
+        && [ -d /sys/kernel/config/gpio-sim ]; then
+    check "GPIO decoder keyed through gpio-sim" gpio_sim
+else
+    echo "skip    GPIO decoder keyed through gpio-sim (needs root and gpio-sim)"
+fi
+
+# Enough input to calibrate first, which runs both batch engines three
+# times before the real batch in the same process, once with each engine
+# picked for the real batch.
+batch_twice() {
+    mkdir -p $T/batch
+    for i in $(seq -w 1 32); do
+        head -c 4000 $T/text.txt > $T/batch/$i.txt
+    done
+    $MORSE -e -f - < $T/batch/01.txt > $T/batch.ref
+    for engine in "" --io-uring; do
+        rm -rf $T/cache
+        rm -f $T/batch/*.morse
+        $MORSE -e $engine $T/batch/*.txt || return 1
+        for i in $(seq -w 1 32); do
+            cmp $T/batch/$i.txt.morse $T/batch.ref || return 1
+        done
+    done
+}
+check "batch after calibration in one process" batch_twice
+
+# Every response arrives when the client half closes after its requests.
+half_close() {
+    $MORSE --serve $T/sock -j 2 > $T/serve.log &
+    SERVER=$!
+    # The socket exists before it listens, wait for the banner.
+    for i in $(seq 50); do
+        grep -q '^serving on' $T/serve.log 2>/dev/null && break
+        sleep 0.1
+    done
+    $LOAD -b -c 2 -n 20000 $T/sock
+}
+check "daemon with a half closed client" half_close
+[ -n "$SERVER" ] && kill $SERVER 2>/dev/null
+SERVER=
+
+# Past the first 64K chunk the labels start later and grow wider.
+generate_wav() {
+    local secs='^[0-9]+\.[0-9][0-9][0-9][0-9][0-9][0-9]$'
+
+    text 8000 | head -c 70000 > $T/gen.txt
+    letters=$($MORSE --generate $T/gen.wav -f $T/gen.txt -j 1 -w 40 \
+                     --impair rate=1000,tone=300 2>&1 | awk '{ print $2 }')
+    [ -n "$letters" ] || return 1
+    awk -F'\t' -v secs="$secs" -v letters=$letters '
+        NF != 3 || $1 !~ secs || $2 !~ secs {
+            print "bad label " NR ": " $0; exit 1 }
+        END { if (NR != letters) { print NR " labels, " letters " letters"; exit 1 } }
+    ' $T/gen.wav.txt
+}
+check "--generate a .wav of more than 64K of text" generate_wav
+
+strict_gzip() {
+    gzip -c $T/text.txt > $T/good.gz
+    printf 'CQ # DE\n' | gzip -c > $T/bad.gz
+    $MORSE -e --strict -f $T/good.gz | $MORSE -d -f - | words > $T/back
+    words < $T/text.txt | cmp - $T/back || return 1
+    ! $MORSE -e --strict -f $T/bad.gz > $T/bad.out 2>/dev/null && [ ! -s $T/bad.out ]
+}
+check "--strict on gzip input" strict_gzip
+
+# Carriage returns and tabs are white space, not letters with no code.
+crlf_tabs() {
+    sed 's/ /\t/; s/$/\r/' $T/text.txt > $T/crlf.txt
+    $MORSE -e --validate -f $T/crlf.txt || return 1
+    $MORSE -e --strict -f $T/crlf.txt | tail -n +2 | $MORSE -d -f - | words > $T/back
+    words < $T/text.txt | cmp - $T/back
+}
+check "--validate and --strict on CRLF and tab text" crlf_tabs
+
+# <AR> right across the 4K chunk of a file and the 64K pipeline block.
+prosign_boundary() {
+    echo 'prosign "AR" { code = ".-.-." }' > $T/morse.cfg
+    for pad in 4093 4094 4095 65533 65534 65535; do
+        { fill E $pad; echo '<AR> K'; } > $T/ps.txt
+        gzip -c $T/ps.txt > $T/ps.gz
+        for input in "-f $T/ps.txt" "-f $T/ps.gz" "-f -"; do
+            n=$($MORSE -c $T/morse.cfg -e $input < $T/ps.txt 2>/dev/null \
+                | grep -o '\.-\.-\.' | wc -l)
+            if [ "$n" != 1 ]; then
+                echo "<AR> after $pad bytes, $input: sent $n times"
+                return 1
+            fi
+        done
+    done
+}
+check "prosigns across chunk boundaries" prosign_boundary
+
+[ $FAILED = 0 ] || { echo "$FAILED failed"; exit 1; }
@@ -0,0 +1,264 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Timing decoder: turns a stream of key-down (mark) and key-up (space)
+ * durations back into letters.
+ *
+ * The decoder keeps a running estimate of the dot length, seeded from the
+ * requested WPM (PARIS, 50 units per word, so dot = 1200ms / WPM) and then
+ * tracks the sender:
+ *
+ *   mark  < 2 dots  -> '.'        mark >= 2 dots -> '-'
+ *   space < 2 dots  -> element gap (same letter)
+ *   space < 5 dots  -> letter gap
+ *   space >= 5 dots -> word gap
+ *
+ * The thresholds sit halfway between the nominal 1/3 and 3/7 unit lengths,
+ * so a sender drifting by up to 50% is still read correctly while the
+ * estimate follows them.
+ *
+ * With --lm or --beam the decisions are left to the beam decoder instead,
+ * see beam.c.  timing_file_decode() feeds either from --generate style
+ * timing lines.
+ *
+ * The other way round, timing_schedule() gives the key down/up durations
+ * that send a code, for the keyer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "morse.h"
+
+void timing_decoder_init(struct timing_decoder *td, unsigned wpm,
+                         void (*emit)(char c, void *arg), void *arg)
+{
+    memset(td, 0, sizeof(*td));
+    if (wpm == 0)
+        wpm = DEFAULT_WPM;
+    td->dot_ns = MORSE_DOT_NS(wpm);
+    td->emit = emit;
+    td->arg = arg;
+}
+
+static void timing_decoder_letter(struct timing_decoder *td)
+{
+    if (!td->nsym)
+        return;
+    td->sym[td->nsym] = '\0';
+    td->emit(morse2char(td->sym), td->arg);
+    td->nsym = 0;
+}
+
+void timing_decoder_mark(struct timing_decoder *td, uint64_t ns)
+{
+    char s;
+
+    if (td->beam) {
+        beam_mark(td->beam, ns);
+        return;
+    }
+    if (ns < 2 * td->dot_ns) {
+        s = '.';
+        td->dot_ns = (3 * td->dot_ns + ns) / 4;
+    } else {
+        s = '-';
+        td->dot_ns = (3 * td->dot_ns + ns / 3) / 4;
+    }
+
+    // No letter is longer than this, treat an overrun as noise.
+    if (td->nsym == TIMING_MAX_SYMBOLS) {
+        pr_err("timing: symbol overrun, dropping letter\n");
+        td->nsym = 0;
+    }
+    td->sym[td->nsym++] = s;
+    td->word_pending = 1;
+}
+
+void timing_decoder_space(struct timing_decoder *td, uint64_t ns)
+{
+    if (td->beam) {
+        beam_space(td->beam, ns);
+        return;
+    }
+    if (ns < 2 * td->dot_ns)
+        return;
+
+    timing_decoder_letter(td);
+    if (ns >= 5 * td->dot_ns && td->word_pending) {
+        td->emit(' ', td->arg);
+        td->word_pending = 0;
+    }
+}
+
+uint64_t timing_decoder_idle_ns(struct timing_decoder *td)
+{
+    if (td->beam)
+        return beam_idle_ns(td->beam);
+    if (td->nsym)
+        return 2 * td->dot_ns;
+    if (td->word_pending)
+        return 5 * td->dot_ns;
+    return 0;
+}
+
+void timing_decoder_flush(struct timing_decoder *td)
+{
+    if (td->beam)
+        beam_flush(td->beam);
+    else
+        timing_decoder_letter(td);
+}
+
+// Hand the decisions to the beam decoder when the options ask for it.
+void timing_decoder_options(struct timing_decoder *td,
+                            struct start_options *options)
+{
+    static struct morse_lm lm;
+
+    if (!options->lm && !options->beam)
+        return;
+    if (options->lm && !lm.map)
+        lm_open(&lm, options->lm);
+    td->beam = beam_create(options->lm ? &lm : NULL, options->beam,
+                           td->dot_ns, td->emit, td->arg);
+}
+
+static void timing_file_emit(char c, void *arg)
+{
+    (void)arg;
+    putchar(c);
+}
+
+/*
+ * Decode timing lines, morse -d --timing -f file|-s msg: an optional label
+ * up to a tab, then durations in microseconds, + key down and - key up.
+ * Durations of the same sign in a row are one, across lines as well, so
+ * the --generate output of any text can be fed back as it is.
+ */
+void timing_file_decode(struct start_options *options)
+{
+    struct timing_decoder td;
+    FILE *f;
+    char *line = NULL;
+    size_t cap = 0;
+    uint64_t run = 0;
+    int sign = 0;
+
+    hmorse_init();
+    if (options->message)
+        f = fmemopen(options->message, strlen(options->message), "r");
+    else if (!strcmp(options->filename, "-"))
+        f = stdin;
+    else
+        f = fopen(options->filename, "r");
+    if (!f) {
+        perror(options->message ? "message" : options->filename);
+        exit(EXIT_FAILURE);
+    }
+    timing_decoder_init(&td, options->wpm, timing_file_emit, NULL);
+    timing_decoder_options(&td, options);
+
+    while (getline(&line, &cap, f) != -1) {
+        char *p = strchr(line, '\t');
+
+        for (p = p ? p + 1 : line; *p; ) {
+            char *end;
+            unsigned long long us;
+            int s;
+
+            if (isspace((unsigned char)*p)) {
+                p++;
+                continue;
+            }
+            if (*p != '+' && *p != '-') {
+                fprintf(stderr, "timing: bad duration \"%s\"\n", p);
+                exit(EXIT_FAILURE);
+            }
+            s = *p == '+' ? 1 : -1;
+            us = strtoull(p + 1, &end, 10);
+            if (end == p + 1) {
+                fprintf(stderr, "timing: bad duration \"%s\"\n", p);
+                exit(EXIT_FAILURE);
+            }
+            p = end;
+            if (sign && s != sign) {
+                if (sign > 0)
+                    timing_decoder_mark(&td, run);
+                else
+                    timing_decoder_space(&td, run);
+                run = 0;
+            }
+            sign = s;
+            run += us * 1000;
+        }
+    }
+    if (sign > 0)
+        timing_decoder_mark(&td, run);
+    timing_decoder_flush(&td);
+    putchar('\n');
+    if (td.beam)
+        beam_destroy(td.beam);
+    free(line);
+    if (f != stdin)
+        fclose(f);
+}
+
+void timing_keying_init(struct timing_keying *k, unsigned wpm,
+                        unsigned farnsworth)
+{
+    if (wpm == 0)
+        wpm = DEFAULT_WPM;
+    k->dot_ns = k->gap_ns = MORSE_DOT_NS(wpm);
+    if (farnsworth && farnsworth < wpm)
+        k->gap_ns = MORSE_GAP_NS(wpm, farnsworth);
+}
+
+/*
+ * The elements of one code into out, at most TIMING_MAX_ELEMENTS.  A dot
+ * is one unit down, a dash three, one unit up between them and the letter
+ * gap of three gap units after the last one.  " " is the rest of a word
+ * gap after a letter, four more gap units.  An empty code sends nothing.
+ */
+size_t timing_schedule(const struct timing_keying *k, const char *code,
+                       struct timing_element *out)
+{
+    size_t n = 0;
+
+    if (!strcmp(code, " ")) {
+        out[0].down = 0;
+        out[0].ns = 4 * k->gap_ns;
+        return 1;
+    }
+    for (; *code && n + 2 <= TIMING_MAX_ELEMENTS; code++) {
+        out[n].down = 1;
+        out[n++].ns = *code == '-' ? 3 * k->dot_ns : k->dot_ns;
+        out[n].down = 0;
+        out[n++].ns = code[1] ? k->dot_ns : 3 * k->gap_ns;
+    }
+    return n;
+}
@@ -0,0 +1,523 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Self tuning engine choice, morse --tune to recalibrate, --no-tune to
+ * keep the fixed defaults.
+ *
+ * Which engine is fastest depends on the input size, the CPU and the
+ * storage: a thread costs tens of microseconds to start, the best chunk
+ * depends on the caches, read() beats mmap() up to a size that depends on
+ * the kernel, and io_uring may be missing or slower than the mmap batch.
+ * So the first run that has a choice to make measures this machine, once:
+ *
+ *   encode_ns, decode_ns  one thread per input byte, the best of the
+ *                         chunk sizes tried becomes the parallel chunk
+ *   speedup               of every cpu encoding at once over one
+ *   thread_ns             starting and joining a pool worker
+ *   read_max              largest file read() is faster for than mmap()
+ *   file_ns               per small file of a batch on the mmap engine
+ *   uring_file_ns         and on io_uring, 0 when the kernel has none
+ *
+ * which takes a fraction of a second and is kept in tune.bin of the cache
+ * directory, next to the compiled config.  A different CPU model or count
+ * measures again.  From then on the engines ask tune_threads() how many
+ * threads an input is worth: the estimated time of the work spread over n
+ * threads plus the start of n threads, least wins, so small inputs stay
+ * on one thread and large ones get every cpu that still helps.
+ *
+ * The storage numbers are taken on files in the cache directory, which
+ * is usually the file system the inputs are on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+#define TUNE_MAGIC "MORSETN2"
+#define TUNE_TEXT (512 * 1024)		// text encoded and decoded
+#define TUNE_REPEAT 3			// best of
+#define TUNE_FILES 32			// small files of the batch test
+#define TUNE_FILE_SIZE 8192
+
+static const size_t tune_chunks[] = { 16 << 10, 64 << 10, 256 << 10 };
+static const size_t tune_reads[] = { 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+
+#define TUNE_NCHUNKS (sizeof(tune_chunks) / sizeof(tune_chunks[0]))
+#define TUNE_NREADS (sizeof(tune_reads) / sizeof(tune_reads[0]))
+
+static const char tune_sample[] =
+    "CQ CQ DE W1AW W1AW K. The quick brown fox jumps over the lazy dog, "
+    "UR RST 599 5NN QTH NEWINGTON CT. Pack my box with five dozen liquor "
+    "jugs; 73 ES GUD DX <SK>\n";
+
+static uint64_t tune_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// FNV-1a of the cpu model name and the cpu count.
+static uint64_t tune_machine(long ncpu)
+{
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)ncpu;
+    char line[256];
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    if (!f)
+        return h;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "model name", 10)) {
+            for (const char *p = line; *p; p++)
+                h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+            break;
+        }
+    fclose(f);
+    return h;
+}
+
+static void *tune_alloc(size_t len)
+{
+    void *p = malloc(len);
+
+    if (!p) {
+        perror("Error allocating calibration buffers");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// ns per input byte of converting in with mode in chunks, best of a few.
+static double tune_convert(int mode, const char *in, size_t len, size_t chunk,
+                           char *out)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int r = 0; r < TUNE_REPEAT; r++) {
+        uint64_t start = tune_now();
+
+        for (size_t off = 0; off < len; off += chunk) {
+            size_t n = len - off < chunk ? len - off : chunk;
+
+            if (mode == MORS_ENCO)
+                morse_encode_buf(in + off, n, out);
+            else
+                morse_decode_buf(in + off, n, out);
+        }
+        start = tune_now() - start;
+        if (start < best)
+            best = start;
+    }
+    return (double)best / len;
+}
+
+struct tune_work {
+    const char *in;
+    size_t len;
+    char *out;
+};
+
+static void tune_nop(void *arg, int worker)
+{
+    (void)arg;
+    (void)worker;
+}
+
+static void tune_encode(void *arg, int worker)
+{
+    struct tune_work *w = arg;
+
+    (void)worker;
+    morse_encode_buf(w->in, w->len, w->out);
+}
+
+static void tune_cpu(struct morse_tune *t, const char *text, size_t len)
+{
+    size_t mlen, bound = MORSE_ENCODE_BOUND(len);
+    char *morse = tune_alloc(bound), *out = tune_alloc(MORSE_DECODE_BOUND(bound));
+    struct tune_work *work;
+    struct pool *pool;
+    uint64_t best = UINT64_MAX;
+
+    t->encode_ns = 1e9;
+    for (size_t i = 0; i < TUNE_NCHUNKS; i++) {
+        double ns = tune_convert(MORS_ENCO, text, len, tune_chunks[i], out);
+
+        if (ns < t->encode_ns) {
+            t->encode_ns = ns;
+            t->chunk = tune_chunks[i];
+        }
+    }
+    mlen = morse_encode_buf(text, len, morse);
+    t->decode_ns = tune_convert(MORS_DECO, morse, mlen, 64 << 10, out);
+
+    // Starting and joining the threads, nothing to run.
+    for (int r = 0; r < TUNE_REPEAT; r++) {
+        uint64_t start = tune_now();
+
+        pool = pool_create(t->ncpu);
+        for (uint32_t i = 0; i < t->ncpu; i++)
+            pool_submit(pool, tune_nop, NULL);
+        pool_wait(pool);
+        pool_destroy(pool);
+        start = tune_now() - start;
+        if (start < best)
+            best = start;
+    }
+    t->thread_ns = (double)best / t->ncpu;
+
+    // Every cpu encoding the whole text at once against one doing it.
+    t->speedup = 1;
+    if (t->ncpu > 1) {
+        work = tune_alloc(t->ncpu * sizeof(*work));
+        pool = pool_create(t->ncpu);
+        for (uint32_t i = 0; i < t->ncpu; i++) {
+            work[i].in = text;
+            work[i].len = len;
+            work[i].out = tune_alloc(bound);
+            pool_submit(pool, tune_nop, NULL);
+        }
+        pool_wait(pool);
+        best = UINT64_MAX;
+        for (int r = 0; r < TUNE_REPEAT; r++) {
+            uint64_t start = tune_now();
+
+            for (uint32_t i = 0; i < t->ncpu; i++)
+                pool_submit(pool, tune_encode, &work[i]);
+            pool_wait(pool);
+            start = tune_now() - start;
+            if (start < best)
+                best = start;
+        }
+        pool_destroy(pool);
+        t->speedup = t->ncpu * t->encode_ns * len / best;
+        if (t->speedup < 1)
+            t->speedup = 1;
+        for (uint32_t i = 0; i < t->ncpu; i++)
+            free(work[i].out);
+        free(work);
+    }
+    free(morse);
+    free(out);
+}
+
+static int tune_write(const char *path, const char *buf, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok;
+
+    if (fd == -1)
+        return -1;
+    ok = write(fd, buf, len) == (ssize_t)len;
+    if (close(fd) == -1)
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+// ns of reading the first len bytes of path with read() or mmap().
+static uint64_t tune_read(const char *path, size_t len, int map, char *buf)
+{
+    uint64_t start = tune_now();
+    volatile char sum = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *p;
+
+    if (fd == -1)
+        return UINT64_MAX;
+    if (!map) {
+        if (read(fd, buf, len) != (ssize_t)len)
+            start = 0;
+    } else {
+        p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return UINT64_MAX;
+        }
+        for (size_t off = 0; off < len; off += 4096)
+            sum += p[off];
+        munmap(p, len);
+    }
+    close(fd);
+    return start ? tune_now() - start : UINT64_MAX;
+}
+
+/*
+ * Per file ns of a batch on the mmap engine, or on io_uring, 0 when the
+ * engine is missing or a file failed.  It runs on its own options, and
+ * both engines start afresh on every call, so nothing of it is left to
+ * the batch of the user.
+ */
+static double tune_batch(struct start_options *o, int uring)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int r = 0; r < TUNE_REPEAT; r++) {
+        uint64_t start = tune_now();
+
+        if ((uring ? uring_batch_run(o, o->jobs)
+                   : batch_files(o, o->jobs, 0)) != 0)
+            return 0;
+        start = tune_now() - start;
+        if (start < best)
+            best = start;
+    }
+    return (double)best / o->nfiles;
+}
+
+static void tune_storage(struct morse_tune *t, const char *dir,
+                         const char *text)
+{
+    char *names[TUNE_FILES], big[PATH_MAX], out[PATH_MAX];
+    char *buf = tune_alloc(tune_reads[TUNE_NREADS - 1]);
+    struct start_options o;
+    int n = 0;
+
+    memset(&o, 0, sizeof(o));
+    o.mode = MORS_ENCO;
+    o.files = names;
+    o.outdir = (char *)dir;
+    o.jobs = t->ncpu;
+    o.cache = -1;
+    o.tune = -1;
+    for (; n < TUNE_FILES; n++) {
+        names[n] = tune_alloc(PATH_MAX);
+        if (snprintf(names[n], PATH_MAX, "%s/%02d.txt", dir, n) >= PATH_MAX
+            || tune_write(names[n], text + n * TUNE_FILE_SIZE, TUNE_FILE_SIZE)) {
+            free(names[n]);
+            break;
+        }
+    }
+    o.nfiles = n;
+    t->read_max = tune_reads[0];
+    if (n == TUNE_FILES) {
+        t->file_ns = tune_batch(&o, 0);
+        t->uring_file_ns = tune_batch(&o, 1);
+        t->uring = t->file_ns && t->uring_file_ns
+                   && t->uring_file_ns < t->file_ns;
+    }
+
+    // The text again and again, as large as the largest read tried.
+    for (size_t off = 0; off < tune_reads[TUNE_NREADS - 1]; off += TUNE_TEXT)
+        memcpy(buf + off, text, TUNE_TEXT);
+    if (snprintf(big, sizeof(big), "%s/read.txt", dir) < (int)sizeof(big)
+        && !tune_write(big, buf, tune_reads[TUNE_NREADS - 1])) {
+        for (size_t i = 0; i < TUNE_NREADS; i++) {
+            uint64_t rd = UINT64_MAX, mm = UINT64_MAX, ns;
+
+            for (int r = 0; r < TUNE_REPEAT; r++) {
+                if ((ns = tune_read(big, tune_reads[i], 0, buf)) < rd)
+                    rd = ns;
+                if ((ns = tune_read(big, tune_reads[i], 1, buf)) < mm)
+                    mm = ns;
+            }
+            if (rd <= mm)
+                t->read_max = tune_reads[i];
+        }
+        unlink(big);
+    }
+
+    while (n--) {
+        if (!batch_output_path(MORS_ENCO, dir, names[n], out, sizeof(out)))
+            unlink(out);
+        unlink(names[n]);
+        free(names[n]);
+    }
+    free(buf);
+}
+
+static uint32_t tune_ncpu(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+}
+
+static void tune_calibrate(struct morse_tune *t, const char *dir)
+{
+    char *text = tune_alloc(TUNE_TEXT), tmp[PATH_MAX];
+
+    memset(t, 0, sizeof(*t));
+    memcpy(t->magic, TUNE_MAGIC, sizeof(t->magic));
+    t->ncpu = tune_ncpu();
+    t->machine = tune_machine(t->ncpu);
+    for (size_t off = 0; off < TUNE_TEXT; off += sizeof(tune_sample) - 1) {
+        size_t n = TUNE_TEXT - off;
+
+        memcpy(text + off, tune_sample, n < sizeof(tune_sample) - 1
+               ? n : sizeof(tune_sample) - 1);
+    }
+    hmorse_init();
+    tune_cpu(t, text, TUNE_TEXT);
+
+    if (snprintf(tmp, sizeof(tmp), "%s/tune-XXXXXX", dir) < (int)sizeof(tmp)
+        && mkdtemp(tmp)) {
+        tune_storage(t, tmp, text);
+        rmdir(tmp);
+    } else
+        t->read_max = tune_reads[0];
+    free(text);
+
+    // None of this was asked for.
+    morse_stats_reset();
+}
+
+static int tune_load(struct morse_tune *t, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd == -1)
+        return -1;
+    n = read(fd, t, sizeof(*t));
+    close(fd);
+    if (n != sizeof(*t) || memcmp(t->magic, TUNE_MAGIC, sizeof(t->magic))
+        || t->ncpu != tune_ncpu() || t->machine != tune_machine(t->ncpu))
+        return -1;
+    return 0;
+}
+
+// Readers either see the old calibration or the complete new one.
+static void tune_store(const struct morse_tune *t, const char *path)
+{
+    char tmp[PATH_MAX + 16];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid())
+        >= (int)sizeof(tmp))
+        return;
+    if (tune_write(tmp, (const char *)t, sizeof(*t)) || rename(tmp, path))
+        unlink(tmp);
+}
+
+/*
+ * The calibration of this machine, measured now when there is none yet
+ * or with --tune.  NULL with --no-tune or without a cache directory, the
+ * engines then keep their defaults.
+ */
+const struct morse_tune *tune_get(struct start_options *options)
+{
+    static struct morse_tune tune;
+    static int have;
+    char dir[PATH_MAX], path[PATH_MAX + 16];
+    int n;
+
+    if (options->tune < 0)
+        return NULL;
+    if (have)
+        return &tune;
+    n = morse_cache_dir(dir, sizeof(dir), 1);
+    if (n < 0)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/tune.bin", dir);
+    if (options->tune > 0 || tune_load(&tune, path)) {
+        pr_dbg("calibrating into %s\n", path);
+        tune_calibrate(&tune, dir);
+        tune_store(&tune, path);
+    }
+    have = 1;
+    return &tune;
+}
+
+/*
+ * Threads worth starting for bytes of input in ntasks pieces converted
+ * with mode.  The speedup measured with every cpu is spread linearly over
+ * the counts in between.
+ */
+int tune_threads(const struct morse_tune *t, double bytes, size_t ntasks,
+                 int mode)
+{
+    double work = bytes * (mode == MORS_DECO ? t->decode_ns : t->encode_ns);
+    double best = work;
+    int n = 1;
+
+    for (uint32_t k = 2; k <= t->ncpu && k <= ntasks; k++) {
+        double speedup = 1 + (t->speedup - 1) * (k - 1) / (t->ncpu - 1);
+        double cost = work / speedup + k * t->thread_ns;
+
+        if (cost < best) {
+            best = cost;
+            n = k;
+        }
+    }
+    return n;
+}
+
+// Single file encoding, on every thread that pays for itself.
+void tune_display_message(struct start_options *options)
+{
+    const struct morse_tune *t = NULL;
+    int n = 1;
+
+    if (options->length >= TUNE_MIN && (t = tune_get(options)))
+        n = tune_threads(t, options->length,
+                         options->length / t->chunk + 1, MORS_ENCO);
+    if (n > 1)
+        display_message_parallel(options, n, t->chunk);
+    else
+        display_message(*options);
+}
+
+static void tune_print_choice(const struct morse_tune *t, size_t len)
+{
+    printf("  %8zuK  encode %2d threads  decode %2d threads\n", len >> 10,
+           tune_threads(t, len, len / t->chunk + 1, MORS_ENCO),
+           tune_threads(t, len, len / t->chunk + 1, MORS_DECO));
+}
+
+// --tune, measure again and show what was found.
+void tune_run(struct start_options *options)
+{
+    const struct morse_tune *t;
+
+    options->tune = 1;
+    t = tune_get(options);
+    if (!t) {
+        fprintf(stderr, "Error: no cache directory, set HOME or XDG_CACHE_HOME\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("cpus:      %u, %.2fx with all of them\n", t->ncpu, t->speedup);
+    printf("encode:    %.0f MB/s per thread, %uK chunks\n",
+           1e3 / t->encode_ns, t->chunk >> 10);
+    printf("decode:    %.0f MB/s per thread\n", 1e3 / t->decode_ns);
+    printf("thread:    %.1f us to start\n", t->thread_ns / 1e3);
+    printf("read:      read() files up to %uK, mmap() above\n",
+           t->read_max >> 10);
+    if (t->file_ns)
+        printf("batch:     %.1f us per small file, io_uring %s\n",
+               t->file_ns / 1e3, !t->uring_file_ns ? "not available"
+               : t->uring ? "faster" : "slower");
+    printf("choices:\n");
+    for (size_t len = TUNE_MIN; len <= (1 << 30); len *= 16)
+        tune_print_choice(t, len);
+}
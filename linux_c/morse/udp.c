@@ -0,0 +1,730 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Morse over UDP, morse --udp-send <host>[:port] [-s msg | -f file | --keyer]
+ *                 morse --udp-listen [<host>:]<port> [--jitter ms] [-g line]
+ *
+ * Every letter is one datagram (see MORSE_UDP_* in morse.h) carrying its
+ * sequence number, its start on the sender's clock and either its keying,
+ * the key down/up durations timing_schedule() gives at the sender's speed,
+ * or with --udp-letters just its code, keyed at the receiver's -w.  The
+ * letter itself comes along so the receiver can print what it keys.
+ *
+ * The sender paces the text by the schedule: letters starting within
+ * UDP_WINDOW_NS of each other go out together in one sendmmsg() as the
+ * first of them is due.  The keyer sends each letter as it starts keying.
+ *
+ * The receiver reads with recvmmsg() into a jitter buffer indexed by
+ * sequence number and plays a letter at its start plus the smallest
+ * transit seen so far plus the --jitter playout delay.  Letters never wait
+ * for a missing one before them, a letter that turns up after a later one
+ * was played is dropped, so a lost or reordered datagram costs at most
+ * that letter and never stalls the stream the way a TCP retransmit does.
+ * A letter arriving after its playout time is keyed as soon as the key is
+ * free and counted as late.  The end of a stream is reported on stderr
+ * with --latency.
+ *
+ * --udp-reorder sends every batch backwards, to try the jitter buffer on
+ * loopback.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "morse.h"
+
+#define UDP_BATCH 32			// datagrams per sendmmsg/recvmmsg
+#define UDP_WINDOW_NS 50000000ULL	// letters sent together
+#define UDP_SLOTS 256			// jitter buffer, in letters
+#define UDP_JITTER_MS 40		// default playout delay
+#define UDP_END_COPIES 3		// the end of a stream is sent this often
+#define UDP_TOS 0xb8			// DSCP EF
+#define UDP_DOWN 0x80000000U
+
+struct udp_letter {
+    int used, flags;
+    uint32_t seq;
+    uint64_t start_ns;			// sender clock
+    int64_t lead_ns;			// sent this long before start_ns
+    size_t nel, ncode, ntext;
+    struct timing_element el[2 * TIMING_MAX_ELEMENTS];
+    char code[MORSE_UDP_CODE_MAX + 1];
+    char text[MORSE_UDP_TEXT_MAX];
+};
+
+static struct udp_sender {
+    int fd;
+    uint32_t stream, seq;
+    uint64_t epoch;
+    int letters, reorder;
+    unsigned char buf[UDP_BATCH][MORSE_UDP_MAX];
+    uint64_t start[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct mmsghdr msg[UDP_BATCH];
+    unsigned n;
+} tx = { .fd = -1 };
+
+static uint64_t udp_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * host:port, [v6 address]:port, host or port alone with the other taken
+ * from the default.  Returns the socket, bound or connected.
+ */
+static int udp_socket(const char *spec, int listen)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_DGRAM }, *res, *ai;
+    char host[256], port[16];
+    const char *colon = strrchr(spec, ':');
+    int fd = -1, err, tos = UDP_TOS;
+
+    snprintf(port, sizeof(port), "%d", MORSE_UDP_PORT);
+    if (spec[0] == '[') {
+        const char *end = strchr(spec, ']');
+
+        if (!end) {
+            fprintf(stderr, "%s: missing ]\n", spec);
+            exit(EXIT_FAILURE);
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(end - spec - 1), spec + 1);
+        if (end[1] == ':')
+            snprintf(port, sizeof(port), "%s", end + 2);
+    } else if (colon && colon == strchr(spec, ':')) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    } else if (listen && strspn(spec, "0123456789") == strlen(spec)) {
+        snprintf(port, sizeof(port), "%s", spec);
+        host[0] = '\0';
+    } else {
+        snprintf(host, sizeof(host), "%s", spec);
+    }
+    if (listen)
+        hints.ai_flags = AI_PASSIVE;
+    err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    // Listening on any address, take both families on one IPv6 socket.
+    for (ai = res; ai && listen && !host[0]; ai = ai->ai_next) {
+        int off = 0;
+
+        if (ai->ai_family != AF_INET6)
+            continue;
+        fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            break;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    for (ai = fd == -1 ? res : NULL; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if ((listen ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                    : connect(fd, ai->ai_addr, ai->ai_addrlen)) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        perror(spec);
+        exit(EXIT_FAILURE);
+    }
+    // Best effort, ahead of bulk traffic on the LAN.
+    if (!ai || ai->ai_family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    else
+        setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    freeaddrinfo(res);
+    return fd;
+}
+
+void udp_sender_open(struct start_options *options)
+{
+    tx.fd = udp_socket(options->udp_send, 0);
+    tx.letters = options->udp_letters;
+    tx.reorder = options->udp_reorder;
+    tx.epoch = udp_now();
+    // Tells a restarted sender from a late datagram of the last run.
+    tx.stream = (uint32_t)(tx.epoch ^ (tx.epoch >> 32)) ^ (uint32_t)getpid() << 16;
+    for (unsigned i = 0; i < UDP_BATCH; i++) {
+        tx.iov[i].iov_base = tx.buf[i];
+        tx.msg[i].msg_hdr.msg_iov = &tx.iov[i];
+        tx.msg[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+void udp_send_flush(void)
+{
+    uint64_t now = udp_now();
+    unsigned done = 0;
+
+    // How long before its start each letter leaves, for the receiver.
+    for (unsigned i = 0; i < tx.n; i++) {
+        int64_t lead = ((int64_t)tx.start[i] - (int64_t)now) / 1000;
+
+        put32(tx.buf[i] + 20, lead < INT32_MIN ? INT32_MIN
+                              : lead > INT32_MAX ? INT32_MAX : lead);
+    }
+
+    if (tx.reorder)
+        for (unsigned i = 0; i < tx.n / 2; i++) {
+            struct iovec t = tx.iov[i];
+
+            tx.iov[i] = tx.iov[tx.n - 1 - i];
+            tx.iov[tx.n - 1 - i] = t;
+        }
+    while (done < tx.n) {
+        int n = sendmmsg(tx.fd, tx.msg + done, tx.n - done, 0);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            // Nobody listening yet is not our problem, the next letter may do.
+            if (errno != ECONNREFUSED)
+                perror("Error sending datagrams");
+            break;
+        }
+        done += n;
+    }
+    for (unsigned i = 0; i < UDP_BATCH; i++)
+        tx.iov[i].iov_base = tx.buf[i];
+    tx.n = 0;
+}
+
+static void udp_queue(int flags, uint32_t seq, uint64_t t,
+                      const char *const *codes, int ncodes,
+                      const struct timing_element *el, size_t nel,
+                      const char *text, size_t ntext)
+{
+    unsigned char *p = tx.buf[tx.n], *q;
+    size_t ncode = 0;
+
+    if (tx.letters)
+        nel = 0;
+    else
+        ncodes = 0;
+    if (ntext > MORSE_UDP_TEXT_MAX)
+        ntext = MORSE_UDP_TEXT_MAX;
+
+    p[0] = MORSE_UDP_MAGIC >> 8;
+    p[1] = MORSE_UDP_MAGIC & 0xff;
+    p[2] = MORSE_UDP_VERSION;
+    p[3] = flags;
+    put32(p + 4, tx.stream);
+    put32(p + 8, seq);
+    tx.start[tx.n] = t;
+    t = (t - tx.epoch) / 1000;
+    put32(p + 12, t >> 32);
+    put32(p + 16, t);
+    q = p + MORSE_UDP_HDR_SIZE;
+    for (size_t i = 0; i < nel; i++, q += 4) {
+        uint64_t us = el[i].ns / 1000;
+
+        put32(q, (us < UDP_DOWN ? us : UDP_DOWN - 1) | (el[i].down ? UDP_DOWN : 0));
+    }
+    for (int i = 0; i < ncodes; i++) {
+        size_t k = strlen(codes[i]);
+
+        if (i)
+            q[ncode++] = ' ';
+        memcpy(q + ncode, codes[i], k);
+        ncode += k;
+    }
+    q += ncode;
+    memcpy(q, text, ntext);
+    p[24] = nel;
+    p[25] = ncode;
+    p[26] = ntext;
+    tx.iov[tx.n].iov_len = q + ntext - p;
+    if (++tx.n == UDP_BATCH)
+        udp_send_flush();
+}
+
+/*
+ * Queue one letter starting at t on CLOCK_MONOTONIC, keyed as el or,
+ * with --udp-letters, by its codes.
+ */
+void udp_send_letter(const char *const *codes, int ncodes,
+                     const struct timing_element *el, size_t nel,
+                     uint64_t t, const char *text, size_t ntext)
+{
+    udp_queue(0, tx.seq++, t, codes, ncodes, el, nel, text, ntext);
+}
+
+// End of the stream at t, after the last letter.
+void udp_send_end(uint64_t t)
+{
+    uint32_t seq = tx.seq++;
+
+    for (int i = 0; i < UDP_END_COPIES; i++)
+        udp_queue(MORSE_UDP_END, seq, t, NULL, 0, NULL, 0, NULL, 0);
+    udp_send_flush();
+}
+
+static void udp_sleep_until(uint64_t t)
+{
+    struct timespec ts = { .tv_sec = t / 1000000000ULL,
+                           .tv_nsec = t % 1000000000ULL };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static char *udp_read_input(struct start_options *options, size_t *len)
+{
+    size_t size = 65536, have = 0;
+    char *buf;
+    ssize_t n;
+    int fd;
+
+    if (options->message) {
+        *len = strlen(options->message);
+        return options->message;
+    }
+    fd = strcmp(options->filename, "-")
+       ? open(options->filename, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd == -1) {
+        perror(options->filename);
+        exit(EXIT_FAILURE);
+    }
+    buf = malloc(size);
+    for (;;) {
+        if (!buf) {
+            perror("Error allocating input buffer");
+            exit(EXIT_FAILURE);
+        }
+        n = read(fd, buf + have, size - have);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror(options->filename);
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        have += n;
+        if (have == size)
+            buf = realloc(buf, size *= 2);
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    *len = have;
+    return buf;
+}
+
+// Send -s or -f paced by its keying, returns when the last letter is out.
+void udp_send_run(struct start_options *options)
+{
+    struct timing_keying k;
+    struct timing_element el[2 * TIMING_MAX_ELEMENTS];
+    size_t len, n;
+    char *in;
+    uint64_t t, batch = 0;
+
+    hmorse_init();
+    timing_keying_init(&k, options->wpm, options->farnsworth);
+    in = udp_read_input(options, &len);
+    udp_sender_open(options);
+    t = tx.epoch;
+
+    for (size_t i = 0; i < len; i += n) {
+        const char *codes[2];
+        size_t nel = 0;
+        int ncodes;
+
+        n = morse_letter_codes(in + i, len - i, codes, &ncodes);
+        if (!ncodes)
+            continue;
+        for (int j = 0; j < ncodes; j++)
+            nel += timing_schedule(&k, codes[j], el + nel);
+
+        if (tx.n && t >= batch + UDP_WINDOW_NS) {
+            udp_sleep_until(batch);
+            udp_send_flush();
+        }
+        if (!tx.n)
+            batch = t;
+        udp_send_letter(codes, ncodes, el, nel, t, in + i, n);
+        for (size_t j = 0; j < nel; j++)
+            t += el[j].ns;
+    }
+    if (tx.n) {
+        udp_sleep_until(batch);
+        udp_send_flush();
+    }
+    udp_sleep_until(t);
+    udp_send_end(t);
+    if (in != options->message)
+        free(in);
+    close(tx.fd);
+}
+
+/*
+ * Receiving side.
+ */
+static struct udp_receiver {
+    struct timing_keying timing;
+    int fd, gpio_fd;
+    uint64_t delay_ns;
+    // stream being played
+    int active, ended;
+    uint32_t stream, next_seq, max_seq;
+    int64_t base;			// smallest arrival - start seen
+    struct udp_letter slot[UDP_SLOTS];
+    // letter being keyed
+    struct udp_letter *cur;
+    size_t pos;
+    uint64_t next_ns, free_ns;
+    // counters of the stream
+    int measure;
+    size_t received, played, lost, reordered, duplicates, late;
+    int64_t transit_min, transit_max;
+    double jitter;			// RFC 3550 interarrival jitter, ns
+    int64_t last_transit;
+    uint64_t keyed_sum, keyed_max;	// first key down after its playout time
+} rx;
+
+static void udp_print(const char *s, size_t len)
+{
+    if (write(STDOUT_FILENO, s, len) == -1)
+        perror("Error writing output");
+}
+
+static void udp_report(void)
+{
+    if (!rx.measure || !rx.received)
+        return;
+    fprintf(stderr, "udp: stream %08x, %zu datagrams, %zu letters played, "
+                    "%zu lost, %zu reordered, %zu duplicate, %zu late\n"
+                    "  playout delay %.1f ms  transit spread %.1f ms  "
+                    "jitter %.3f ms  keyed after due avg %.1f us max %.1f us\n",
+            rx.stream, rx.received, rx.played, rx.lost, rx.reordered,
+            rx.duplicates, rx.late, rx.delay_ns / 1e6,
+            (rx.transit_max - rx.transit_min) / 1e6, rx.jitter / 1e6,
+            rx.played ? rx.keyed_sum / 1e3 / rx.played : 0.0, rx.keyed_max / 1e3);
+}
+
+static void udp_stream_start(uint32_t stream)
+{
+    udp_report();
+    memset(rx.slot, 0, sizeof(rx.slot));
+    rx.active = 1;
+    rx.ended = 0;
+    rx.stream = stream;
+    rx.next_seq = rx.max_seq = 0;
+    rx.received = rx.played = rx.lost = rx.reordered = rx.duplicates = rx.late = 0;
+    rx.jitter = 0;
+    rx.keyed_sum = rx.keyed_max = 0;
+}
+
+static uint64_t udp_due(const struct udp_letter *l)
+{
+    return l->start_ns + rx.base + rx.delay_ns;
+}
+
+static int udp_parse(struct udp_letter *l, const unsigned char *p, size_t len,
+                     uint32_t *stream)
+{
+    const unsigned char *q = p + MORSE_UDP_HDR_SIZE;
+
+    if (len < MORSE_UDP_HDR_SIZE || get32(p) >> 16 != MORSE_UDP_MAGIC
+        || p[2] != MORSE_UDP_VERSION || p[24] > 2 * TIMING_MAX_ELEMENTS
+        || p[25] > MORSE_UDP_CODE_MAX || p[26] > MORSE_UDP_TEXT_MAX
+        || len != MORSE_UDP_HDR_SIZE + 4U * p[24] + p[25] + p[26])
+        return -1;
+    l->flags = p[3];
+    *stream = get32(p + 4);
+    l->seq = get32(p + 8);
+    l->start_ns = ((uint64_t)get32(p + 12) << 32 | get32(p + 16)) * 1000;
+    l->lead_ns = (int64_t)(int32_t)get32(p + 20) * 1000;
+    l->nel = p[24];
+    l->ncode = p[25];
+    l->ntext = p[26];
+    for (size_t i = 0; i < l->nel; i++, q += 4) {
+        uint32_t v = get32(q);
+
+        l->el[i].down = !!(v & UDP_DOWN);
+        l->el[i].ns = (uint64_t)(v & ~UDP_DOWN) * 1000;
+    }
+    memcpy(l->code, q, l->ncode);
+    l->code[l->ncode] = '\0';
+    memcpy(l->text, q + l->ncode, l->ntext);
+    return 0;
+}
+
+// Keying of a letter sent by code, at our own speed.
+static void udp_schedule_code(struct udp_letter *l)
+{
+    char *code = l->code, *next;
+
+    l->nel = 0;
+    if (!strcmp(code, " ")) {
+        l->nel = timing_schedule(&rx.timing, code, l->el);
+        return;
+    }
+    for (int i = 0; i < 2 && *code; i++, code = next) {
+        next = code + strcspn(code, " ");
+        if (*next)
+            *next++ = '\0';
+        l->nel += timing_schedule(&rx.timing, code, l->el + l->nel);
+    }
+}
+
+static void udp_receive(const unsigned char *p, size_t len, uint64_t now)
+{
+    struct udp_letter l, *s;
+    uint32_t stream;
+    int64_t transit;
+
+    if (udp_parse(&l, p, len, &stream)) {
+        pr_dbg("udp: bad datagram of %zu bytes\n", len);
+        return;
+    }
+    if (rx.active && stream == rx.stream && rx.ended)
+        return;				// copies of the end
+    if (!rx.active || stream != rx.stream)
+        udp_stream_start(stream);
+    rx.received++;
+
+    // Against when it was sent, a letter sent early is not a fast network.
+    transit = (int64_t)(now - l.start_ns) + l.lead_ns;
+    if (rx.received == 1) {
+        rx.base = rx.transit_min = rx.transit_max = rx.last_transit = transit;
+    } else {
+        int64_t d = transit - rx.last_transit;
+
+        rx.jitter += ((d < 0 ? -d : d) - rx.jitter) / 16;
+        rx.last_transit = transit;
+        if (transit < rx.transit_min)
+            rx.transit_min = transit;
+        if (transit > rx.transit_max)
+            rx.transit_max = transit;
+        if (transit < rx.base)
+            rx.base = transit;
+    }
+
+    s = &rx.slot[l.seq % UDP_SLOTS];
+    if (l.seq < rx.next_seq || (s->used && s->seq == l.seq)) {
+        rx.duplicates += !(l.flags & MORSE_UDP_END);
+        return;
+    }
+    if (l.seq - rx.next_seq >= UDP_SLOTS) {
+        // Too far ahead for the buffer, everything before it is gone.
+        rx.lost += l.seq - rx.next_seq;
+        memset(rx.slot, 0, sizeof(rx.slot));
+        rx.next_seq = l.seq;
+    }
+    if (l.seq < rx.max_seq)
+        rx.reordered++;
+    else
+        rx.max_seq = l.seq;
+    if (!l.nel && l.ncode)
+        udp_schedule_code(&l);
+    l.used = 1;
+    if (now > udp_due(&l))
+        rx.late++;
+    *s = l;
+}
+
+static void udp_key(int down)
+{
+    if (rx.gpio_fd != -1)
+        gpio_set(rx.gpio_fd, down);
+}
+
+// Start keying l at t.
+static void udp_play(struct udp_letter *l, uint64_t t, uint64_t now)
+{
+    uint64_t after = now > t ? now - t : 0;
+
+    rx.played++;
+    rx.keyed_sum += after;
+    if (after > rx.keyed_max)
+        rx.keyed_max = after;
+    udp_print(l->text, l->ntext);
+    if (!l->nel) {
+        l->used = 0;
+        return;
+    }
+    rx.cur = l;
+    rx.pos = 0;
+    rx.next_ns = t + l->el[0].ns;
+    udp_key(l->el[0].down);
+}
+
+static void udp_advance(uint64_t now)
+{
+    while (rx.cur && now >= rx.next_ns) {
+        if (++rx.pos < rx.cur->nel) {
+            rx.next_ns += rx.cur->el[rx.pos].ns;
+            udp_key(rx.cur->el[rx.pos].down);
+            continue;
+        }
+        rx.free_ns = rx.next_ns;
+        rx.cur->used = 0;
+        rx.cur = NULL;
+    }
+}
+
+/*
+ * Play the first buffered letter once it is due, skipping any missing
+ * before it.  Returns when the next one is due, 0 for nothing buffered.
+ */
+static uint64_t udp_next(uint64_t now)
+{
+    while (!rx.cur) {
+        struct udp_letter *l = NULL;
+        uint64_t due, t;
+        uint32_t seq;
+
+        for (seq = rx.next_seq; seq <= rx.max_seq && seq - rx.next_seq < UDP_SLOTS; seq++) {
+            struct udp_letter *s = &rx.slot[seq % UDP_SLOTS];
+
+            if (s->used && s->seq == seq) {
+                l = s;
+                break;
+            }
+        }
+        if (!l)
+            return 0;
+        due = udp_due(l);
+        if (due > now)
+            return due;
+
+        rx.lost += seq - rx.next_seq;
+        rx.next_seq = seq + 1;
+        if (l->flags & MORSE_UDP_END) {
+            l->used = 0;
+            udp_report();
+            rx.ended = 1;
+            rx.received = 0;
+            return 0;
+        }
+        // Keep the letter's own timing unless it is behind.
+        t = due > rx.free_ns ? due : rx.free_ns;
+        if (now > t + 1000000)
+            t = now;
+        udp_play(l, t, now);
+        udp_advance(now);
+    }
+    return rx.next_ns;
+}
+
+void udp_listen_run(struct start_options *options)
+{
+    static unsigned char buf[UDP_BATCH][MORSE_UDP_MAX];
+    struct iovec iov[UDP_BATCH];
+    struct mmsghdr msg[UDP_BATCH];
+    struct pollfd pfd;
+
+    hmorse_init();
+    timing_keying_init(&rx.timing, options->wpm, options->farnsworth);
+    rx.fd = udp_socket(options->udp_listen, 1);
+    rx.gpio_fd = options->gpio_spec ? gpio_open_output(options->gpio_spec) : -1;
+    rx.delay_ns = (uint64_t)(options->jitter ? options->jitter : UDP_JITTER_MS) * 1000000;
+    rx.measure = options->latency;
+    pfd.fd = rx.fd;
+    pfd.events = POLLIN;
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+    if (rx.measure)
+        atexit(udp_report);
+
+    for (;;) {
+        uint64_t now = udp_now(), wake;
+        struct timespec ts, *tsp = NULL;
+        int r;
+
+        udp_advance(now);
+        wake = udp_next(now);
+        if (wake) {
+            uint64_t left = wake > now ? wake - now : 0;
+
+            ts.tv_sec = left / 1000000000ULL;
+            ts.tv_nsec = left % 1000000000ULL;
+            tsp = &ts;
+        }
+        r = ppoll(&pfd, 1, tsp, NULL);
+        if (r == -1 && errno != EINTR) {
+            perror("Error waiting for datagrams");
+            exit(EXIT_FAILURE);
+        }
+        if (r <= 0)
+            continue;
+
+        for (unsigned i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = sizeof(buf[i]);
+            memset(&msg[i].msg_hdr, 0, sizeof(msg[i].msg_hdr));
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        r = recvmmsg(rx.fd, msg, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (r == -1) {
+            if (errno != EINTR && errno != EAGAIN)
+                perror("Error receiving datagrams");
+            continue;
+        }
+        now = udp_now();
+        for (int i = 0; i < r; i++)
+            udp_receive(buf[i], msg[i].msg_len, now);
+    }
+}
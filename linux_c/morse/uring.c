@@ -0,0 +1,479 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * io_uring engine for batch mode (--io-uring).
+ *
+ * Each thread drives its own ring with URING_SLOTS files in flight.  A
+ * slot owns one registered input buffer and one registered output buffer
+ * and walks its file chunk by chunk: READ_FIXED a chunk, convert it while
+ * the other slots' reads and writes are in the kernel, WRITE_FIXED the
+ * result, read the next chunk.  Both files of a slot are installed in the
+ * ring's registered file table so the kernel skips the fd lookup and
+ * reference counting on every request.
+ *
+ * The ring is driven through the raw system calls so there is no library
+ * dependency.  When the kernel has no io_uring (or it is disabled, or the
+ * buffers can not be pinned) uring_batch_run() returns -1 before touching
+ * any file and batch mode carries on with the mmap path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "morse.h"
+
+#define URING_SLOTS 16
+#define URING_CHUNK (64 * 1024)
+#define URING_OUT_SIZE (MORSE_ENCODE_BOUND(URING_CHUNK) + 1)
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+};
+
+enum {
+    SLOT_IDLE,
+    SLOT_READ,
+    SLOT_WRITE,
+};
+
+struct uring_slot {
+    int state;
+    const char *name;
+    char *in, *out;			// registered buffers 2n and 2n + 1
+    off_t in_off, out_off, size;
+    size_t out_len, out_done;
+    int eof;
+    struct morse_decoder dec;
+};
+
+static struct {
+    struct start_options *options;
+    atomic_int next;			// next file to start
+    atomic_int failed;
+} ub;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned wait,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void uring_exit(struct uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd == -1)
+        return -1;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ring = r->sq_ring;
+    else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto err;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto err;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return 0;
+
+err:
+    uring_exit(r);
+    return -1;
+}
+
+// Queue a fixed buffer read or write on a registered file.
+static void uring_prep(struct uring *r, int op, int file, void *buf,
+                       unsigned len, off_t off, unsigned buf_index,
+                       uint64_t data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf_index;
+    sqe->user_data = data;
+    r->sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *)r->sq_tail, tail + 1,
+                          memory_order_release);
+    r->to_submit++;
+}
+
+static int uring_set_file(struct uring *r, unsigned index, int fd)
+{
+    struct io_uring_files_update up = {
+        .offset = index,
+        .fds = (uintptr_t)&fd,
+    };
+
+    return sys_io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1)
+           == 1 ? 0 : -1;
+}
+
+static void slot_fail(struct uring *r, int n, struct uring_slot *s, int err)
+{
+    fprintf(stderr, "%s: %s\n", s->name, strerror(err));
+    atomic_fetch_add(&ub.failed, 1);
+    uring_set_file(r, 2 * n, -1);
+    uring_set_file(r, 2 * n + 1, -1);
+    s->state = SLOT_IDLE;
+}
+
+static void slot_read(struct uring *r, int n, struct uring_slot *s)
+{
+    s->state = SLOT_READ;
+    uring_prep(r, IORING_OP_READ_FIXED, 2 * n, s->in, URING_CHUNK,
+               s->in_off, 2 * n, n);
+}
+
+static void slot_write(struct uring *r, int n, struct uring_slot *s)
+{
+    s->state = SLOT_WRITE;
+    uring_prep(r, IORING_OP_WRITE_FIXED, 2 * n + 1, s->out + s->out_done,
+               s->out_len - s->out_done, s->out_off, 2 * n + 1, n);
+}
+
+// Open the next file of the batch in this slot and queue its first read.
+static void slot_start(struct uring *r, int n, struct uring_slot *s)
+{
+    struct start_options *o = ub.options;
+    char path[PATH_MAX];
+    struct stat st;
+    int i, in, out;
+
+    while ((i = atomic_fetch_add(&ub.next, 1)) < o->nfiles) {
+        s->name = o->files[i];
+        if (batch_output_path(o->mode, o->outdir, s->name, path, sizeof(path))) {
+            errno = ENAMETOOLONG;
+            goto fail;
+        }
+        in = open(s->name, O_RDONLY | O_CLOEXEC);
+        if (in == -1)
+            goto fail;
+        if (fstat(in, &st) == -1) {
+            close(in);
+            goto fail;
+        }
+        out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out == -1) {
+            close(in);
+            goto fail;
+        }
+        // The registered table keeps its own reference.
+        if (uring_set_file(r, 2 * n, in) || uring_set_file(r, 2 * n + 1, out)) {
+            close(in);
+            close(out);
+            goto fail;
+        }
+        close(in);
+        close(out);
+
+        s->in_off = s->out_off = 0;
+        s->size = st.st_size;
+        s->eof = 0;
+        morse_decoder_init(&s->dec);
+        slot_read(r, n, s);
+        return;
+fail:
+        fprintf(stderr, "%s: %s\n", s->name, strerror(errno));
+        atomic_fetch_add(&ub.failed, 1);
+    }
+    s->state = SLOT_IDLE;
+}
+
+// A chunk (possibly empty at EOF) has been read, convert and write it.
+static void slot_convert(struct uring *r, int n, struct uring_slot *s,
+                         size_t len)
+{
+    uint64_t start = morse_stats_chunk_start();
+
+    if (ub.options->mode == MORS_ENCO) {
+        // Leave a letter or prosign cut by the chunk end to the next read.
+        if (!s->eof) {
+            size_t whole = encode_boundary(s->in, len);
+
+            if (whole)
+                len = whole;
+        }
+        s->out_len = morse_encode_buf(s->in, len, s->out);
+        if (s->eof)
+            s->out[s->out_len++] = '\n';
+    } else {
+        s->out_len = morse_decoder_feed(&s->dec, s->in, len, s->out);
+        if (s->eof)
+            s->out_len += morse_decoder_finish(&s->dec, s->out + s->out_len);
+    }
+    morse_stats_chunk_end(start);
+    s->in_off += len;
+    s->out_done = 0;
+
+    if (s->out_len)
+        slot_write(r, n, s);
+    else if (!s->eof)
+        slot_read(r, n, s);
+    else {
+        uring_set_file(r, 2 * n, -1);
+        uring_set_file(r, 2 * n + 1, -1);
+        slot_start(r, n, s);
+    }
+}
+
+static void slot_complete(struct uring *r, int n, struct uring_slot *s, int res)
+{
+    if (res < 0) {
+        slot_fail(r, n, s, -res);
+        slot_start(r, n, s);
+        return;
+    }
+
+    if (s->state == SLOT_READ) {
+        // Skip the extra zero length read for files that did not grow.
+        s->eof = res == 0 || s->in_off + res >= s->size;
+        slot_convert(r, n, s, res);
+        return;
+    }
+
+    s->out_done += res;
+    s->out_off += res;
+    morse_stats_flush(res);
+    if (s->out_done < s->out_len)
+        slot_write(r, n, s);		// short write, push the rest
+    else if (!s->eof)
+        slot_read(r, n, s);
+    else {
+        uring_set_file(r, 2 * n, -1);
+        uring_set_file(r, 2 * n + 1, -1);
+        slot_start(r, n, s);
+    }
+}
+
+struct uring_thread {
+    pthread_t thread;
+    struct uring ring;
+    char *mem;
+    int ready;
+};
+
+static int uring_thread_init(struct uring_thread *t)
+{
+    struct iovec iov[2 * URING_SLOTS];
+    int fds[2 * URING_SLOTS];
+    size_t size = URING_SLOTS * (URING_CHUNK + URING_OUT_SIZE);
+
+    if (uring_init(&t->ring, 2 * URING_SLOTS))
+        return -1;
+
+    t->mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t->mem == MAP_FAILED)
+        goto err;
+    for (int i = 0; i < URING_SLOTS; i++) {
+        iov[2 * i].iov_base = t->mem + i * (URING_CHUNK + URING_OUT_SIZE);
+        iov[2 * i].iov_len = URING_CHUNK;
+        iov[2 * i + 1].iov_base = (char *)iov[2 * i].iov_base + URING_CHUNK;
+        iov[2 * i + 1].iov_len = URING_OUT_SIZE;
+        fds[2 * i] = fds[2 * i + 1] = -1;
+    }
+    if (sys_io_uring_register(t->ring.fd, IORING_REGISTER_BUFFERS,
+                              iov, 2 * URING_SLOTS) == -1
+        || sys_io_uring_register(t->ring.fd, IORING_REGISTER_FILES,
+                                 fds, 2 * URING_SLOTS) == -1) {
+        pr_err("io_uring register: %s\n", strerror(errno));
+        munmap(t->mem, size);
+        goto err;
+    }
+    t->ready = 1;
+    return 0;
+
+err:
+    uring_exit(&t->ring);
+    return -1;
+}
+
+static void *uring_thread(void *arg)
+{
+    struct uring_thread *t = arg;
+    struct uring *r = &t->ring;
+    struct uring_slot slots[URING_SLOTS];
+    int busy = 0;
+
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < URING_SLOTS; i++) {
+        slots[i].in = t->mem + i * (URING_CHUNK + URING_OUT_SIZE);
+        slots[i].out = slots[i].in + URING_CHUNK;
+        slot_start(r, i, &slots[i]);
+        busy += slots[i].state != SLOT_IDLE;
+    }
+
+    while (busy) {
+        unsigned head, tail;
+        int ret;
+
+        ret = sys_io_uring_enter(r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error in io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        r->to_submit -= ret;
+
+        head = *r->cq_head;
+        tail = atomic_load_explicit((_Atomic unsigned *)r->cq_tail,
+                                    memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int n = cqe->user_data;
+
+            slot_complete(r, n, &slots[n], cqe->res);
+        }
+        atomic_store_explicit((_Atomic unsigned *)r->cq_head, head,
+                              memory_order_release);
+
+        busy = 0;
+        for (int i = 0; i < URING_SLOTS; i++)
+            busy += slots[i].state != SLOT_IDLE;
+    }
+
+    munmap(t->mem, URING_SLOTS * (URING_CHUNK + URING_OUT_SIZE));
+    uring_exit(r);
+    return NULL;
+}
+
+/*
+ * Run the whole batch on io_uring.  Returns -1 without doing anything if
+ * io_uring can not be used, otherwise the number of failed files.  Every
+ * call starts from the first file again.
+ */
+int uring_batch_run(struct start_options *options, int nthreads)
+{
+    struct uring_thread *threads;
+    int started = 0;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!threads)
+        return -1;
+    for (int i = 0; i < nthreads; i++)
+        if (uring_thread_init(&threads[i]))
+            break;
+    if (!threads[0].ready) {
+        free(threads);
+        return -1;
+    }
+
+    ub.options = options;
+    atomic_store(&ub.next, 0);
+    atomic_store(&ub.failed, 0);
+    for (int i = 0; i < nthreads && threads[i].ready; i++) {
+        if (pthread_create(&threads[i].thread, NULL, uring_thread, &threads[i])) {
+            perror("Error creating thread");
+            exit(EXIT_FAILURE);
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i].thread, NULL);
+    free(threads);
+    return ub.failed;
+}
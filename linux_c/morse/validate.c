@@ -0,0 +1,565 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Input validation, morse -e|-d --validate[=N] and the --strict pre-pass.
+ *
+ * Text bytes without a code are encoded to nothing and morse tokens
+ * without a letter decode to a space, both silently.  --validate scans
+ * the inputs instead of converting them and reports, per input, how many
+ * there are and the offsets of the first N (10 by default); it exits 1
+ * when any input has one.  --strict runs the same scan before converting
+ * and refuses to start when it finds anything, so a long batch does not
+ * fail hours in.  Without --strict the conversion never scans twice.
+ * A gzip or zstd -f file is scanned decompressed, as the pipeline
+ * converts it; batch mode converts its files as they are and so they are
+ * scanned raw.
+ *
+ * Text is reported by letter, a UTF-8 letter with no code counts once at
+ * its first byte.  In morse a byte that is neither a symbol nor a
+ * separator is a stray byte, the token around it is not counted again.
+ *
+ * The scan looks at 64 bytes at a time as bit masks, built with SSE2
+ * compares where available.  For text the ranges A-Z, a-z and 0-9 and
+ * white space are good in one compare each when the table has a code
+ * for every letter of the range; only the other bytes are looked up one
+ * by one (punctuation, UTF-8 letters, <prosigns>).  For morse the dot,
+ * dash and separator masks cut the tokens, and a token's dashes are its
+ * key into a bitmap of the codes that have a letter, built once from the
+ * decoder itself, so a token costs a few bit operations.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define VALIDATE_BLOCK 64
+#define VALIDATE_READ (1 << 20)		// streams are scanned in pieces this big
+
+enum { TEXT_GOOD, TEXT_BAD, TEXT_PROSIGN };
+
+static uint8_t text_class[128];
+static int text_ranges;			// VALIDATE_UPPER... that are all good
+static uint64_t token_valid[(2 << MORSE_TOKEN_MAX) / 64];
+
+#define VALIDATE_UPPER 1
+#define VALIDATE_LOWER 2
+#define VALIDATE_DIGIT 4
+
+static void validate_init(void)
+{
+    static int built;
+    char tok[MORSE_TOKEN_MAX + 1], out[MORSE_TOKEN_MAX + 3];
+
+    if (built)
+        return;
+    built = 1;
+    hmorse_init();
+
+    for (int c = 0; c < 128; c++)
+        text_class[c] = *morse_lookup(c) ? TEXT_GOOD : TEXT_BAD;
+    text_class[' '] = text_class['\n'] = text_class['\r'] = TEXT_GOOD;
+    text_class['\t'] = TEXT_GOOD;
+    if (morse_nprosigns)
+        text_class['<'] = TEXT_PROSIGN;
+    text_ranges = VALIDATE_UPPER | VALIDATE_LOWER | VALIDATE_DIGIT;
+    for (int c = 'A'; c <= 'Z'; c++)
+        if (text_class[c] != TEXT_GOOD)
+            text_ranges &= ~VALIDATE_UPPER;
+    for (int c = 'a'; c <= 'z'; c++)
+        if (text_class[c] != TEXT_GOOD)
+            text_ranges &= ~VALIDATE_LOWER;
+    for (int c = '0'; c <= '9'; c++)
+        if (text_class[c] != TEXT_GOOD)
+            text_ranges &= ~VALIDATE_DIGIT;
+
+    // Key of a token: a 1 above its symbols, a dash is a 1 bit, first lowest.
+    for (int n = 1; n <= MORSE_TOKEN_MAX; n++)
+        for (uint32_t bits = 0; bits < 1u << n; bits++) {
+            uint32_t key = 1u << n | bits;
+
+            for (int i = 0; i < n; i++)
+                tok[i] = bits >> i & 1 ? '-' : '.';
+            tok[n] = '\0';
+            if (morse_token_letter(tok, out))
+                token_valid[key / 64] |= 1ULL << key % 64;
+        }
+}
+
+static void validate_add(uint64_t *count, uint64_t *at, size_t max,
+                         uint64_t off)
+{
+    if (*count < max)
+        at[*count] = off;
+    (*count)++;
+}
+
+// Masks of n bytes, bits from n on are separators (morse) or good (text).
+#ifdef __SSE2__
+static inline uint64_t mask_eq(const char *in, char c)
+{
+    __m128i v = _mm_set1_epi8(c);
+    uint64_t m = 0;
+
+    for (int k = 0; k < 4; k++)
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                 _mm_loadu_si128((const __m128i *)(in + 16 * k)), v)) << 16 * k;
+    return m;
+}
+
+static inline __m128i range16(__m128i x, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+}
+
+static inline uint64_t mask_text_good(const char *in)
+{
+    uint64_t m = 0;
+
+    for (int k = 0; k < 4; k++) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + 16 * k));
+        __m128i g = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+
+        if (text_ranges & VALIDATE_UPPER)
+            g = _mm_or_si128(g, range16(x, 'A', 'Z'));
+        if (text_ranges & VALIDATE_LOWER)
+            g = _mm_or_si128(g, range16(x, 'a', 'z'));
+        if (text_ranges & VALIDATE_DIGIT)
+            g = _mm_or_si128(g, range16(x, '0', '9'));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(g) << 16 * k;
+    }
+    return m;
+}
+#endif
+
+static inline int text_fast(unsigned char c)
+{
+    return c == ' ' || c == '\n'
+        || ((text_ranges & VALIDATE_UPPER) && c - 'A' < 26u)
+        || ((text_ranges & VALIDATE_LOWER) && c - 'a' < 26u)
+        || ((text_ranges & VALIDATE_DIGIT) && c - '0' < 10u);
+}
+
+static void morse_masks(const char *in, size_t n, uint64_t *dot,
+                        uint64_t *dash, uint64_t *sep)
+{
+    uint64_t tail = n < VALIDATE_BLOCK ? ~0ULL << n : 0;
+
+#ifdef __SSE2__
+    if (n == VALIDATE_BLOCK) {
+        *dot = mask_eq(in, '.');
+        *dash = mask_eq(in, '-');
+        *sep = mask_eq(in, ' ') | mask_eq(in, '\n') | mask_eq(in, '\r')
+             | mask_eq(in, '\t');
+        return;
+    }
+#endif
+    *dot = *dash = 0;
+    *sep = tail;
+    for (size_t i = 0; i < n; i++) {
+        char c = in[i];
+
+        *dot |= (uint64_t)(c == '.') << i;
+        *dash |= (uint64_t)(c == '-') << i;
+        *sep |= (uint64_t)(c == ' ' || c == '\n' || c == '\r' || c == '\t') << i;
+    }
+}
+
+static uint64_t text_mask(const char *in, size_t n)
+{
+    uint64_t good = n < VALIDATE_BLOCK ? ~0ULL << n : 0;
+
+#ifdef __SSE2__
+    if (n == VALIDATE_BLOCK)
+        return mask_text_good(in);
+#endif
+    for (size_t i = 0; i < n; i++)
+        good |= (uint64_t)text_fast(in[i]) << i;
+    return good;
+}
+
+static size_t validate_prosign(const char *in, size_t len)
+{
+    for (size_t i = 0; i < morse_nprosigns; i++) {
+        struct morse_prosign *ps = &morse_prosigns[i];
+
+        if (ps->len + 2 <= len && in[ps->len + 1] == '>'
+            && !memcmp(in + 1, ps->name, ps->len))
+            return ps->len + 2;
+    }
+    return 0;
+}
+
+static void validate_text(struct morse_validate *v, const char *in,
+                          size_t len, uint64_t base)
+{
+    size_t skip = 0;			// bytes of a letter or prosign already seen
+
+    for (size_t off = 0; off < len; off += VALIDATE_BLOCK) {
+        size_t n = len - off < VALIDATE_BLOCK ? len - off : VALIDATE_BLOCK;
+        uint64_t slow = ~text_mask(in + off, n);
+
+        for (; slow; slow &= slow - 1) {
+            size_t i = off + __builtin_ctzll(slow), k;
+            unsigned char c = in[i];
+            const char *codes[2];
+            uint32_t cp;
+
+            if (i < skip)
+                continue;
+            if (c < 0x80) {
+                if (text_class[c] == TEXT_PROSIGN
+                    && (k = validate_prosign(in + i, len - i)))
+                    skip = i + k;
+                else if (text_class[c] == TEXT_BAD
+                         || (text_class[c] == TEXT_PROSIGN && !*morse_lookup(c)))
+                    validate_add(&v->bad_chars, v->char_at, v->max, base + i);
+                continue;
+            }
+            k = utf8_decode((const unsigned char *)in + i, len - i, &cp);
+            if (!k || !alphabet_encode(cp, codes))
+                validate_add(&v->bad_chars, v->char_at, v->max, base + i);
+            skip = i + (k ? k : 1);
+        }
+    }
+}
+
+// A token with junk in it is already reported by its stray bytes.
+static inline int token_ok(uint64_t len, uint64_t bits, int junk)
+{
+    uint32_t key;
+
+    if (junk)
+        return 1;
+    if (len > MORSE_TOKEN_MAX)
+        return 0;
+    key = 1u << len | bits;
+    return token_valid[key / 64] >> key % 64 & 1;
+}
+
+static void validate_morse(struct morse_validate *v, const char *in,
+                           size_t len, uint64_t base)
+{
+    uint64_t tok_at = 0, tok_bits = 0, tok_len = 0;
+    int tok_junk = 0, open = 0;		// a token runs up to the block edge
+
+    for (size_t off = 0; off < len; off += VALIDATE_BLOCK) {
+        size_t n = len - off < VALIDATE_BLOCK ? len - off : VALIDATE_BLOCK;
+        uint64_t dot, dash, sep, junk, sym;
+
+        morse_masks(in + off, n, &dot, &dash, &sep);
+        sym = ~sep;
+        junk = sym & ~(dot | dash);
+        for (uint64_t m = junk; m; m &= m - 1)
+            validate_add(&v->bad_chars, v->char_at, v->max,
+                         base + off + __builtin_ctzll(m));
+
+        if (open && !(sym & 1)) {
+            if (!token_ok(tok_len, tok_bits, tok_junk))
+                validate_add(&v->bad_tokens, v->token_at, v->max, tok_at);
+            open = 0;
+        }
+        // Every run of symbols is a token, or the next piece of the open one.
+        while (sym) {
+            int s = __builtin_ctzll(sym);
+            uint64_t rest = ~sym >> s;
+            int e = rest ? s + __builtin_ctzll(rest) : VALIDATE_BLOCK;
+            uint64_t low = e - s < 64 ? (1ULL << (e - s)) - 1 : ~0ULL;
+
+            if (!open) {
+                tok_at = base + off + s;
+                tok_bits = tok_len = 0;
+                tok_junk = 0;
+            }
+            if (tok_len + (e - s) <= MORSE_TOKEN_MAX)
+                tok_bits |= (dash >> s & low) << tok_len;
+            tok_len += e - s;
+            tok_junk |= (junk >> s & low) != 0;
+            open = e == VALIDATE_BLOCK;
+            if (open)
+                break;
+            if (!token_ok(tok_len, tok_bits, tok_junk))
+                validate_add(&v->bad_tokens, v->token_at, v->max, tok_at);
+            sym &= ~0ULL << e;
+        }
+    }
+    if (open && !token_ok(tok_len, tok_bits, tok_junk))
+        validate_add(&v->bad_tokens, v->token_at, v->max, tok_at);
+}
+
+// Scan len bytes at offset base of an input, text with MORS_ENCO.
+void validate_buf(struct morse_validate *v, int mode, const char *in,
+                  size_t len, uint64_t base)
+{
+    validate_init();
+    if (mode == MORS_ENCO)
+        validate_text(v, in, len, base);
+    else
+        validate_morse(v, in, len, base);
+}
+
+static int is_gap(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/*
+ * Input that can not be mapped, a pipe or a compressed file, in pieces
+ * cut after white space so no letter, prosign or token is split between
+ * two of them.
+ */
+static int validate_stream(struct morse_validate *v, int mode,
+                           struct pipe_source *src)
+{
+    char *buf = malloc(VALIDATE_READ);
+    size_t have = 0, cut;
+    uint64_t base = 0;
+    ssize_t n;
+
+    if (!buf) {
+        perror("Error allocating validate buffer");
+        exit(EXIT_FAILURE);
+    }
+    do {
+        n = pipeline_read(src, buf + have, VALIDATE_READ - have);
+        if (n == -1) {
+            free(buf);
+            return -1;
+        }
+        have += n;
+        cut = have;
+        if (n && have == VALIDATE_READ) {
+            while (cut && !is_gap(buf[cut - 1]))
+                cut--;
+            if (!cut)
+                cut = mode == MORS_ENCO ? encode_boundary(buf, have) : have;
+        } else if (n)
+            continue;			// read more before cutting
+        validate_buf(v, mode, buf, cut, base);
+        base += cut;
+        memmove(buf, buf + cut, have - cut);
+        have -= cut;
+    } while (n);
+    free(buf);
+    return 0;
+}
+
+/*
+ * One input, "-" is stdin, decompressed unless raw.  Returns -1 with the
+ * reason in why when it can not be read.
+ */
+static int validate_file(struct morse_validate *v, int mode, const char *name,
+                         int raw, char *why, size_t len)
+{
+    struct pipe_source *src;
+    struct stat st;
+    char *map;
+    int fd, fmt = raw ? PIPE_PLAIN : PIPE_AUTO, ret = 0;
+
+    fd = strcmp(name, "-") ? open(name, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        snprintf(why, len, "%s", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    src = pipeline_open(fd, fd == STDIN_FILENO || !S_ISREG(st.st_mode), &fmt);
+    if (fd == STDIN_FILENO || !S_ISREG(st.st_mode) || fmt != PIPE_PLAIN) {
+        if ((ret = validate_stream(v, mode, src)))
+            pipeline_error(src, why, len);
+    } else if (st.st_size) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            snprintf(why, len, "%s", strerror(errno));
+            ret = -1;
+        } else {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            validate_buf(v, mode, map, st.st_size, 0);
+            munmap(map, st.st_size);
+        }
+    }
+    pipeline_close(src);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return ret;
+}
+
+struct validate_task {
+    const char *name;			// NULL for the -s message
+    int mode;
+    struct morse_validate v;
+    const char *message;
+    int raw;				// a batch file, not decompressed
+    char why[160];			// why it could not be read
+};
+
+static void validate_task(void *arg, int worker)
+{
+    struct validate_task *t = arg;
+
+    (void)worker;
+    if (!t->name)
+        validate_buf(&t->v, t->mode, t->message, strlen(t->message), 0);
+    else
+        validate_file(&t->v, t->mode, t->name, t->raw, t->why, sizeof(t->why));
+}
+
+static void validate_list(FILE *f, uint64_t count, const char *what,
+                          const char *why, const uint64_t *at, size_t max)
+{
+    fprintf(f, " %llu %s%s%s", (unsigned long long)count, what,
+            count == 1 ? "" : "s", why);
+    for (uint64_t i = 0; i < count && i < max; i++)
+        fprintf(f, "%s%llu", i ? ", " : " at ", (unsigned long long)at[i]);
+    if (count > max)
+        fprintf(f, ", ...");
+}
+
+static void validate_report(FILE *f, const struct validate_task *t)
+{
+    const struct morse_validate *v = &t->v;
+
+    fprintf(f, "%s:", t->name ? t->name : "-s");
+    if (*t->why)
+        fprintf(f, " %s", t->why);
+    else if (!v->bad_chars && !v->bad_tokens)
+        fprintf(f, " ok");
+    if (v->bad_chars)
+        validate_list(f, v->bad_chars, t->mode == MORS_ENCO ? "letter" : "stray byte",
+                      t->mode == MORS_ENCO ? " with no code" : "",
+                      v->char_at, v->max);
+    if (v->bad_chars && v->bad_tokens)
+        fprintf(f, ";");
+    if (v->bad_tokens)
+        validate_list(f, v->bad_tokens, "token", " with no letter",
+                      v->token_at, v->max);
+    fprintf(f, "\n");
+}
+
+/*
+ * Scan every input of the command line, on the pool when there are
+ * several, and report them in order.  Inputs without a problem are only
+ * reported when all is set.  Returns the number of bad inputs.
+ */
+static int validate_inputs(struct start_options *options, size_t max,
+                           FILE *f, int all)
+{
+    struct validate_task *tasks;
+    const char *single = options->filename;
+    int n = options->nfiles, bad = 0;
+
+    if (options->from_list) {
+        batch_read_list(options);
+        options->from_list = NULL;	// read, batch_run must not again
+        n = options->nfiles;
+    }
+    if (!n)
+        n = 1;
+    tasks = calloc(n, sizeof(*tasks));
+    if (!tasks) {
+        perror("Error allocating validate tasks");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        struct validate_task *t = &tasks[i];
+
+        t->name = options->nfiles ? options->files[i]
+                : options->message ? NULL : single;
+        t->message = options->message;
+        t->mode = options->mode;
+        t->raw = options->nfiles > 0;
+        t->v.max = max;
+        t->v.char_at = calloc(max, sizeof(*t->v.char_at));
+        t->v.token_at = calloc(max, sizeof(*t->v.token_at));
+        if ((max && (!t->v.char_at || !t->v.token_at))) {
+            perror("Error allocating validate tasks");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    validate_init();
+    if (n == 1)
+        validate_task(&tasks[0], 0);
+    else {
+        int nthreads = batch_threads(options);
+        struct pool *pool = pool_create(nthreads < n ? nthreads : n);
+
+        for (int i = 0; i < n; i++)
+            pool_submit(pool, validate_task, &tasks[i]);
+        pool_destroy(pool);
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct validate_task *t = &tasks[i];
+        int ok = !*t->why && !t->v.bad_chars && !t->v.bad_tokens;
+
+        bad += !ok;
+        if (all || !ok)
+            validate_report(f, t);
+        free(t->v.char_at);
+        free(t->v.token_at);
+    }
+    free(tasks);
+    return bad;
+}
+
+// --validate[=N], report and exit 1 when any input is bad.
+void validate_run(struct start_options *options)
+{
+    if (validate_inputs(options, options->validate, stdout, 1)) {
+        fflush(stdout);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// --strict, refuse to convert anything when an input is bad.
+void validate_strict(struct start_options *options)
+{
+    int bad;
+
+    if (!options->message && !options->nfiles && !options->from_list
+        && options->filename && !strcmp(options->filename, "-")) {
+        fprintf(stderr, "Error: --strict can not scan stdin ahead, use --validate\n");
+        exit(EXIT_FAILURE);
+    }
+    bad = validate_inputs(options, MORSE_VALIDATE_FIRST, stderr, 0);
+    if (bad) {
+        fprintf(stderr, "%d input%s refused, nothing converted\n", bad,
+                bad == 1 ? "" : "s");
+        exit(EXIT_FAILURE);
+    }
+}
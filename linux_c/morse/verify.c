@@ -0,0 +1,329 @@
+/*
+ * morse, it will display text files via Morse Code
+ *
+ * Copyright (C) 2019  David I. S. Mandala
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * David I. S. Mandala davidm@them.com
+ * 120 E. FM 544
+ * Suite 72, BX 107
+ * Murphy, TX 75094
+ *
+ */
+
+/*
+ * Round trip verification, morse --verify [-a alphabet] file... | -s msg
+ *
+ * Every input is mapped and cut into VERIFY_CHUNK sized chunks at white
+ * space, the chunks are encoded and decoded again in memory on the pool
+ * and the decoded text is compared with the input as a lossless round
+ * trip would give it back:
+ *
+ *   - letters case folded the way the alphabet sends them (upper case,
+ *     final forms, kana), prosigns as written
+ *   - any run of white space or letters without a code as one space,
+ *     none at the start or end of a chunk
+ *
+ * Letters without a code are counted as unencodable, letters that come
+ * back as something else (two letters sharing a code) are mismatches and
+ * the first VERIFY_REPORT of them are listed with their byte offset.  The
+ * exit status is a failure when there is any mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "morse.h"
+
+#define VERIFY_CHUNK (1 << 20)
+#define VERIFY_REPORT 10
+#define VERIFY_CUT_BACK 256		// how far back to look for white space
+
+struct verify_mismatch {
+    size_t offset;			// in the input
+    char expected[8], got[8];		// UTF-8
+};
+
+struct verify_chunk {
+    const char *in;
+    size_t len, offset;
+    // results
+    size_t letters, unencodable, mismatches;
+    struct verify_mismatch first[VERIFY_REPORT];
+};
+
+struct verify_worker {
+    char *morse, *text;
+};
+
+static struct verify_worker *workers;
+
+static void *verify_alloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p) {
+        perror("Error allocating verify buffers");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void note_mismatch(struct verify_chunk *c, size_t offset,
+                          const char *exp, size_t nexp,
+                          const char *got, size_t ngot)
+{
+    if (c->mismatches < VERIFY_REPORT) {
+        struct verify_mismatch *m = &c->first[c->mismatches];
+
+        m->offset = c->offset + offset;
+        snprintf(m->expected, sizeof(m->expected), "%.*s", (int)nexp, exp);
+        snprintf(m->got, sizeof(m->got), "%.*s", (int)ngot, got);
+    }
+    c->mismatches++;
+}
+
+// Length of the decoded letter at p, one byte for anything not UTF-8.
+static size_t out_letter(const char *p, size_t len)
+{
+    uint32_t cp;
+    size_t n = len ? utf8_decode((const unsigned char *)p, len, &cp) : 0;
+
+    return n ? n : len ? 1 : 0;
+}
+
+/*
+ * The letter at in[i] as a round trip gives it back into exp, returns the
+ * input bytes it covers and 0 in *nexp for white space or no code.
+ */
+static size_t expected_letter(const char *in, size_t len, size_t i,
+                              char *exp, size_t *nexp, int *unencodable)
+{
+    unsigned char c = in[i];
+    uint32_t cp, canon[2];
+    size_t n;
+    int k;
+
+    *nexp = 0;
+    *unencodable = 0;
+    if (c == '<' && morse_nprosigns) {
+        for (size_t p = 0; p < morse_nprosigns; p++) {
+            struct morse_prosign *ps = &morse_prosigns[p];
+
+            if (i + ps->len + 2 <= len && in[i + ps->len + 1] == '>'
+                && !memcmp(in + i + 1, ps->name, ps->len)) {
+                memcpy(exp, in + i, ps->len + 2);
+                *nexp = ps->len + 2;
+                return ps->len + 2;
+            }
+        }
+    }
+    if (c < 0x80) {
+        const char *code = morse_lookup(c);
+
+        if (*code && *code != ' ')
+            exp[(*nexp)++] = toupper(c);
+        else
+            *unencodable = !*code && !isspace(c);
+        return 1;
+    }
+
+    n = utf8_decode((const unsigned char *)in + i, len - i, &cp);
+    if (!n || !(k = alphabet_canonical(cp, canon))) {
+        *unencodable = 1;
+        return n ? n : 1;
+    }
+    for (int j = 0; j < k; j++)
+        *nexp += utf8_encode(canon[j], exp + *nexp);
+    return n;
+}
+
+static void verify_task(void *arg, int worker)
+{
+    struct verify_chunk *c = arg;
+    struct verify_worker *w = &workers[worker];
+    size_t nmorse, ntext, j = 0;
+    int started = 0, gap = 0;
+
+    nmorse = morse_encode_buf(c->in, c->len, w->morse);
+    ntext = morse_decode_buf(w->morse, nmorse, w->text);
+
+    for (size_t i = 0, n; i < c->len; i += n) {
+        char exp[2 * 4 + MORSE_TOKEN_MAX + 2];
+        size_t nexp, ngot;
+        int unencodable;
+
+        n = expected_letter(c->in, c->len, i, exp, &nexp, &unencodable);
+        c->unencodable += unencodable;
+        if (!nexp) {
+            gap = started;
+            continue;
+        }
+        if (gap) {
+            if (j < ntext && w->text[j] == ' ')
+                j++;
+            else
+                note_mismatch(c, i, " ", 1, w->text + j, out_letter(w->text + j, ntext - j));
+            gap = 0;
+        }
+        started = 1;
+        c->letters++;
+
+        if (j + nexp <= ntext && !memcmp(w->text + j, exp, nexp)) {
+            j += nexp;
+            continue;
+        }
+        // Resynchronise on the letter that came back instead.
+        ngot = out_letter(w->text + j, ntext - j);
+        note_mismatch(c, i, exp, nexp, w->text + j, ngot);
+        j += ngot;
+    }
+    if (j < ntext)
+        note_mismatch(c, c->len, "", 0, w->text + j, out_letter(w->text + j, ntext - j));
+}
+
+// Chunk ends at white space where there is some close by.
+static size_t chunk_end(const char *in, size_t len, size_t off)
+{
+    size_t end = off + VERIFY_CHUNK;
+
+    if (end >= len)
+        return len;
+    for (size_t k = end; k > end - VERIFY_CUT_BACK; k--)
+        if (isspace((unsigned char)in[k - 1]))
+            return k;
+    return off + encode_boundary(in + off, VERIFY_CHUNK);
+}
+
+static int cmp_offset(const void *a, const void *b)
+{
+    const struct verify_mismatch *x = a, *y = b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Verify one input, returns its number of mismatches.
+static size_t verify_input(struct pool *pool, const char *name,
+                           const char *in, size_t len)
+{
+    size_t nchunks = len / (VERIFY_CHUNK - VERIFY_CUT_BACK) + 1, n = 0, k = 0;
+    struct verify_chunk *chunks = calloc(nchunks, sizeof(*chunks));
+    struct verify_mismatch first[VERIFY_REPORT * 4];
+    size_t letters = 0, unencodable = 0, mismatches = 0;
+
+    if (!chunks) {
+        perror("Error allocating verify chunks");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t off = 0, end; off < len; off = end) {
+        end = chunk_end(in, len, off);
+        chunks[n].in = in + off;
+        chunks[n].len = end - off;
+        chunks[n].offset = off;
+        pool_submit(pool, verify_task, &chunks[n]);
+        n++;
+    }
+    pool_wait(pool);
+
+    // Chunks are in input order, so are the mismatches within each.
+    for (size_t i = 0; i < n; i++) {
+        struct verify_chunk *c = &chunks[i];
+        size_t listed = c->mismatches < VERIFY_REPORT ? c->mismatches : VERIFY_REPORT;
+
+        letters += c->letters;
+        unencodable += c->unencodable;
+        mismatches += c->mismatches;
+        for (size_t m = 0; m < listed && k < VERIFY_REPORT; m++)
+            first[k++] = c->first[m];
+    }
+    qsort(first, k, sizeof(*first), cmp_offset);
+
+    printf("%s: %zu bytes, %zu letters, %zu unencodable, %zu mismatches\n",
+           name, len, letters, unencodable, mismatches);
+    for (size_t m = 0; m < k; m++)
+        printf("  byte %zu: expected \"%s\" got \"%s\"\n", first[m].offset,
+               first[m].expected, first[m].got);
+    free(chunks);
+    return mismatches;
+}
+
+void verify_run(struct start_options *options)
+{
+    int nthreads = batch_threads(options);
+    char *single[1] = { options->filename };
+    char **files = options->nfiles ? options->files : single;
+    int nfiles = options->nfiles ? options->nfiles : 1;
+    size_t failed = 0;
+    struct pool *pool;
+
+    hmorse_init();
+    workers = calloc(nthreads, sizeof(*workers));
+    if (!workers) {
+        perror("Error allocating verify buffers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].morse = verify_alloc(MORSE_ENCODE_BOUND(VERIFY_CHUNK));
+        workers[i].text = verify_alloc(MORSE_DECODE_BOUND(MORSE_ENCODE_BOUND(VERIFY_CHUNK)));
+    }
+    pool = pool_create(nthreads);
+
+    if (options->message)
+        failed += verify_input(pool, "message", options->message,
+                               strlen(options->message)) != 0;
+    if (!options->message || options->filename || options->nfiles)
+        for (int i = 0; i < nfiles; i++) {
+            struct stat st;
+            char *map;
+            int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+
+            if (fd == -1 || fstat(fd, &st) == -1) {
+                perror(files[i]);
+                failed++;
+                if (fd != -1)
+                    close(fd);
+                continue;
+            }
+            if (st.st_size == 0) {
+                failed += verify_input(pool, files[i], "", 0) != 0;
+                close(fd);
+                continue;
+            }
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED) {
+                perror(files[i]);
+                failed++;
+                continue;
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            failed += verify_input(pool, files[i], map, st.st_size) != 0;
+            munmap(map, st.st_size);
+        }
+
+    pool_destroy(pool);
+    for (int i = 0; i < nthreads; i++) {
+        free(workers[i].morse);
+        free(workers[i].text);
+    }
+    free(workers);
+    if (failed)
+        exit(EXIT_FAILURE);
+}